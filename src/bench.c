@@ -0,0 +1,182 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Adam Simpson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Times the substeps of a single rank with and without the pair geometry cache
+// Built by the bench make target, run as bench.out [particles] [substeps] [threads] [substeps per rebuild]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mpi.h"
+#include "hash.h"
+#include "fluid.h"
+#include "communication.h"
+#include "geometry.h"
+#include "simd.h"
+#include "threads.h"
+
+// Run substeps as the simulation loop does, gravity, viscosity, prediction, density and relaxation,
+// rebuilding the neighbor lists every substeps_per_rebuild substeps and recomputing the densities from them otherwise
+// Every substep starts from the same particles so each configuration times the same work
+// Returns the time per substep in seconds
+double time_substeps(fluid_particles_t *particles, fluid_particles_t *initial, AABB_t *boundary, float width,
+                     int substeps, int substeps_per_rebuild, bool cache_geometry, param *params)
+{
+    int i;
+    int n = params->number_fluid_particles_local;
+    double elapsed = 0.0;
+    neighbor_grid_t grid;
+
+    // Grid and lists as start_simulation() sets them up, per particle arrays are grown by the first hash
+    memset(&grid, 0, sizeof(neighbor_grid_t));
+    grid.spacing = params->tunable_params.smoothing_radius + params->skin;
+    grid.force_rebuild = true;
+    grid.domain_size_x = ceil(width / grid.spacing);
+    grid.domain_size_y = ceil(width / grid.spacing);
+    place_grid(&grid, params);
+    alloc_neighbor_list(&grid.fluid_neighbors, n, cache_geometry);
+    alloc_neighbor_list(&grid.halo_neighbors, n, cache_geometry);
+    alloc_neighbor_list(&grid.mirror_neighbors, n, cache_geometry);
+    alloc_build_blocks(&grid, thread_pool.number_blocks, cache_geometry);
+
+    // The first substep is not timed
+    for(i=-1; i<substeps; i++) {
+        memcpy(particles->x, initial->x, n*sizeof(float));
+        memcpy(particles->y, initial->y, n*sizeof(float));
+        memcpy(particles->v_x, initial->v_x, n*sizeof(float));
+        memcpy(particles->v_y, initial->v_y, n*sizeof(float));
+
+        double start = MPI_Wtime();
+        apply_gravity(particles, params);
+        viscosity_impluses(particles, &grid, params);
+        predict_positions(particles, boundary, params);
+        if(i < 0 || i % substeps_per_rebuild == 0)
+            hash_fluid(particles, &grid, params, true, CELLS_ALL);
+        else
+            compute_cell_densities(particles, &grid, params, CELLS_ALL);
+        double_density_relaxation(particles, &grid, params);
+        if(i >= 0)
+            elapsed += MPI_Wtime() - start;
+    }
+
+    free_build_blocks(&grid);
+    free_neighbor_list(&grid.fluid_neighbors);
+    free_neighbor_list(&grid.halo_neighbors);
+    free_neighbor_list(&grid.mirror_neighbors);
+    free(grid.cell_starts);
+    free(grid.cell_counts);
+    free(grid.cell_particles);
+    free(grid.particle_cells);
+    free(grid.build_x);
+    free(grid.build_y);
+    free(grid.candidates);
+
+    return elapsed/substeps;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, n;
+
+    MPI_Init(&argc, &argv);
+    MPI_COMM_COMPUTE = MPI_COMM_WORLD;
+
+    int number_particles = argc > 1 ? atoi(argv[1]) : 2000;
+    int substeps = argc > 2 ? atoi(argv[2]) : 1000;
+    int threads = argc > 3 ? atoi(argv[3]) : default_thread_count();
+    int substeps_per_rebuild = argc > 4 ? atoi(argv[4]) : 4;
+
+    init_simd_kernels();
+    init_thread_pool(threads);
+
+    // Square block of particles at the simulations spacing, jittered so pair distances vary
+    int number_particles_x = ceil(sqrt(number_particles));
+    number_particles = number_particles_x * number_particles_x;
+    float spacing_particle = 0.29f;
+    float width = (number_particles_x + 2) * spacing_particle;
+
+    // Parameters as start_simulation() sets them, the mover is placed outside the block
+    param params;
+    memset(&params, 0, sizeof(param));
+    params.tunable_params.smoothing_radius = 2.0f*spacing_particle;
+    params.tunable_params.g = 6.0f;
+    params.tunable_params.time_step = 1.0f/120.0f;
+    params.tunable_params.k = 0.2f;
+    params.tunable_params.k_near = 6.0f;
+    params.tunable_params.sigma = 5.0f;
+    params.tunable_params.beta = 0.5f;
+    params.tunable_params.rest_density = 30.0f;
+    params.tunable_params.mover_type = SPHERE_MOVER;
+    params.tunable_params.mover_center_x = -width;
+    params.tunable_params.mover_center_y = -width;
+    params.tunable_params.node_start_x = 0.0f;
+    params.tunable_params.node_end_x = width;
+    params.tunable_params.node_start_y = 0.0f;
+    params.tunable_params.node_end_y = width;
+    params.skin = 0.25f*params.tunable_params.smoothing_radius;
+    params.number_fluid_particles_global = number_particles;
+    params.number_fluid_particles_local = number_particles;
+    params.partitions_x = 1;
+    params.partitions_y = 1;
+    for(n=0; n<NUMBER_NEIGHBORS; n++)
+        params.neighbor_ranks[n] = MPI_PROC_NULL;
+
+    AABB_t boundary;
+    memset(&boundary, 0, sizeof(AABB_t));
+    boundary.max_x = width;
+    boundary.max_y = width;
+
+    fluid_particles_t particles, initial;
+    alloc_fluid_particles(&particles, number_particles);
+    alloc_fluid_particles(&initial, number_particles);
+    srand(1);
+    for(i=0; i<number_particles; i++) {
+        initial.x[i] = (1 + i%number_particles_x + 0.2f*rand()/RAND_MAX) * spacing_particle;
+        initial.y[i] = (1 + i/number_particles_x + 0.2f*rand()/RAND_MAX) * spacing_particle;
+        initial.v_x[i] = 0.1f*rand()/RAND_MAX;
+        initial.v_y[i] = 0.1f*rand()/RAND_MAX;
+    }
+
+    printf("particles: %d threads: %d substeps: %d substeps per rebuild: %d\n", number_particles,
+           thread_pool.number_threads, substeps, substeps_per_rebuild);
+
+    // The cache is only read by relaxation with relax_cached_geometry, viscosity follows relaxation so always recomputes the geometry
+    double live = time_substeps(&particles, &initial, &boundary, width, substeps, substeps_per_rebuild, false, &params);
+    double cached = time_substeps(&particles, &initial, &boundary, width, substeps, substeps_per_rebuild, true, &params);
+    params.relax_cached_geometry = true;
+    double relax_cached = time_substeps(&particles, &initial, &boundary, width, substeps, substeps_per_rebuild, true, &params);
+
+    printf("live geometry: %f us per substep\n", 1.0e6*live);
+    printf("cached geometry: %f us per substep\n", 1.0e6*cached);
+    printf("cached geometry read by relaxation: %f us per substep\n", 1.0e6*relax_cached);
+
+    free_fluid_particles(&particles);
+    free_fluid_particles(&initial);
+    free_thread_pool();
+
+    MPI_Finalize();
+    return 0;
+}
@@ -27,6 +27,9 @@ THE SOFTWARE.
 #include "communication.h"
 #include "fluid.h"
 #include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 
 // Rank 0 is the render node, the rest are compute nodes
 // This will create appropriate MPI communicators
@@ -46,6 +49,168 @@ void create_communicators()
     // Create communicator from group_compute
     MPI_Comm_create(MPI_COMM_WORLD, group_compute, &MPI_COMM_COMPUTE);
 
+    // Count the non-compute ranks sharing each host so compute ranks leave them a core
+    int rank, noncompute;
+    MPI_Comm host_comm;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    noncompute = rank == 0;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &host_comm);
+    MPI_Allreduce(&noncompute, &host_noncompute_ranks, 1, MPI_INT, MPI_SUM, host_comm);
+    MPI_Comm_free(&host_comm);
+
+    // All compute ranks start awake
+    int nprocs;
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_COMM_AWAKE = MPI_COMM_NULL;
+    split_awake_ranks(nprocs-1);
+}
+
+// Arrange the compute ranks in a Cartesian grid with partitions_y rows, 0 lets MPI_Dims_create choose the rows
+// Ranks are not reordered so the render node can index them by column and row
+// The compute communicator is replaced by the Cartesian communicator
+void create_compute_grid(int partitions_y, param *params)
+{
+    int rank, nprocs;
+    int dims[2];
+    int periods[2] = {0, 0};
+    int coords[2];
+    MPI_Comm grid_comm;
+
+    MPI_Comm_size(MPI_COMM_COMPUTE, &nprocs);
+
+    if(partitions_y < 0 || (partitions_y && nprocs % partitions_y)) {
+        printf("Could not divide %d compute ranks into %d rows, using 1\n", nprocs, partitions_y);
+        partitions_y = 1;
+    }
+    dims[0] = 0;
+    dims[1] = partitions_y;
+    MPI_Dims_create(nprocs, 2, dims);
+
+    MPI_Cart_create(MPI_COMM_COMPUTE, 2, dims, periods, 0, &grid_comm);
+    MPI_Comm_free(&MPI_COMM_COMPUTE);
+    MPI_COMM_COMPUTE = grid_comm;
+    MPI_Comm_dup(MPI_COMM_COMPUTE, &MPI_COMM_COMPUTE_AWAKE);
+
+    MPI_Comm_rank(MPI_COMM_COMPUTE, &rank);
+    MPI_Cart_coords(MPI_COMM_COMPUTE, rank, 2, coords);
+    params->partitions_x = dims[0];
+    params->partitions_y = dims[1];
+    params->partition_x = coords[0];
+    params->partition_y = coords[1];
+
+    // Columns share x bounds and rows share y bounds
+    int column_dims[2] = {0, 1};
+    int row_dims[2] = {1, 0};
+    MPI_Cart_sub(MPI_COMM_COMPUTE, column_dims, &params->column_comm);
+    MPI_Cart_sub(MPI_COMM_COMPUTE, row_dims, &params->row_comm);
+
+    set_neighbor_ranks(params, nprocs);
+}
+
+// Neighbors beyond the edge of the grid or parked are MPI_PROC_NULL so messages to them are skipped
+// A parked rank has no neighbors
+void set_neighbor_ranks(param *params, int awake_ranks)
+{
+    int d, rank, offset_x, offset_y;
+    int coords[2];
+
+    MPI_Comm_rank(MPI_COMM_COMPUTE, &rank);
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        neighbor_offset(d, &offset_x, &offset_y);
+        coords[0] = params->partition_x + offset_x;
+        coords[1] = params->partition_y + offset_y;
+        if(rank >= awake_ranks || coords[0] < 0 || coords[0] >= params->partitions_x || coords[1] < 0 || coords[1] >= params->partitions_y)
+            params->neighbor_ranks[d] = MPI_PROC_NULL;
+        else {
+            MPI_Cart_rank(MPI_COMM_COMPUTE, coords, &params->neighbor_ranks[d]);
+            if(params->neighbor_ranks[d] >= awake_ranks)
+                params->neighbor_ranks[d] = MPI_PROC_NULL;
+        }
+    }
+}
+
+// Split the render node and the first awake_ranks compute ranks into MPI_COMM_AWAKE, parked ranks get MPI_COMM_NULL
+// Must be called by every rank, parked or not, each time the number of awake ranks changes
+void split_awake_ranks(int awake_ranks)
+{
+    int rank;
+
+    if(MPI_COMM_AWAKE != MPI_COMM_NULL)
+        MPI_Comm_free(&MPI_COMM_AWAKE);
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_split(MPI_COMM_WORLD, rank <= awake_ranks ? 0 : MPI_UNDEFINED, rank, &MPI_COMM_AWAKE);
+}
+
+// Park or wake compute ranks, only the first awake_ranks compute ranks take part in each frame
+// Halos are only exchanged between awake ranks so the neighbors and shared halos are recreated, the edges must be rebuilt
+// Ranks are only parked or woken without particles so nothing is exchanged with a changed neighbor until the rebuild
+// Must be called by every compute rank along with split_awake_ranks() on the render node
+void update_awake_ranks(param *params, edge_t *edges, int awake_ranks, bool shared_halos)
+{
+    int d, rank;
+    int previous_ranks[NUMBER_NEIGHBORS];
+
+    split_awake_ranks(awake_ranks);
+
+    free_shared_halos(edges);
+    if(MPI_COMM_COMPUTE_AWAKE != MPI_COMM_NULL)
+        MPI_Comm_free(&MPI_COMM_COMPUTE_AWAKE);
+    MPI_Comm_rank(MPI_COMM_COMPUTE, &rank);
+    MPI_Comm_split(MPI_COMM_COMPUTE, rank < awake_ranks ? 0 : MPI_UNDEFINED, rank, &MPI_COMM_COMPUTE_AWAKE);
+
+    memcpy(previous_ranks, params->neighbor_ranks, sizeof(previous_ranks));
+    set_neighbor_ranks(params, awake_ranks);
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        if(params->neighbor_ranks[d] != previous_ranks[d]) {
+            edges->number_edge_particles[d] = 0;
+            edges->number_halo_particles[d] = 0;
+        }
+    }
+
+    if(shared_halos && MPI_COMM_COMPUTE_AWAKE != MPI_COMM_NULL)
+        init_shared_halos(edges, params);
+
+    // The rebuild returns displacements before the edges are reselected so its requests must already use the new neighbors
+    init_halo_requests(edges, params);
+}
+
+// Wait for the render node to send this parked rank new parameters
+// The receive is polled with a sleep in between so a parked rank leaves its core idle
+void park_rank(param *params)
+{
+    int received = 0;
+    MPI_Request req;
+    struct timespec interval = {0, PARK_INTERVAL*1000};
+
+    MPI_Irecv(&params->tunable_params, 1, TunableParamtype, 0, PARK_TAG, MPI_COMM_WORLD, &req);
+    while(1) {
+        MPI_Test(&req, &received, MPI_STATUS_IGNORE);
+        if(received)
+            break;
+        nanosleep(&interval, NULL);
+    }
+}
+
+// Direction of the neighbor offset_x columns and offset_y rows away, each offset is -1, 0 or 1
+int neighbor_direction(int offset_x, int offset_y)
+{
+    static const int directions[3][3] = {{NEIGHBOR_DOWN_LEFT, NEIGHBOR_LEFT, NEIGHBOR_UP_LEFT},
+                                         {NEIGHBOR_DOWN, -1, NEIGHBOR_UP},
+                                         {NEIGHBOR_DOWN_RIGHT, NEIGHBOR_RIGHT, NEIGHBOR_UP_RIGHT}};
+
+    return directions[offset_x+1][offset_y+1];
+}
+
+// Column and row offset of the neighbor in a direction
+void neighbor_offset(int direction, int *offset_x, int *offset_y)
+{
+    static const int offsets_x[NUMBER_NEIGHBORS] = {-1, 1, 0, 0, -1, 1, 1, -1};
+    static const int offsets_y[NUMBER_NEIGHBORS] = {0, 0, -1, 1, -1, 1, -1, 1};
+
+    *offset_x = offsets_x[direction];
+    *offset_y = offsets_y[direction];
 }
 
 void createMpiTypes()
@@ -56,9 +221,8 @@ void createMpiTypes()
     int i; 
 
     // Create fluid particle type;
-    for (i=0; i<12; i++) types[i] = MPI_FLOAT;
-    types[12] = MPI_INT;
-    for (i=0; i<13; i++) blocklens[i] = 1;
+    for (i=0; i<10; i++) types[i] = MPI_FLOAT;
+    for (i=0; i<10; i++) blocklens[i] = 1;
     // Get displacement of each struct member
     disps[0] = offsetof( fluid_particle, x_prev);
     disps[1] = offsetof( fluid_particle, y_prev);
@@ -66,23 +230,27 @@ void createMpiTypes()
     disps[3] = offsetof( fluid_particle, y);
     disps[4] = offsetof( fluid_particle, v_x);
     disps[5] = offsetof( fluid_particle, v_y);
-    disps[6] = offsetof( fluid_particle, a_x);
-    disps[7] = offsetof( fluid_particle, a_y);
-    disps[8] = offsetof( fluid_particle, density);
-    disps[9] = offsetof( fluid_particle, density_near);
-    disps[10] = offsetof( fluid_particle, pressure);
-    disps[11] = offsetof( fluid_particle, pressure_near);
-    disps[12] = offsetof( fluid_particle, id);
+    disps[6] = offsetof( fluid_particle, density);
+    disps[7] = offsetof( fluid_particle, density_near);
+    disps[8] = offsetof( fluid_particle, pressure);
+    disps[9] = offsetof( fluid_particle, pressure_near);
     // Commit type
-    MPI_Type_create_struct( 13, blocklens, disps, types, &Particletype );
+    MPI_Type_create_struct( 10, blocklens, disps, types, &Particletype );
     MPI_Type_commit( &Particletype );
 
+    // Create halo record types
+    for (i=0; i<NUMBER_HALO_RECORDS; i++) {
+        MPI_Type_contiguous( halo_record_fields(i), MPI_FLOAT, &HaloRecordtypes[i] );
+        MPI_Type_commit( &HaloRecordtypes[i] );
+    }
+
     // Create param type
-    for(i=0; i<15; i++) types[i] = MPI_FLOAT;
-    types[15] = MPI_CHAR;
-    types[16] = MPI_CHAR;
+    for(i=0; i<17; i++) types[i] = MPI_FLOAT;
     types[17] = MPI_CHAR;
-    for (i=0; i<18; i++) blocklens[i] = 1;
+    types[18] = MPI_CHAR;
+    types[19] = MPI_CHAR;
+    types[20] = MPI_INT;
+    for (i=0; i<21; i++) blocklens[i] = 1;
     // Get displacement of each struct member
     disps[0] = offsetof( tunable_parameters, rest_density );
     disps[1] = offsetof( tunable_parameters, smoothing_radius );
@@ -95,357 +263,1183 @@ void createMpiTypes()
     disps[8] = offsetof( tunable_parameters, time_step );
     disps[9] = offsetof( tunable_parameters, node_start_x );
     disps[10] = offsetof( tunable_parameters, node_end_x );
-    disps[11] = offsetof( tunable_parameters, mover_center_x );
-    disps[12] = offsetof( tunable_parameters, mover_center_y );
-    disps[13] = offsetof( tunable_parameters, mover_width );
-    disps[14] = offsetof( tunable_parameters, mover_height );
-    disps[15] = offsetof( tunable_parameters, mover_type );
-    disps[16] = offsetof( tunable_parameters, kill_sim );
-    disps[17] = offsetof( tunable_parameters, active );
+    disps[11] = offsetof( tunable_parameters, node_start_y );
+    disps[12] = offsetof( tunable_parameters, node_end_y );
+    disps[13] = offsetof( tunable_parameters, mover_center_x );
+    disps[14] = offsetof( tunable_parameters, mover_center_y );
+    disps[15] = offsetof( tunable_parameters, mover_width );
+    disps[16] = offsetof( tunable_parameters, mover_height );
+    disps[17] = offsetof( tunable_parameters, mover_type );
+    disps[18] = offsetof( tunable_parameters, kill_sim );
+    disps[19] = offsetof( tunable_parameters, active );
+    disps[20] = offsetof( tunable_parameters, awake_ranks );
 
     // Commit type
-    MPI_Type_create_struct( 18, blocklens, disps, types, &TunableParamtype );
+    MPI_Type_create_struct( 21, blocklens, disps, types, &TunableParamtype );
     MPI_Type_commit( &TunableParamtype );
 }
 
 void freeMpiTypes()
 {
+    int i;
+
     MPI_Type_free(&Particletype);
+    for (i=0; i<NUMBER_HALO_RECORDS; i++)
+        MPI_Type_free(&HaloRecordtypes[i]);
     MPI_Type_free(&TunableParamtype);
 
     MPI_Group_free(&group_world);
     MPI_Group_free(&group_compute);
 }
 
-void startHaloExchange(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles,  edge_t *edges, param *params)
+// Pack particle i of the particle arrays into an MPI particle record
+void pack_particle(fluid_particles_t *particles, int i, fluid_particle *record)
 {
-    int i;
-    fluid_particle *p;
-    float h = params->tunable_params.smoothing_radius;
+    record->x_prev = particles->x_prev[i];
+    record->y_prev = particles->y_prev[i];
+    record->x = particles->x[i];
+    record->y = particles->y[i];
+    record->v_x = particles->v_x[i];
+    record->v_y = particles->v_y[i];
+    record->density = particles->density[i];
+    record->density_near = particles->density_near[i];
+    record->pressure = particles->pressure[i];
+    record->pressure_near = particles->pressure_near[i];
+}
 
-    int rank;
-    MPI_Comm_rank(MPI_COMM_COMPUTE, &rank);
-    int nprocs;
-    MPI_Comm_size(MPI_COMM_COMPUTE, &nprocs);
+// Unpack an MPI particle record into particle i of the particle arrays
+void unpack_particle(fluid_particle *record, fluid_particles_t *particles, int i)
+{
+    particles->x_prev[i] = record->x_prev;
+    particles->y_prev[i] = record->y_prev;
+    particles->x[i] = record->x;
+    particles->y[i] = record->y;
+    particles->v_x[i] = record->v_x;
+    particles->v_y[i] = record->v_y;
+    particles->density[i] = record->density;
+    particles->density_near[i] = record->density_near;
+    particles->pressure[i] = record->pressure;
+    particles->pressure_near[i] = record->pressure_near;
+}
 
-    // Set edge particle indicies and update number
-    edges->number_edge_particles_left = 0;
-    edges->number_edge_particles_right = 0;
-    for(i=0; i<params->number_fluid_particles_local; i++)
-    {
-        p = fluid_particle_pointers[i];
-        if (p->x - params->tunable_params.node_start_x <= h)
-            edges->edge_pointers_left[edges->number_edge_particles_left++] = p;
-        else if (params->tunable_params.node_end_x - p->x <= h)
-            edges->edge_pointers_right[edges->number_edge_particles_right++] = p;
+// Number of floats in a halo record
+int halo_record_fields(int record)
+{
+    return record == HALO_DENSITY ? 6 : 4;
+}
+
+// Pack the fields of particle i used by a halo record layout
+void pack_halo_particle(fluid_particles_t *particles, int i, float *record, int layout)
+{
+    record[0] = particles->x[i];
+    record[1] = particles->y[i];
+    record[2] = particles->v_x[i];
+    record[3] = particles->v_y[i];
+    if(layout == HALO_DENSITY) {
+        record[4] = particles->density[i];
+        record[5] = particles->density_near[i];
     }
+}
 
-    int num_moving_left = edges->number_edge_particles_left;
-    int num_moving_right = edges->number_edge_particles_right;
+// Unpack a halo record into halo particle i
+// Fields not in the layout keep the values from the last exchange that carried them
+void unpack_halo_particle(float *record, fluid_particles_t *particles, int i, int layout)
+{
+    particles->x[i] = record[0];
+    particles->y[i] = record[1];
+    particles->v_x[i] = record[2];
+    particles->v_y[i] = record[3];
+    if(layout == HALO_DENSITY) {
+        particles->density[i] = record[4];
+        particles->density_near[i] = record[5];
+    }
+}
 
-    // Setup nodes to left and right of self
-    int proc_to_left =  (rank == 0 ? MPI_PROC_NULL : rank-1);
-    int proc_to_right = (rank == nprocs-1 ? MPI_PROC_NULL : rank+1);
+// Packed halo buffers start empty and are grown as edges are selected
+void alloc_halo_buffers(edge_t *edges)
+{
+    int i, d;
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        edges->number_edge_particles[d] = 0;
+        edges->send_buffers[d] = NULL;
+        edges->recv_buffers[d] = NULL;
+        edges->max_send[d] = 0;
+        edges->max_recv[d] = 0;
+        edges->number_halo_particles[d] = 0;
+    }
+    edges->record = HALO_DENSITY;
+    for(i=0; i<NUMBER_HALO_RECORDS; i++) {
+        for(d=0; d<2*NUMBER_NEIGHBORS; d++)
+            edges->reqs[i][d] = MPI_REQUEST_NULL;
+    }
 
-    debug_print("rank %d, halo: will send %d to left, %d to right\n", rank, num_moving_left, num_moving_right);
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        edges->return_buffers[d] = NULL;
+        edges->max_return[d] = 0;
+        edges->return_reqs[d] = MPI_REQUEST_NULL;
+    }
 
-    // Get number of halo particles from right and left
-    int num_from_left = 0;
-    int num_from_right = 0;
-    int tag = 3217;
+    // Halos are exchanged by messages until init_shared_halos() is called
+    edges->number_pairs = 0;
+    edges->parity = 0;
+    edges->returned_displacement = 0.0f;
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        edges->pair_comms[d] = MPI_COMM_NULL;
+        edges->windows[d] = MPI_WIN_NULL;
+        edges->segments[d] = NULL;
+        edges->neighbor_segments[d] = NULL;
+        edges->max_shared_particles[d] = 0;
+        edges->shared[d] = false;
+    }
+}
 
-    // Send number to right and receive from left
-    MPI_Sendrecv(&num_moving_right, 1, MPI_INT, proc_to_right, tag, &num_from_left,1,MPI_INT,proc_to_left,tag,MPI_COMM_COMPUTE, MPI_STATUS_IGNORE);
-    // Send number to left and receive from right
-    tag = 8425;
-    MPI_Sendrecv(&num_moving_left, 1, MPI_INT, proc_to_left, tag, &num_from_right,1,MPI_INT,proc_to_right,tag,MPI_COMM_COMPUTE, MPI_STATUS_IGNORE);
+void free_halo_buffers(edge_t *edges)
+{
+    int i, d;
 
-    debug_print("rank %d, halo: will recv %d from left, %d from right\n", rank, num_from_left, num_from_right);
+    for(i=0; i<NUMBER_HALO_RECORDS; i++) {
+        for(d=0; d<2*NUMBER_NEIGHBORS; d++) {
+            if(edges->reqs[i][d] != MPI_REQUEST_NULL)
+                MPI_Request_free(&edges->reqs[i][d]);
+        }
+    }
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        if(edges->return_reqs[d] != MPI_REQUEST_NULL)
+            MPI_Request_free(&edges->return_reqs[d]);
+        free(edges->send_buffers[d]);
+        free(edges->recv_buffers[d]);
+        free(edges->return_buffers[d]);
+    }
+    free_shared_halos(edges);
+}
 
+// Allocate a shared memory window with each neighbor on this host
+// Neighbors on this host read halo records from the window, neighbors on other hosts are still sent messages
+// Must be called by all awake compute ranks after the edges are allocated
+// Returns the number of bytes allocated
+size_t init_shared_halos(edge_t *edges, param *params)
+{
+    int d, n, node_rank, node_size;
+    int node_ranks[NUMBER_NEIGHBORS];
+    int pair_ranks[2];
+    size_t bytes = 0;
+    MPI_Comm node_comm;
+    MPI_Group node_group, grid_group, pair_group;
+
+    MPI_Comm_split_type(MPI_COMM_COMPUTE_AWAKE, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &node_size);
+    if(node_size == 1) {
+        MPI_Comm_free(&node_comm);
+        return 0;
+    }
 
-    int *blocklens_left = (int*)malloc(num_moving_left * sizeof(int));
-    int *blocklens_right = (int*)malloc(num_moving_right * sizeof(int));
-    int *indicies_left = (int*)malloc(num_moving_left * sizeof(int));
-    int *indicies_right = (int*)malloc(num_moving_right * sizeof(int));
+    // Find which neighbors are on this host
+    MPI_Comm_group(MPI_COMM_COMPUTE, &grid_group);
+    MPI_Comm_group(node_comm, &node_group);
+    MPI_Group_translate_ranks(grid_group, NUMBER_NEIGHBORS, params->neighbor_ranks, node_group, node_ranks);
+    MPI_Group_free(&grid_group);
+
+    // Pairs are created in increasing neighbor rank on both ranks of every pair, which orders them by their lower then higher rank,
+    // so the lowest pair not yet created always has both ranks waiting on it
+    edges->number_pairs = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        edges->shared[d] = params->neighbor_ranks[d] != MPI_PROC_NULL && node_ranks[d] != MPI_UNDEFINED;
+        if(!edges->shared[d])
+            continue;
+        for(n=edges->number_pairs; n>0 && params->neighbor_ranks[edges->pair_order[n-1]] > params->neighbor_ranks[d]; n--)
+            edges->pair_order[n] = edges->pair_order[n-1];
+        edges->pair_order[n] = d;
+        edges->number_pairs++;
+    }
 
-    // Convert the edge pointer into a particle array index using pointer arithmetic
-    int index;
-    int edge_global_index; // Should perhaps use ptrdiff_t
-    for (i=0; i<num_moving_left; i++) {
-        blocklens_left[i] = 1;
-        edge_global_index = (int) (edges->edge_pointers_left[i] - fluid_particles);
-        indicies_left[i]  = edge_global_index;
+    // Both ranks of a pair list it in the same order so they create the same communicator
+    MPI_Comm_rank(node_comm, &node_rank);
+    for(n=0; n<edges->number_pairs; n++) {
+        d = edges->pair_order[n];
+        pair_ranks[0] = node_rank < node_ranks[d] ? node_rank : node_ranks[d];
+        pair_ranks[1] = node_rank < node_ranks[d] ? node_ranks[d] : node_rank;
+        MPI_Group_incl(node_group, 2, pair_ranks, &pair_group);
+        MPI_Comm_create_group(node_comm, pair_group, HALO_TAG, &edges->pair_comms[d]);
+        MPI_Group_free(&pair_group);
+
+        // Segments start with only the counts and are grown before the first edges are packed
+        edges->max_shared_particles[d] = 0;
+        bytes += alloc_shared_segment(edges, d);
     }
-    for (i=0; i<num_moving_right; i++) {
-        blocklens_right[i] = 1;
-        edge_global_index = (int) (edges->edge_pointers_right[i] - fluid_particles);
-        indicies_right[i]  = edge_global_index;
+    edges->parity = 0;
+
+    MPI_Group_free(&node_group);
+    MPI_Comm_free(&node_comm);
+
+    debug_print("shared halos: left %d, right %d\n", edges->shared[NEIGHBOR_LEFT], edges->shared[NEIGHBOR_RIGHT]);
+
+    return bytes;
+}
+
+// Allocate the window shared with the neighbor in direction, each rank's segment holds both parities of a count and max_shared_particles records
+// Must be called by both ranks of the pair
+// Returns the number of bytes allocated
+size_t alloc_shared_segment(edge_t *edges, int direction)
+{
+    int pair_rank, disp_unit;
+    size_t segment_bytes;
+    MPI_Aint bytes;
+
+    segment_bytes = 2*(sizeof(int) + (size_t)edges->max_shared_particles[direction]*MAX_HALO_RECORD_FIELDS*sizeof(float));
+    MPI_Win_allocate_shared(segment_bytes, sizeof(float), MPI_INFO_NULL, edges->pair_comms[direction], &edges->segments[direction], &edges->windows[direction]);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, edges->windows[direction]);
+
+    MPI_Comm_rank(edges->pair_comms[direction], &pair_rank);
+    MPI_Win_shared_query(edges->windows[direction], pair_rank^1, &bytes, &disp_unit, &edges->neighbor_segments[direction]);
+
+    return segment_bytes;
+}
+
+void free_shared_segment(edge_t *edges, int direction)
+{
+    MPI_Win_unlock_all(edges->windows[direction]);
+    MPI_Win_free(&edges->windows[direction]);
+    edges->segments[direction] = NULL;
+    edges->neighbor_segments[direction] = NULL;
+}
+
+void free_shared_halos(edge_t *edges)
+{
+    int d, n;
+
+    for(n=0; n<edges->number_pairs; n++) {
+        d = edges->pair_order[n];
+        free_shared_segment(edges, d);
+        MPI_Comm_free(&edges->pair_comms[d]);
+        edges->shared[d] = false;
+    }
+    edges->number_pairs = 0;
+}
+
+// Grow the shared segments to hold the edge particles of both ranks of each pair, growing geometrically
+// Must be called by all awake compute ranks when the edges are updated, before the edge particles are packed
+// A window is only reallocated when either rank of its pair has more edge particles than the segments hold, the records are not kept
+void reserve_shared_halos(edge_t *edges)
+{
+    int d, n, max;
+    int number_particles[NUMBER_NEIGHBORS];
+    MPI_Request reqs[NUMBER_NEIGHBORS];
+
+    for(n=0; n<edges->number_pairs; n++) {
+        d = edges->pair_order[n];
+        number_particles[d] = edges->number_edge_particles[d];
+        MPI_Iallreduce(MPI_IN_PLACE, &number_particles[d], 1, MPI_INT, MPI_MAX, edges->pair_comms[d], &reqs[n]);
     }
+    MPI_Waitall(edges->number_pairs, reqs, MPI_STATUSES_IGNORE);
 
-    MPI_Type_indexed(num_moving_left,blocklens_left,indicies_left,Particletype,&LeftEdgetype);
-    MPI_Type_commit(&LeftEdgetype);
-    MPI_Type_indexed(num_moving_right,blocklens_right,indicies_right,Particletype,&RightEdgetype);
-    MPI_Type_commit(&RightEdgetype);
+    for(n=0; n<edges->number_pairs; n++) {
+        d = edges->pair_order[n];
+        if(number_particles[d] <= edges->max_shared_particles[d])
+            continue;
 
-    debug_print("rank %d, prams->max_fluid_particle_index: %d\n", rank,  params->max_fluid_particle_index);
+        max = edges->max_shared_particles[d] ? 2*edges->max_shared_particles[d] : 64;
+        while(max < number_particles[d])
+            max *= 2;
 
-    //Index to start receiving halo particles
-    int indexToReceiveLeft = params->max_fluid_particle_index + 1;
-    int indexToReceiveRight = indexToReceiveLeft + num_from_left;
+        free_shared_segment(edges, d);
+        edges->max_shared_particles[d] = max;
+        alloc_shared_segment(edges, d);
+        debug_print("shared halo segments in direction %d grown to %d\n", d, max);
+    }
+}
 
-    debug_print("rank %d, halo: send %d to left, %d to right, indexToRecieveLeft %d, indexToReceiveRight %d \n", rank, num_moving_left, num_moving_right, indexToReceiveLeft, indexToReceiveRight);
+// Number of edge particles written to a segment
+int *shared_halo_count(void *segment, int parity)
+{
+    return (int*)segment + parity;
+}
 
-    int tagl = 4312;
-    int tagr = 5177;
-    // Receive halo from left rank
-    MPI_Irecv(&fluid_particles[indexToReceiveLeft], num_from_left, Particletype, proc_to_left,tagl, MPI_COMM_COMPUTE, &edges->reqs[0]);
-    // Receive halo from right rank
-    MPI_Irecv(&fluid_particles[indexToReceiveRight], num_from_right, Particletype, proc_to_right,tagr, MPI_COMM_COMPUTE, &edges->reqs[1]);
-    // Send halo to right rank
-    MPI_Isend(fluid_particles,1,RightEdgetype,proc_to_right,tagl,MPI_COMM_COMPUTE, &edges->reqs[2]);
-    MPI_Isend(fluid_particles,1,LeftEdgetype,proc_to_left,tagr,MPI_COMM_COMPUTE, &edges->reqs[3]);
+// Edge particle records written to a segment of the window shared with the neighbor in direction
+float *shared_halo_records(edge_t *edges, void *segment, int parity, int direction)
+{
+    float *records = (float*)((int*)segment + 2);
 
-    // Free allocated arays
-    free(blocklens_left);
-    free(blocklens_right);
-    free(indicies_left);
-    free(indicies_right);
+    return records + (size_t)parity*edges->max_shared_particles[direction]*MAX_HALO_RECORD_FIELDS;
 }
 
-void finishHaloExchange(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles,  edge_t *edges, param *params)
+// True if this rank computes the pairs between its particles and the halo particles from direction
+// A pair across a boundary is computed by the rank the other is to the right of or above, opposite directions always differ
+bool halo_computed(int direction)
 {
-    int i;
-    // Wait for transfer to complete
-    MPI_Status statuses[4];
-    MPI_Waitall(4, edges->reqs, statuses);
+    return direction & 1;
+}
+
+// Direction of the nth block of halo particles, the computed halo particles are first
+int halo_direction(int n)
+{
+    return n < NUMBER_NEIGHBORS/2 ? 2*n + 1 : 2*(n - NUMBER_NEIGHBORS/2);
+}
+
+// Make room for number_particles records of any layout, growing the buffer geometrically
+// Returns false if the buffer could not be grown
+bool reserve_halo_buffer(float **buffer, int *max_particles, int number_particles)
+{
+    int max;
+    float *grown;
+
+    if(number_particles <= *max_particles)
+        return true;
+
+    max = *max_particles ? 2 * *max_particles : 64;
+    while(max < number_particles)
+        max *= 2;
+
+    grown = realloc(*buffer, max*MAX_HALO_RECORD_FIELDS*sizeof(float));
+    if(grown == NULL) {
+        printf("Could not allocate halo buffer\n");
+        return false;
+    }
+    *buffer = grown;
+    *max_particles = max;
+
+    return true;
+}
+
+// (Re)create the persistent halo requests of every record layout for the current edge and halo counts
+// The previous requests must be inactive
+void init_halo_requests(edge_t *edges, param *params)
+{
+    int i, d;
+    MPI_Request *reqs;
+
+    for(i=0; i<NUMBER_HALO_RECORDS; i++) {
+        reqs = edges->reqs[i];
+        for(d=0; d<2*NUMBER_NEIGHBORS; d++) {
+            if(reqs[d] != MPI_REQUEST_NULL)
+                MPI_Request_free(&reqs[d]);
+        }
+
+        // Receive halo from each neighbor, it was sent in the opposite direction
+        // Shared halos are sent empty, the message tells the neighbor the segment has been packed
+        for(d=0; d<NUMBER_NEIGHBORS; d++)
+            MPI_Recv_init(edges->recv_buffers[d], edges->shared[d] ? 0 : edges->number_halo_particles[d], HaloRecordtypes[i], params->neighbor_ranks[d], HALO_TAG + (d^1), MPI_COMM_COMPUTE, &reqs[d]);
+        // Send halo to each neighbor
+        for(d=0; d<NUMBER_NEIGHBORS; d++)
+            MPI_Send_init(edges->send_buffers[d], edges->shared[d] ? 0 : edges->number_edge_particles[d], HaloRecordtypes[i], params->neighbor_ranks[d], HALO_TAG + d, MPI_COMM_COMPUTE, &reqs[NUMBER_NEIGHBORS + d]);
+    }
+
+    // Displacements of the computed halo particles are returned to their owners, which receive them for their edge particles
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        if(edges->return_reqs[d] != MPI_REQUEST_NULL)
+            MPI_Request_free(&edges->return_reqs[d]);
+        if(halo_computed(d)) {
+            reserve_halo_buffer(&edges->return_buffers[d], &edges->max_return[d], edges->number_halo_particles[d]);
+            MPI_Send_init(edges->return_buffers[d], RETURN_RECORD_FIELDS*edges->number_halo_particles[d], MPI_FLOAT, params->neighbor_ranks[d], RETURN_TAG + d, MPI_COMM_COMPUTE, &edges->return_reqs[d]);
+        }
+        else {
+            reserve_halo_buffer(&edges->return_buffers[d], &edges->max_return[d], edges->number_edge_particles[d]);
+            MPI_Recv_init(edges->return_buffers[d], RETURN_RECORD_FIELDS*edges->number_edge_particles[d], MPI_FLOAT, params->neighbor_ranks[d], RETURN_TAG + (d^1), MPI_COMM_COMPUTE, &edges->return_reqs[d]);
+        }
+    }
+}
 
-    int num_received_right = 0;
-    int num_received_left = 0;
-    MPI_Get_count(&statuses[0], Particletype, &num_received_left);
-    MPI_Get_count(&statuses[1], Particletype, &num_received_right);
+// Make room for number_indicies edge particles in the index array of every direction, growing the arrays geometrically
+// Directions without a neighbor are grown as well as a parked neighbor may be woken
+// Returns false if the arrays could not be grown
+bool reserve_edge_indicies(edge_t *edges, int number_indicies)
+{
+    int d, max;
+    int *grown;
+
+    if(number_indicies <= edges->max_edge_particles)
+        return true;
+
+    max = edges->max_edge_particles ? 2*edges->max_edge_particles : 64;
+    while(max < number_indicies)
+        max *= 2;
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        grown = realloc(edges->edge_indicies[d], max*sizeof(int));
+        if(grown == NULL) {
+            printf("Could not allocate edge indicies\n");
+            return false;
+        }
+        edges->edge_indicies[d] = grown;
+    }
+    edges->max_edge_particles = max;
+
+    return true;
+}
+
+// Add particle i to the edge particles of each neighbor it is within width of
+// Only neighbors that exist are sent edge particles
+void add_edge_particle(edge_t *edges, int i, float x, float y, float width, param *params)
+{
+    int d;
+    int offset_x = 0;
+    int offset_y = 0;
+
+    if (x - params->tunable_params.node_start_x <= width)
+        offset_x = -1;
+    else if (params->tunable_params.node_end_x - x <= width)
+        offset_x = 1;
+    if (y - params->tunable_params.node_start_y <= width)
+        offset_y = -1;
+    else if (params->tunable_params.node_end_y - y <= width)
+        offset_y = 1;
+
+    if(offset_x) {
+        d = neighbor_direction(offset_x, 0);
+        if(params->neighbor_ranks[d] != MPI_PROC_NULL)
+            edges->edge_indicies[d][edges->number_edge_particles[d]++] = i;
+    }
+    if(offset_y) {
+        d = neighbor_direction(0, offset_y);
+        if(params->neighbor_ranks[d] != MPI_PROC_NULL)
+            edges->edge_indicies[d][edges->number_edge_particles[d]++] = i;
+    }
+    if(offset_x && offset_y) {
+        d = neighbor_direction(offset_x, offset_y);
+        if(params->neighbor_ranks[d] != MPI_PROC_NULL)
+            edges->edge_indicies[d][edges->number_edge_particles[d]++] = i;
+    }
+}
+
+// Select the edge particles of each neighbor from the fluid particles near the node edges
+// Candidates come from the cell list, see edge_candidates(), so the fluid particles must not have been reordered since they were binned
+// If remaining is true particles that are leaving are skipped so the selection is the same before and after they are removed
+void select_edge_particles(fluid_particles_t *particles, edge_t *edges, neighbor_grid_t *grid, param *params, bool remaining)
+{
+    int i, n, d, number_candidates;
+    // Edges are wide enough to contain any neighbor until the neighbor lists are rebuilt
+    float width = params->tunable_params.smoothing_radius + params->skin;
+    float *x = particles->x;
+    float *y = particles->y;
+
+    // Returned displacements may have moved edge particles since the last displacement check
+    number_candidates = edge_candidates(grid, params, width + edges->returned_displacement);
+    reserve_edge_indicies(edges, number_candidates);
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        edges->number_edge_particles[d] = 0;
+    for(n=0; n<number_candidates; n++) {
+        i = grid->candidates[n];
+        if (remaining && oob_direction(x[i], y[i], params) >= 0)
+            continue;
+        add_edge_particle(edges, i, x[i], y[i], width, params);
+    }
+}
 
-    int total_received = num_received_left + num_received_right;
+// Send edge particles to neighboring ranks as their halo
+// If update_edges is true the edges have been reselected, otherwise the previously selected edge particles are resent so the
+// halo particles received by the neighbors keep their indicies
+// All ranks must agree on update_edges
+// Counts are never exchanged, when the edges are updated the halo counts are read from the incoming messages
+// and the persistent requests are recreated for them, otherwise the persistent requests are restarted
+// record selects the halo record layout sent
+void startHaloExchange(fluid_particles_t *particles, edge_t *edges, param *params, bool update_edges, int record)
+{
+    int i, d;
+    int fields = halo_record_fields(record);
+
+    if(update_edges) {
+        // Grow the send buffers and shared segments to the high water mark
+        for(d=0; d<NUMBER_NEIGHBORS; d++) {
+            if(!edges->shared[d])
+                reserve_halo_buffer(&edges->send_buffers[d], &edges->max_send[d], edges->number_edge_particles[d]);
+        }
+        reserve_shared_halos(edges);
+
+        debug_print("halo: will send %d to left, %d to right\n", edges->number_edge_particles[NEIGHBOR_LEFT], edges->number_edge_particles[NEIGHBOR_RIGHT]);
+    }
+
+    // Pack edge particles into contiguous send buffers, or this ranks segment for neighbors sharing the window
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        float *buffer = edges->send_buffers[d];
+        if(edges->shared[d]) {
+            buffer = shared_halo_records(edges, edges->segments[d], edges->parity, d);
+            *shared_halo_count(edges->segments[d], edges->parity) = edges->number_edge_particles[d];
+        }
+        for (i=0; i<edges->number_edge_particles[d]; i++)
+            pack_halo_particle(particles, edges->edge_indicies[d][i], &buffer[i*fields], record);
+        if(edges->shared[d])
+            MPI_Win_sync(edges->windows[d]);
+    }
+
+    edges->record = record;
+    edges->updating = update_edges;
+
+    if(update_edges) {
+        // Send halo to each neighbor
+        for(d=0; d<NUMBER_NEIGHBORS; d++)
+            MPI_Isend(edges->send_buffers[d], edges->shared[d] ? 0 : edges->number_edge_particles[d], HaloRecordtypes[record], params->neighbor_ranks[d], HALO_TAG + d, MPI_COMM_COMPUTE, &edges->update_reqs[d]);
+    }
+    else
+        MPI_Startall(2*NUMBER_NEIGHBORS, edges->reqs[record]);
+}
+
+// Receive a halo message of unknown length, growing the receive buffer to fit it
+// Returns the number of halo particles received
+int receive_halo(float **buffer, int *max_particles, int source, int tag, int record)
+{
+    int count = 0;
+    MPI_Status status;
+
+    if(source != MPI_PROC_NULL) {
+        MPI_Probe(source, tag, MPI_COMM_COMPUTE, &status);
+        MPI_Get_count(&status, HaloRecordtypes[record], &count);
+    }
+
+    reserve_halo_buffer(buffer, max_particles, count);
+    MPI_Recv(*buffer, count, HaloRecordtypes[record], source, tag, MPI_COMM_COMPUTE, MPI_STATUS_IGNORE);
+
+    return count;
+}
+
+void finishHaloExchange(fluid_particles_t *particles, edge_t *edges, param *params)
+{
+    int i, d;
+    int fields = halo_record_fields(edges->record);
+
+    if(edges->updating) {
+        // Receive halo from each neighbor
+        for(d=0; d<NUMBER_NEIGHBORS; d++)
+            edges->number_halo_particles[d] = receive_halo(&edges->recv_buffers[d], &edges->max_recv[d], params->neighbor_ranks[d], HALO_TAG + (d^1), edges->record);
+        MPI_Waitall(NUMBER_NEIGHBORS, edges->update_reqs, MPI_STATUSES_IGNORE);
+    }
+    else {
+        // Wait for transfer to complete
+        MPI_Waitall(2*NUMBER_NEIGHBORS, edges->reqs[edges->record], MPI_STATUSES_IGNORE);
+    }
+
+    // Shared halos are read once the neighbors empty message has arrived, it is sent after the segment is packed
+    // The segments alternate parity so a neighbor can not overwrite records before they are read,
+    // it writes the same parity again only after receiving this ranks message of the next exchange
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        if(edges->shared[d]) {
+            MPI_Win_sync(edges->windows[d]);
+            edges->number_halo_particles[d] = *shared_halo_count(edges->neighbor_segments[d], edges->parity);
+        }
+    }
+
+    // Exchanges until the next edge update have the same counts and buffers
+    if(edges->updating)
+        init_halo_requests(edges, params);
+
+    int total_received = 0;
+    params->number_computed_halo_particles = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        total_received += edges->number_halo_particles[d];
+        if(halo_computed(d))
+            params->number_computed_halo_particles += edges->number_halo_particles[d];
+    }
     params->number_halo_particles = total_received;
+    reserve_fluid_particles(particles, params->number_fluid_particles_local + total_received);
 
     // Need to automatically add rank to debug print
-    debug_print("halo: recv %d from left, %d from right\n",num_received_left,num_received_right);
+    debug_print("halo: recv %d from left, %d from right\n", edges->number_halo_particles[NEIGHBOR_LEFT], edges->number_halo_particles[NEIGHBOR_RIGHT]);
 
-    // Update pointer array with new values
-    int local_index;
-    int global_index;
-    for (i=0; i< total_received; i++) {
-        local_index = params->number_fluid_particles_local + i;
-        global_index = params->max_fluid_particle_index + 1 + i;
-        fluid_particle_pointers[local_index] = &fluid_particles[global_index];
-        fluid_particle_pointers[local_index]->id = local_index;
+    // Unpack halo particles directly after the local particles, new halo particles have not been displaced
+    int n, halo_index = params->number_fluid_particles_local;
+    if(edges->updating) {
+        memset(&particles->halo_d_x[halo_index], 0, total_received*sizeof(float));
+        memset(&particles->halo_d_y[halo_index], 0, total_received*sizeof(float));
+    }
+    for(n=0; n<NUMBER_NEIGHBORS; n++) {
+        d = halo_direction(n);
+        float *buffer = edges->shared[d] ? shared_halo_records(edges, edges->neighbor_segments[d], edges->parity, d) : edges->recv_buffers[d];
+        for (i=0; i<edges->number_halo_particles[d]; i++)
+            unpack_halo_particle(&buffer[i*fields], particles, halo_index++, edges->record);
     }
 
-    // Free indexed types
-    MPI_Type_free(&LeftEdgetype);
-    MPI_Type_free(&RightEdgetype);
+    edges->parity ^= 1;
 }
 
-// Transfer particles that are out of node bounds
-void transferOOBParticles(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles, oob_t *out_of_bounds, param *params)
+// Displace particle i by a returned displacement record
+// The velocity changes as if the displacement was made during the step, the same as a displacement made by relaxation
+void apply_returned_displacement(fluid_particles_t *particles, int i, float *record, float dt)
 {
-    int i;
-    fluid_particle *p;
+    particles->x[i] += record[0];
+    particles->y[i] += record[1];
+    particles->v_x[i] += record[0]/dt;
+    particles->v_y[i] += record[1]/dt;
+}
 
-    int rank;
-    MPI_Comm_rank(MPI_COMM_COMPUTE, &rank);
-    int nprocs;
-    MPI_Comm_size(MPI_COMM_COMPUTE, &nprocs);
+// Return the displacements this rank gave its computed halo particles to the owners of the particles
+// Records are packed in halo order, which is the order of the owners edge particles, and the displacements are reset
+// All ranks must start a return exchange together and it must complete before the edges are updated
+void startReturnExchange(fluid_particles_t *particles, edge_t *edges, param *params)
+{
+    int i, n, d;
+    int halo_index = params->number_fluid_particles_local;
+    float *record;
+
+    for(n=0; n<NUMBER_NEIGHBORS; n++) {
+        d = halo_direction(n);
+        if(!halo_computed(d)) {
+            halo_index += edges->number_halo_particles[d];
+            continue;
+        }
+        record = edges->return_buffers[d];
+        for(i=0; i<edges->number_halo_particles[d]; i++) {
+            record[0] = particles->halo_d_x[halo_index];
+            record[1] = particles->halo_d_y[halo_index];
+            particles->halo_d_x[halo_index] = 0.0f;
+            particles->halo_d_y[halo_index] = 0.0f;
+            record += RETURN_RECORD_FIELDS;
+            halo_index++;
+        }
+    }
 
-    int num_moving_left = out_of_bounds->number_oob_particles_left;
-    int num_moving_right = out_of_bounds->number_oob_particles_right;
-
-    // Setup nodes to left and right of self
-    int proc_to_left =  (rank == 0 ? MPI_PROC_NULL : rank-1);
-    int proc_to_right = (rank == nprocs-1 ? MPI_PROC_NULL : rank+1);
-
-    // Get number of particles from right and left
-    int num_from_left = 0;
-    int num_from_right = 0;
-    int tag = 7006;
-    // Send number to right and receive from left
-    MPI_Sendrecv(&num_moving_right, 1, MPI_INT, proc_to_right, tag, &num_from_left,1,MPI_INT,proc_to_left,tag,MPI_COMM_COMPUTE,MPI_STATUS_IGNORE);
-    // Send number to left and receive from right
-    tag = 8278;
-    MPI_Sendrecv(&num_moving_left, 1, MPI_INT, proc_to_left, tag, &num_from_right,1,MPI_INT,proc_to_right,tag,MPI_COMM_COMPUTE,MPI_STATUS_IGNORE);
-
-    // Create indexed type to send
-    MPI_Datatype LeftMovetype;
-    MPI_Datatype RightMovetype;
-    int *blocklens_left = malloc(num_moving_left*sizeof(int));
-    int *blocklens_right = malloc(num_moving_right*sizeof(int));
-    int *indicies_left = malloc(num_moving_left*sizeof(int));
-    int *indicies_right = malloc(num_moving_right*sizeof(int));
-
-    // Convert the OOB pointer into a particle array index using pointer arithmetic
-    int index;
-    int oob_global_index;
-    for (i=0; i<num_moving_left; i++) {
-        blocklens_left[i] = 1;
-        index = out_of_bounds->oob_pointer_indicies_left[i];
-        oob_global_index = (int) (fluid_particle_pointers[index] - fluid_particles);
-        indicies_left[i]  = oob_global_index;
-    }
-    for (i=0; i<num_moving_right; i++) {
-        blocklens_right[i] = 1;
-        index = out_of_bounds->oob_pointer_indicies_right[i];
-        oob_global_index = (int) (fluid_particle_pointers[index] - fluid_particles);
-        indicies_right[i]  = oob_global_index;
-    }
-
-    MPI_Type_indexed(num_moving_left,blocklens_left,indicies_left,Particletype,&LeftMovetype);
-    MPI_Type_commit(&LeftMovetype);
-    MPI_Type_indexed(num_moving_right,blocklens_right,indicies_right,Particletype,&RightMovetype);
-    MPI_Type_commit(&RightMovetype);
-
-    // Create indexed type to recv
-    MPI_Datatype LeftRecvtype;
-    MPI_Datatype RightRecvtype;
-
-    int total_recv = num_from_left + num_from_right;
-    int *blocklens_recv = malloc(total_recv*sizeof(int));
-    int *indicies_recv = malloc(total_recv*sizeof(int));
-    // Go through vacancies, starting at end, to create receive indicies
-    // Go through reverse so it's easy to set update vacancies below
-    for (i=0; i<out_of_bounds->number_vacancies && i<total_recv; i++) {
-        blocklens_recv[i] = 1;
-        index = out_of_bounds->number_vacancies-1-i;
-        indicies_recv[i] = out_of_bounds->vacant_indicies[index];
-    }
-    int replaced = i;
-    int remaining = total_recv - replaced;
-    for (i=0; i<remaining; i++) {
-        blocklens_recv[replaced+i] = 1;
-        indicies_recv[replaced+i] = params->max_fluid_particle_index + 1 + i;
-    }
-
-    MPI_Type_indexed(num_from_left, blocklens_recv, indicies_recv, Particletype, &LeftRecvtype);
-    MPI_Type_commit(&LeftRecvtype);
-    MPI_Type_indexed(num_from_right, &blocklens_recv[num_from_left],&indicies_recv[num_from_left], Particletype, &RightRecvtype);
-    MPI_Type_commit(&RightRecvtype); 
+    MPI_Startall(NUMBER_NEIGHBORS, edges->return_reqs);
+}
 
-    MPI_Status status;
-    MPI_Request request;
+// Apply the displacements the neighbors gave this ranks edge particles
+// If the halo has been refreshed since the displacements were made the computed halo particles are displaced again
+// so they match their owners, a refreshing exchange must be started after the return exchange
+void finishReturnExchange(fluid_particles_t *particles, edge_t *edges, param *params, bool halo_refreshed)
+{
+    int i, n, d;
+    int halo_index = params->number_fluid_particles_local;
+    float dt = params->tunable_params.time_step;
+    float *record;
+    float returned, max_returned;
+
+    MPI_Waitall(NUMBER_NEIGHBORS, edges->return_reqs, MPI_STATUSES_IGNORE);
+
+    // A particle may be an edge particle of several neighbors so the bound is the sum of the largest displacement from each
+    edges->returned_displacement = 0.0f;
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        if(halo_computed(d))
+            continue;
+        max_returned = 0.0f;
+        for(i=0; i<edges->number_edge_particles[d]; i++) {
+            record = &edges->return_buffers[d][i*RETURN_RECORD_FIELDS];
+            apply_returned_displacement(particles, edges->edge_indicies[d][i], record, dt);
+            returned = fabsf(record[0]) + fabsf(record[1]);
+            if(returned > max_returned)
+                max_returned = returned;
+        }
+        edges->returned_displacement += max_returned;
+    }
 
-    // Send oob particles to right processor receive oob particles from right processor
-    int num_received_left = 0;
-    int num_received_right = 0;
+    if(!halo_refreshed)
+        return;
 
-    // Sending to right, recv from left
-    tag = 2522;
-    MPI_Sendrecv(fluid_particles,1,RightMovetype,proc_to_right,tag,fluid_particles,1,LeftRecvtype,proc_to_left,tag,MPI_COMM_COMPUTE,&status);
-    MPI_Get_count(&status, Particletype, &num_received_left);
-    // Sending to left, recv from right
-    tag = 1165;
-    MPI_Sendrecv(fluid_particles,1,LeftMovetype,proc_to_left,tag,fluid_particles,1,RightRecvtype,proc_to_right,tag,MPI_COMM_COMPUTE,&status);
-    MPI_Get_count(&status, Particletype, &num_received_right);
+    // The sent records are the displacements of the computed halo particles in halo order
+    for(n=0; n<NUMBER_NEIGHBORS; n++) {
+        d = halo_direction(n);
+        if(!halo_computed(d))
+            break;
+        for(i=0; i<edges->number_halo_particles[d]; i++)
+            apply_returned_displacement(particles, halo_index++, &edges->return_buffers[d][i*RETURN_RECORD_FIELDS], dt);
+    }
+}
 
-    int total_sent = num_moving_left + num_moving_right;
-    int total_received = num_received_right + num_received_left;
+// Packed OOB buffers start empty and are grown as particles leave and arrive
+void alloc_oob_buffers(oob_t *out_of_bounds)
+{
+    int d;
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        out_of_bounds->number_oob_particles[d] = 0;
+        out_of_bounds->send_buffers[d] = NULL;
+        out_of_bounds->recv_buffers[d] = NULL;
+        out_of_bounds->max_send[d] = 0;
+        out_of_bounds->max_recv[d] = 0;
+    }
+    out_of_bounds->removed_indicies = NULL;
+    out_of_bounds->moved_indicies = NULL;
+    out_of_bounds->max_removed = 0;
+    out_of_bounds->number_remaining = 0;
+}
 
-    debug_print("rank %d OOB: sent left %d, right: %d recv left:%d, right: %d\n", rank, num_moving_left, num_moving_right, num_received_left, num_received_right);
+void free_oob_buffers(oob_t *out_of_bounds)
+{
+    int d;
 
-    // Update maximum particle index if neccessary
-    int max_received_index = total_received?total_received-1:0;// If non received don't access indicies_recv[-1]...
-    if (total_received && indicies_recv[max_received_index] > params->max_fluid_particle_index) {
-        debug_print("rank %d increasing max index from: %d", rank, params->max_fluid_particle_index);
-        params->max_fluid_particle_index = indicies_recv[max_received_index];
-        debug_print("to %d\n", params->max_fluid_particle_index);
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        free(out_of_bounds->send_buffers[d]);
+        free(out_of_bounds->recv_buffers[d]);
     }
+    free(out_of_bounds->removed_indicies);
+    free(out_of_bounds->moved_indicies);
+}
 
-    // Update vacancy total for particles received
-    if (total_received < out_of_bounds->number_vacancies )
-        out_of_bounds->number_vacancies -= total_received;
-    else
-        out_of_bounds->number_vacancies = 0;
-
-    // Update vacancy indicies and total for particles sent
-    // Set sent particle pointer to received particle location or to NULL
-    int oob_pointer_index;
-    int recv_replaced = 0; // received particles that have replaced leaving particles
-    for (i=0; i<num_moving_left; i++) {
-        // Index of particle pointer that has left
-        oob_pointer_index = out_of_bounds->oob_pointer_indicies_left[i];
-        // Index of particle that has left
-        oob_global_index = (int) (fluid_particle_pointers[oob_pointer_index] - fluid_particles);
-        out_of_bounds->vacant_indicies[out_of_bounds->number_vacancies] = oob_global_index;
-        // Incriment the number of vacancies
-        out_of_bounds->number_vacancies++;
-
-        // Set pointer from removed particle to a recvd particle ,if any, else NULL
-        if(recv_replaced < total_received) {
-            fluid_particle_pointers[oob_pointer_index] = &fluid_particles[indicies_recv[recv_replaced]]; 
-            recv_replaced++;
+// Make room for number_particles particle records, growing the buffer geometrically
+// Returns false if the buffer could not be grown
+bool reserve_oob_buffer(fluid_particle **buffer, int *max_particles, int number_particles)
+{
+    int max;
+    fluid_particle *grown;
+
+    if(number_particles <= *max_particles)
+        return true;
+
+    max = *max_particles ? 2 * *max_particles : 64;
+    while(max < number_particles)
+        max *= 2;
+
+    grown = realloc(*buffer, max*sizeof(fluid_particle));
+    if(grown == NULL) {
+        printf("Could not allocate OOB buffer\n");
+        return false;
+    }
+    *buffer = grown;
+    *max_particles = max;
+
+    return true;
+}
+
+// Make room for number_indicies leaving particles in the index array of every direction, growing the arrays geometrically
+// Directions without a neighbor are grown as well as a parked neighbor may be woken
+// Returns false if the arrays could not be grown
+bool reserve_oob_indicies(oob_t *out_of_bounds, int number_indicies)
+{
+    int d, max;
+    int *grown;
+
+    if(number_indicies <= out_of_bounds->max_oob_particles)
+        return true;
+
+    max = out_of_bounds->max_oob_particles ? 2*out_of_bounds->max_oob_particles : 64;
+    while(max < number_indicies)
+        max *= 2;
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        grown = realloc(out_of_bounds->oob_indicies[d], max*sizeof(int));
+        if(grown == NULL) {
+            printf("Could not allocate OOB indicies\n");
+            return false;
         }
-        else
-            fluid_particle_pointers[oob_pointer_index] = NULL;
-    }
-    for (i=0; i<num_moving_right; i++) {
-        // Index of particle pointer that has left
-        oob_pointer_index = out_of_bounds->oob_pointer_indicies_right[i];
-        // Index of particle that has left
-        oob_global_index = (int) (fluid_particle_pointers[oob_pointer_index] - fluid_particles);
-        // Set new vacancy index
-        out_of_bounds->vacant_indicies[out_of_bounds->number_vacancies] = oob_global_index;
-        // Incriment the number of vacancies
-        out_of_bounds->number_vacancies++;
-
-        // Set pointer from removed particle to a recvd particle ,if any, else NULL
-        if(recv_replaced < total_received) {
-            fluid_particle_pointers[oob_pointer_index] = &fluid_particles[indicies_recv[recv_replaced]];
-            recv_replaced++;
+        out_of_bounds->oob_indicies[d] = grown;
+    }
+    out_of_bounds->max_oob_particles = max;
+
+    return true;
+}
+
+// Direction of the neighbor a particle at (x, y) must be sent to, -1 if it is within the node bounds
+// Particles beyond a node edge with no neighbor stay on the node
+int oob_direction(float x, float y, param *params)
+{
+    int offset_x = 0;
+    int offset_y = 0;
+
+    if (x < params->tunable_params.node_start_x)
+        offset_x = -1;
+    else if (x > params->tunable_params.node_end_x)
+        offset_x = 1;
+    if (y < params->tunable_params.node_start_y)
+        offset_y = -1;
+    else if (y > params->tunable_params.node_end_y)
+        offset_y = 1;
+
+    if(offset_x && params->neighbor_ranks[neighbor_direction(offset_x, 0)] == MPI_PROC_NULL)
+        offset_x = 0;
+    if(offset_y && params->neighbor_ranks[neighbor_direction(0, offset_y)] == MPI_PROC_NULL)
+        offset_y = 0;
+
+    if(!offset_x && !offset_y)
+        return -1;
+
+    return neighbor_direction(offset_x, offset_y);
+}
+
+// Make room for number_removed removed and moved particle indicies, growing the arrays geometrically
+// Returns false if the arrays could not be grown
+bool reserve_removed_indicies(oob_t *out_of_bounds, int number_removed)
+{
+    int max;
+    int *removed, *moved;
+
+    if(number_removed <= out_of_bounds->max_removed)
+        return true;
+
+    max = out_of_bounds->max_removed ? 2 * out_of_bounds->max_removed : 64;
+    while(max < number_removed)
+        max *= 2;
+
+    removed = realloc(out_of_bounds->removed_indicies, max*sizeof(int));
+    if(removed != NULL)
+        out_of_bounds->removed_indicies = removed;
+    moved = realloc(out_of_bounds->moved_indicies, max*sizeof(int));
+    if(moved != NULL)
+        out_of_bounds->moved_indicies = moved;
+    if(removed == NULL || moved == NULL) {
+        printf("Could not allocate removed particle indicies\n");
+        return false;
+    }
+    out_of_bounds->max_removed = max;
+
+    return true;
+}
+
+// Remove particles that have left, the places of those below the remaining number are filled by the remaining particles above it
+// Only the moved particles are copied, moved_indicies records the new index of each particle from number_remaining up, -1 if it left
+// Returns the number of particles remaining
+int remove_oob_particles(fluid_particles_t *particles, oob_t *out_of_bounds, param *params)
+{
+    int i, d, hole, next;
+    int number_removed = 0;
+    int *removed, *moved;
+
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        number_removed += out_of_bounds->number_oob_particles[d];
+    reserve_removed_indicies(out_of_bounds, number_removed);
+    removed = out_of_bounds->removed_indicies;
+    moved = out_of_bounds->moved_indicies;
+
+    number_removed = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        for (i=0; i<out_of_bounds->number_oob_particles[d]; i++)
+            removed[number_removed++] = out_of_bounds->oob_indicies[d][i];
+    }
+    qsort(removed, number_removed, sizeof(int), compare_indicies);
+
+    int num_particles = params->number_fluid_particles_local - number_removed;
+
+    // Removed particles below num_particles leave holes, there are as many remaining particles at or above it
+    next = 0;
+    while(next < number_removed && removed[next] < num_particles)
+        next++;
+    hole = 0;
+    for (i=num_particles; i<params->number_fluid_particles_local; i++) {
+        if (next < number_removed && removed[next] == i) {
+            moved[i - num_particles] = -1;
+            next++;
+            continue;
         }
-        else
-            fluid_particle_pointers[oob_pointer_index] = NULL;
-    }
-
-    debug_print("rank %d OOB: num vacant %d\n", rank, out_of_bounds->number_vacancies);
-
-    // If more particles are received than sent add to end of pointer array
-    remaining = total_received - recv_replaced;
-    int pointer_index;
-    int global_index;
-    int max_fluid_pointers = params->number_fluid_particles_local;
-    for(i=0; i<remaining; i++)
-    {
-        pointer_index = params->number_fluid_particles_local + i;
-        global_index = indicies_recv[recv_replaced + i];
-        fluid_particle_pointers[pointer_index] = &fluid_particles[global_index];
-        max_fluid_pointers++;
-    }
-
-    // Update particle pointer array
-    // Go through all possible fluid particles and remove null entries
-    int num_particles = 0;
-    for (i=0; i<max_fluid_pointers; i++) {
-        p = fluid_particle_pointers[i];
-        if (p != NULL) {
-            fluid_particle_pointers[num_particles] = p;
-            fluid_particle_pointers[num_particles]->id = num_particles;
-            num_particles++;
+        copy_particle(particles, i, particles, removed[hole]);
+        moved[i - num_particles] = removed[hole++];
+    }
+
+    out_of_bounds->number_remaining = num_particles;
+
+    return num_particles;
+}
+
+// Update indicies into the particle arrays after remove_oob_particles(), the indicies must not be of particles that left
+void remap_moved_indicies(int *indicies, int number_indicies, oob_t *out_of_bounds)
+{
+    int i;
+
+    for (i=0; i<number_indicies; i++) {
+        if (indicies[i] >= out_of_bounds->number_remaining)
+            indicies[i] = out_of_bounds->moved_indicies[indicies[i] - out_of_bounds->number_remaining];
+    }
+}
+
+// Transfer particles that are out of node bounds
+void transferOOBParticles(fluid_particles_t *particles, oob_t *out_of_bounds, param *params)
+{
+    int i, d;
+    int *neighbor_ranks = params->neighbor_ranks;
+    int num_received[NUMBER_NEIGHBORS];
+    MPI_Request reqs[NUMBER_NEIGHBORS];
+    MPI_Status status;
+
+    // Pack OOB particles into contiguous send buffers
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        reserve_oob_buffer(&out_of_bounds->send_buffers[d], &out_of_bounds->max_send[d], out_of_bounds->number_oob_particles[d]);
+        for (i=0; i<out_of_bounds->number_oob_particles[d]; i++)
+            pack_particle(particles, out_of_bounds->oob_indicies[d][i], &out_of_bounds->send_buffers[d][i]);
+    }
+
+    // Send oob particles to each neighbor, no counts are sent ahead as the receiver probes the message size
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        MPI_Isend(out_of_bounds->send_buffers[d], out_of_bounds->number_oob_particles[d], Particletype, neighbor_ranks[d], OOB_TAG + d, MPI_COMM_COMPUTE, &reqs[d]);
+
+    // Receive oob particles from each neighbor, growing the receive buffers to fit
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        num_received[d] = 0;
+        if(neighbor_ranks[d] != MPI_PROC_NULL) {
+            MPI_Probe(neighbor_ranks[d], OOB_TAG + (d^1), MPI_COMM_COMPUTE, &status);
+            MPI_Get_count(&status, Particletype, &num_received[d]);
         }
+        reserve_oob_buffer(&out_of_bounds->recv_buffers[d], &out_of_bounds->max_recv[d], num_received[d]);
+        MPI_Recv(out_of_bounds->recv_buffers[d], num_received[d], Particletype, neighbor_ranks[d], OOB_TAG + (d^1), MPI_COMM_COMPUTE, MPI_STATUS_IGNORE);
+    }
+
+    MPI_Waitall(NUMBER_NEIGHBORS, reqs, MPI_STATUSES_IGNORE);
+
+    debug_print("OOB: sent left %d, right: %d recv left:%d, right: %d\n", out_of_bounds->number_oob_particles[NEIGHBOR_LEFT], out_of_bounds->number_oob_particles[NEIGHBOR_RIGHT],
+                num_received[NEIGHBOR_LEFT], num_received[NEIGHBOR_RIGHT]);
+
+    int num_particles = remove_oob_particles(particles, out_of_bounds, params);
+
+    // Add received particles to the end of the local particles
+    int total_received = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        total_received += num_received[d];
+    reserve_fluid_particles(particles, num_particles + total_received);
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        for (i=0; i<num_received[d]; i++)
+            unpack_particle(&out_of_bounds->recv_buffers[d][i], particles, num_particles++);
     }
 
     params->number_fluid_particles_local = num_particles;
 
+    // Halo particles were stored after the local particles and have been overwritten
+    params->number_halo_particles = 0;
+    params->number_computed_halo_particles = 0;
+
     // Need to add rank to debug_print
     debug_print("num local: %d\n", num_particles);
+}
+
+// Pack a fused exchange message: a header, the particles leaving towards the neighbor and the edge particles sent as halo
+// Leaving particles within width of the shared boundary are packed first and counted in the header,
+// the sender keeps them as halo particles and the receiver lists them as edge particles
+// Returns the number of floats packed
+int pack_exchange(fluid_particles_t *particles, int *oob_indicies, int number_oob, int *edge_indicies, int number_edge, float boundary_x, float width, float **buffer, int *max_records)
+{
+    int i, pass;
+    int number_kept = 0;
+    int fields = halo_record_fields(HALO_MOTION);
+    int floats = EXCHANGE_HEADER_FIELDS + number_oob*PARTICLE_RECORD_FIELDS + number_edge*fields;
+    float *record;
+
+    reserve_halo_buffer(buffer, max_records, (floats + MAX_HALO_RECORD_FIELDS - 1)/MAX_HALO_RECORD_FIELDS);
+
+    record = *buffer + EXCHANGE_HEADER_FIELDS;
+    for(pass=0; pass<2; pass++) {
+        for(i=0; i<number_oob; i++) {
+            bool kept = fabsf(particles->x[oob_indicies[i]] - boundary_x) <= width;
+            if(kept != (pass == 0))
+                continue;
+            pack_particle(particles, oob_indicies[i], (fluid_particle*)record);
+            record += PARTICLE_RECORD_FIELDS;
+            number_kept += kept;
+        }
+    }
+    for(i=0; i<number_edge; i++) {
+        pack_halo_particle(particles, edge_indicies[i], record, HALO_MOTION);
+        record += fields;
+    }
 
-    // Free indexed types
-    MPI_Type_free(&LeftRecvtype);
-    MPI_Type_free(&RightRecvtype);
-    MPI_Type_free(&LeftMovetype);
-    MPI_Type_free(&RightMovetype);
+    (*buffer)[0] = number_oob;
+    (*buffer)[1] = number_kept;
 
-    free(blocklens_left);
-    free(blocklens_right);
-    free(indicies_left);
-    free(indicies_right);
-    free(blocklens_recv);
-    free(indicies_recv);
+    return floats;
 }
 
+// Receive a fused exchange message of unknown length, growing the receive buffer to fit it
+// Returns the number of floats received
+int receive_exchange(float **buffer, int *max_records, int source, int tag)
+{
+    int count = 0;
+    MPI_Status status;
+
+    if(source != MPI_PROC_NULL) {
+        MPI_Probe(source, tag, MPI_COMM_COMPUTE, &status);
+        MPI_Get_count(&status, MPI_FLOAT, &count);
+    }
+
+    reserve_halo_buffer(buffer, max_records, (count + MAX_HALO_RECORD_FIELDS - 1)/MAX_HALO_RECORD_FIELDS);
+    MPI_Recv(*buffer, count, MPI_FLOAT, source, tag, MPI_COMM_COMPUTE, MPI_STATUS_IGNORE);
+
+    return count;
+}
+
+// Read the counts of a fused exchange message, an empty message has no header
+void exchange_counts(float *buffer, int floats, int *number_oob, int *number_kept, int *number_halo)
+{
+    *number_oob = 0;
+    *number_kept = 0;
+    *number_halo = 0;
+    if(floats) {
+        *number_oob = buffer[0];
+        *number_kept = buffer[1];
+        *number_halo = (floats - EXCHANGE_HEADER_FIELDS - *number_oob*PARTICLE_RECORD_FIELDS)/halo_record_fields(HALO_MOTION);
+    }
+}
+
+// Transfer particles that are out of node bounds and exchange the halo in a single message to each neighbor
+// The edges are updated and the persistent halo requests recreated as in an exchange updating the edges
+// Particles within width of the boundary they crossed are edge particles of their new rank and
+// halo particles of their old rank, so the halo matches an edge update following the transfer
+// Particles arriving from one neighbor are not sent as halo to the other
+// On a 2-D grid a particle that crosses a boundary may join the halo of a rank the sender does not share
+// that boundary with, so the transfer and the edge update are separate exchanges
+void exchangeParticles(fluid_particles_t *particles, edge_t *edges, oob_t *out_of_bounds, neighbor_grid_t *grid, param *params)
+{
+    int i, d;
+    int fields = halo_record_fields(HALO_MOTION);
+    float width = params->tunable_params.smoothing_radius + params->skin;
+    int left = NEIGHBOR_LEFT;
+    int right = NEIGHBOR_RIGHT;
+    int *neighbor_ranks = params->neighbor_ranks;
+
+    if(params->partitions_y > 1) {
+        select_edge_particles(particles, edges, grid, params, true);
+        transferOOBParticles(particles, out_of_bounds, params);
+
+        // Edge particles moved into the place of a leaving particle are remapped and only the arriving particles are checked
+        // Arriving particles may be edge particles of any neighbor
+        int number_arrived = params->number_fluid_particles_local - out_of_bounds->number_remaining;
+        for(d=0; d<NUMBER_NEIGHBORS; d++) {
+            remap_moved_indicies(edges->edge_indicies[d], edges->number_edge_particles[d], out_of_bounds);
+            reserve_edge_indicies(edges, edges->number_edge_particles[d] + number_arrived);
+        }
+        for(i=out_of_bounds->number_remaining; i<params->number_fluid_particles_local; i++)
+            add_edge_particle(edges, i, particles->x[i], particles->y[i], width, params);
+
+        startHaloExchange(particles, edges, params, true, HALO_MOTION);
+        finishHaloExchange(particles, edges, params);
+        return;
+    }
+
+    // Pack leaving particles and remaining edge particles
+    select_edge_particles(particles, edges, grid, params, true);
+    int floats_sent_left = pack_exchange(particles, out_of_bounds->oob_indicies[left], out_of_bounds->number_oob_particles[left],
+                                         edges->edge_indicies[left], edges->number_edge_particles[left],
+                                         params->tunable_params.node_start_x, width, &edges->send_buffers[left], &edges->max_send[left]);
+    int floats_sent_right = pack_exchange(particles, out_of_bounds->oob_indicies[right], out_of_bounds->number_oob_particles[right],
+                                          edges->edge_indicies[right], edges->number_edge_particles[right],
+                                          params->tunable_params.node_end_x, width, &edges->send_buffers[right], &edges->max_send[right]);
+
+    MPI_Isend(edges->send_buffers[right], floats_sent_right, MPI_FLOAT, neighbor_ranks[right], OOB_TAG + right, MPI_COMM_COMPUTE, &edges->update_reqs[0]);
+    MPI_Isend(edges->send_buffers[left], floats_sent_left, MPI_FLOAT, neighbor_ranks[left], OOB_TAG + left, MPI_COMM_COMPUTE, &edges->update_reqs[1]);
+
+    int floats_received_left = receive_exchange(&edges->recv_buffers[left], &edges->max_recv[left], neighbor_ranks[left], OOB_TAG + right);
+    int floats_received_right = receive_exchange(&edges->recv_buffers[right], &edges->max_recv[right], neighbor_ranks[right], OOB_TAG + left);
+
+    int num_received_left, num_arrived_kept_left, num_halo_left;
+    int num_received_right, num_arrived_kept_right, num_halo_right;
+    exchange_counts(edges->recv_buffers[left], floats_received_left, &num_received_left, &num_arrived_kept_left, &num_halo_left);
+    exchange_counts(edges->recv_buffers[right], floats_received_right, &num_received_right, &num_arrived_kept_right, &num_halo_right);
+
+    // Particles are never sent to a missing neighbor
+    int num_kept_left = (int)edges->send_buffers[left][1];
+    int num_kept_right = (int)edges->send_buffers[right][1];
+
+    debug_print("exchange: sent left %d, right: %d recv left:%d, right: %d\n", out_of_bounds->number_oob_particles[left], out_of_bounds->number_oob_particles[right], num_received_left, num_received_right);
+
+    int num_particles = remove_oob_particles(particles, out_of_bounds, params);
+
+    // Remaining edge particles keep their order, those moved into the place of a leaving particle are remapped
+    remap_moved_indicies(edges->edge_indicies[left], edges->number_edge_particles[left], out_of_bounds);
+    remap_moved_indicies(edges->edge_indicies[right], edges->number_edge_particles[right], out_of_bounds);
+
+    // Make room for the arriving particles, the halo and the arriving particles kept as edge particles
+    reserve_fluid_particles(particles, num_particles + num_received_left + num_received_right
+                                       + num_halo_left + num_kept_left + num_halo_right + num_kept_right);
+    reserve_edge_indicies(edges, edges->number_edge_particles[left] + num_arrived_kept_left);
+    reserve_edge_indicies(edges, edges->number_edge_particles[right] + num_arrived_kept_right);
+
+    // Add received particles to the end of the local particles, the kept ones are edge particles of the sender
+    float *record = edges->recv_buffers[left] + EXCHANGE_HEADER_FIELDS;
+    for (i=0; i<num_received_left; i++) {
+        if(i < num_arrived_kept_left)
+            edges->edge_indicies[left][edges->number_edge_particles[left]++] = num_particles;
+        unpack_particle((fluid_particle*)record, particles, num_particles++);
+        record += PARTICLE_RECORD_FIELDS;
+    }
+    float *halo_records_left = record;
+    record = edges->recv_buffers[right] + EXCHANGE_HEADER_FIELDS;
+    for (i=0; i<num_received_right; i++) {
+        if(i < num_arrived_kept_right)
+            edges->edge_indicies[right][edges->number_edge_particles[right]++] = num_particles;
+        unpack_particle((fluid_particle*)record, particles, num_particles++);
+        record += PARTICLE_RECORD_FIELDS;
+    }
+    float *halo_records_right = record;
+
+    params->number_fluid_particles_local = num_particles;
+
+    // Unpack halo particles directly after the local particles, the computed right halo is first
+    // Each neighbor's edge particles are followed by the particles it received that are kept
+    int halo_index = num_particles;
+    for (i=0; i<num_halo_right; i++)
+        unpack_halo_particle(&halo_records_right[i*fields], particles, halo_index++, HALO_MOTION);
+    for (i=0; i<num_kept_right; i++)
+        unpack_particle((fluid_particle*)&edges->send_buffers[right][EXCHANGE_HEADER_FIELDS + i*PARTICLE_RECORD_FIELDS], particles, halo_index++);
+    for (i=0; i<num_halo_left; i++)
+        unpack_halo_particle(&halo_records_left[i*fields], particles, halo_index++, HALO_MOTION);
+    for (i=0; i<num_kept_left; i++)
+        unpack_particle((fluid_particle*)&edges->send_buffers[left][EXCHANGE_HEADER_FIELDS + i*PARTICLE_RECORD_FIELDS], particles, halo_index++);
+
+    edges->number_halo_particles[left] = num_halo_left + num_kept_left;
+    edges->number_halo_particles[right] = num_halo_right + num_kept_right;
+    params->number_halo_particles = edges->number_halo_particles[left] + edges->number_halo_particles[right];
+    params->number_computed_halo_particles = edges->number_halo_particles[right];
+
+    // New halo particles have not been displaced
+    memset(&particles->halo_d_x[num_particles], 0, params->number_halo_particles*sizeof(float));
+    memset(&particles->halo_d_y[num_particles], 0, params->number_halo_particles*sizeof(float));
+
+    debug_print("halo: will send %d to left, %d to right, recv %d from left, %d from right\n", edges->number_edge_particles[left], edges->number_edge_particles[right],
+                edges->number_halo_particles[left], edges->number_halo_particles[right]);
+
+    MPI_Waitall(2, edges->update_reqs, MPI_STATUSES_IGNORE);
+
+    // Exchanges until the next edge update have the same counts and buffers
+    for(d=0; d<NUMBER_NEIGHBORS; d++) {
+        reserve_halo_buffer(&edges->send_buffers[d], &edges->max_send[d], edges->number_edge_particles[d]);
+        reserve_halo_buffer(&edges->recv_buffers[d], &edges->max_recv[d], edges->number_halo_particles[d]);
+    }
+    reserve_shared_halos(edges);
+    init_halo_requests(edges, params);
+}
+
+// Distance to move the boundary between two partitions, negative toward the partition before it
+// The boundary moves into the more loaded partition by the width that carries DIFFUSION_RATE of half the load difference,
+// assuming the load is spread evenly across the partition
+// A partition gives up at most half of its width beyond 2h through each boundary so it stays at least 2h wide
+// Both ranks sharing the boundary pass the same values in the same order so they move it identically
+float diffusion_shift(double load_before, float width_before, double load_after, float width_after, float h)
+{
+    double difference = load_before - load_after;
+    float shift, bound;
+
+    if(fabs(difference) <= DIFFUSION_TOLERANCE*0.5*(load_before + load_after))
+        return 0.0f;
+
+    if(difference > 0.0) {
+        shift = -DIFFUSION_RATE*0.5*difference/load_before*width_before;
+        bound = 0.5f*(width_before - 2.0f*h);
+        return bound > 0.0f ? fmaxf(shift, -bound) : 0.0f;
+    }
+    else {
+        shift = -DIFFUSION_RATE*0.5*difference/load_after*width_after;
+        bound = 0.5f*(width_after - 2.0f*h);
+        return bound > 0.0f ? fminf(shift, bound) : 0.0f;
+    }
+}
+
+// Balance the partitions without the render node by exchanging load with the neighboring ranks
+// The load of a column or row is the sum of the busy times of its ranks so ranks sharing a boundary move it together
+// All compute ranks must call this together, the changed bounds cause the neighbor lists to be rebuilt
+void diffuse_partitions(param *params, float busy_time)
+{
+    int d;
+    int *neighbor_ranks = params->neighbor_ranks;
+    double load = busy_time;
+    double own[2][2], neighbor[NUMBER_NEIGHBORS][2];
+    float h = params->tunable_params.smoothing_radius;
+    float shift[NUMBER_NEIGHBORS] = {0.0f};
+
+    // Load and width of this ranks column, sent left and right, and row, sent down and up
+    MPI_Allreduce(&load, &own[0][0], 1, MPI_DOUBLE, MPI_SUM, params->column_comm);
+    MPI_Allreduce(&load, &own[1][0], 1, MPI_DOUBLE, MPI_SUM, params->row_comm);
+    own[0][1] = params->tunable_params.node_end_x - params->tunable_params.node_start_x;
+    own[1][1] = params->tunable_params.node_end_y - params->tunable_params.node_start_y;
+
+    for(d=NEIGHBOR_LEFT; d<=NEIGHBOR_UP; d++) {
+        neighbor[d][0] = 0.0;
+        neighbor[d][1] = 0.0;
+        MPI_Sendrecv(own[d/2], 2, MPI_DOUBLE, neighbor_ranks[d], BALANCE_TAG + d,
+                     neighbor[d], 2, MPI_DOUBLE, neighbor_ranks[d], BALANCE_TAG + (d^1), MPI_COMM_COMPUTE, MPI_STATUS_IGNORE);
+    }
+
+    if(neighbor_ranks[NEIGHBOR_LEFT] != MPI_PROC_NULL)
+        shift[NEIGHBOR_LEFT] = diffusion_shift(neighbor[NEIGHBOR_LEFT][0], neighbor[NEIGHBOR_LEFT][1], own[0][0], own[0][1], h);
+    if(neighbor_ranks[NEIGHBOR_RIGHT] != MPI_PROC_NULL)
+        shift[NEIGHBOR_RIGHT] = diffusion_shift(own[0][0], own[0][1], neighbor[NEIGHBOR_RIGHT][0], neighbor[NEIGHBOR_RIGHT][1], h);
+    if(neighbor_ranks[NEIGHBOR_DOWN] != MPI_PROC_NULL)
+        shift[NEIGHBOR_DOWN] = diffusion_shift(neighbor[NEIGHBOR_DOWN][0], neighbor[NEIGHBOR_DOWN][1], own[1][0], own[1][1], h);
+    if(neighbor_ranks[NEIGHBOR_UP] != MPI_PROC_NULL)
+        shift[NEIGHBOR_UP] = diffusion_shift(own[1][0], own[1][1], neighbor[NEIGHBOR_UP][0], neighbor[NEIGHBOR_UP][1], h);
+
+    params->tunable_params.node_start_x += shift[NEIGHBOR_LEFT];
+    params->tunable_params.node_end_x += shift[NEIGHBOR_RIGHT];
+    params->tunable_params.node_start_y += shift[NEIGHBOR_DOWN];
+    params->tunable_params.node_end_y += shift[NEIGHBOR_UP];
+}
@@ -28,45 +28,164 @@ THE SOFTWARE.
 typedef struct EDGE_T edge_t;
 typedef struct OOB_T oob_t;
 
+// Neighbor directions on the Cartesian grid of compute ranks
+// Opposite directions differ only in the lowest bit so a message sent in direction d arrives from direction d^1
+#define NEIGHBOR_LEFT 0
+#define NEIGHBOR_RIGHT 1
+#define NEIGHBOR_DOWN 2
+#define NEIGHBOR_UP 3
+#define NEIGHBOR_DOWN_LEFT 4
+#define NEIGHBOR_UP_RIGHT 5
+#define NEIGHBOR_DOWN_RIGHT 6
+#define NEIGHBOR_UP_LEFT 7
+#define NUMBER_NEIGHBORS 8
+
 #include "fluid.h"
 #include "mpi.h"
 
+// Halo record layouts
+// Each exchange sends only the fields read from halo particles before the next exchange
+// A record is HALO_RECORD_FIELDS[layout] floats, the motion record is the start of the density record
+#define HALO_DENSITY 0 // x, y, v_x, v_y, density, density_near for density completion and relaxation
+#define HALO_MOTION 1  // x, y, v_x, v_y for the viscosity sweep after relaxation
+#define NUMBER_HALO_RECORDS 2
+#define MAX_HALO_RECORD_FIELDS 6
+
+// Fused migration and halo messages
+// A header of EXCHANGE_HEADER_FIELDS floats holds the number of migrating particles and the number kept as halo by the sender,
+// followed by the migrating particle records and HALO_MOTION records of the sender's edge particles
+#define EXCHANGE_HEADER_FIELDS 2
+#define PARTICLE_RECORD_FIELDS 10 // Floats in a fluid_particle record
+
+// Displacements given to halo particles are returned to their owners as records of RETURN_RECORD_FIELDS floats, d_x and d_y
+#define RETURN_RECORD_FIELDS 2
+
+// Message tags, the direction a message is sent in is added
+#define HALO_TAG 4312
+#define OOB_TAG 2522
+#define RETURN_TAG 6011
+#define BALANCE_TAG 7211
+#define PARK_TAG 19
+
+// Microseconds a parked rank sleeps between checks for a message from the render node
+#define PARK_INTERVAL 10000
+
+// Partitions balanced by the compute ranks move their shared boundaries by diffusion of the measured load
+// Each frame a boundary moves DIFFUSION_RATE of the way toward equal load if the loads on either side differ by more than DIFFUSION_TOLERANCE
+#define DIFFUSION_RATE 0.5f
+#define DIFFUSION_TOLERANCE 0.1f
+
 // MPI globals
 MPI_Datatype Particletype;
+MPI_Datatype HaloRecordtypes[NUMBER_HALO_RECORDS];
 MPI_Datatype TunableParamtype;
-MPI_Datatype LeftEdgetype;
-MPI_Datatype RightEdgetype;
 MPI_Comm MPI_COMM_COMPUTE;
+MPI_Comm MPI_COMM_AWAKE; // Render node and the compute ranks that are not parked, MPI_COMM_NULL on a parked rank
+MPI_Comm MPI_COMM_COMPUTE_AWAKE; // Compute ranks that are not parked
 MPI_Group group_world;
 MPI_Group group_compute;
 MPI_Group group_render;
+int host_noncompute_ranks; // Ranks on this ranks host that are not compute ranks, set by create_communicators()
 
 // Particles that are within 2*h distance of node edge
+// A particle near a corner is an edge particle of both sides and the diagonal neighbor
 struct EDGE_T {
-    int max_edge_particles;
-    fluid_particle **edge_pointers_left;
-    fluid_particle **edge_pointers_right;
-    int number_edge_particles_left;
-    int number_edge_particles_right;
-    MPI_Request reqs[4];
+    int max_edge_particles; // Allocated length of each edge index array, grown as edges are selected
+    int *edge_indicies[NUMBER_NEIGHBORS]; // Indicies in particle arrays of particles near the edge shared with each neighbor
+    int number_edge_particles[NUMBER_NEIGHBORS];
+    float *send_buffers[NUMBER_NEIGHBORS]; // Packed edge particle records
+    float *recv_buffers[NUMBER_NEIGHBORS]; // Packed halo particle records
+    int max_send[NUMBER_NEIGHBORS]; // Allocated length of each packed buffer in records, grown to the largest exchange seen
+    int max_recv[NUMBER_NEIGHBORS];
+    int number_halo_particles[NUMBER_NEIGHBORS];  // Halo particles received from each neighbor
+    int record; // Layout of the exchange in progress
+    bool updating; // The exchange in progress updates the edges
+    MPI_Request update_reqs[NUMBER_NEIGHBORS]; // Sends of an exchange updating the edges
+    MPI_Request reqs[NUMBER_HALO_RECORDS][2*NUMBER_NEIGHBORS]; // Persistent requests for each layout, initialized when the edges are updated and restarted by each exchange
+    // Returned displacements are sent in the directions this rank computes halo pairs for and received from the others
+    float *return_buffers[NUMBER_NEIGHBORS]; // Displacements of the computed halo particles or of this ranks edge particles
+    int max_return[NUMBER_NEIGHBORS];
+    MPI_Request return_reqs[NUMBER_NEIGHBORS]; // Persistent send or receive in each direction
+    // Neighbors on the same host read packed edge records from a shared memory window instead of receiving them
+    // Each pair of neighbors has its own window so only the pair synchronises to read or grow it
+    MPI_Comm pair_comms[NUMBER_NEIGHBORS]; // This rank and the neighbor in each direction, MPI_COMM_NULL if the halo is not shared
+    MPI_Win windows[NUMBER_NEIGHBORS];
+    void *segments[NUMBER_NEIGHBORS]; // This ranks part of each window, written with the edge particles for the neighbor
+    void *neighbor_segments[NUMBER_NEIGHBORS]; // The neighbors part of each window, read for the halo
+    int max_shared_particles[NUMBER_NEIGHBORS]; // Records each parity of a segment holds, the same on both ranks of the pair
+    bool shared[NUMBER_NEIGHBORS]; // Halo of the neighbor is read from its segment
+    int pair_order[NUMBER_NEIGHBORS]; // Shared directions by increasing neighbor rank, the order pair windows are created, grown and freed in
+    int number_pairs;
+    int parity; // Half of each segment written by the exchange in progress, alternates so the halo messages alone order writes after reads
+    float returned_displacement; // Bound on the displacement the last return exchange applied to any edge particle
 };
 
 // Particles that have left the node
 struct OOB_T {
-    int max_oob_particles;
-    int *oob_pointer_indicies_left; // Indicies in particle pointer array for particles traveling left
-    int *oob_pointer_indicies_right;
-    int number_oob_particles_left;
-    int number_oob_particles_right;
-    int *vacant_indicies; // Indicies in particle array that are vacant
-    int number_vacancies;
+    int max_oob_particles; // Allocated length of each out of bounds index array, grown as particles leave
+    int *oob_indicies[NUMBER_NEIGHBORS]; // Indicies in particle arrays for particles traveling to each neighbor
+    int number_oob_particles[NUMBER_NEIGHBORS];
+    fluid_particle *send_buffers[NUMBER_NEIGHBORS]; // Packed particles leaving the node, grown as required
+    fluid_particle *recv_buffers[NUMBER_NEIGHBORS]; // Packed particles entering the node
+    int max_send[NUMBER_NEIGHBORS];
+    int max_recv[NUMBER_NEIGHBORS];
+    int *removed_indicies; // Sorted indicies of the particles removed by the last transfer
+    int *moved_indicies;   // New index of each particle from number_remaining up after the last transfer, -1 if it left
+    int max_removed;
+    int number_remaining;  // Particles remaining after the last transfer, before the arriving particles were added
 };
 
 void createMpiTypes();
 void create_communicators();
 void freeMpiTypes();
-void startHaloExchange(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles,  edge_t *edges, param *params);
-void finishHaloExchange(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles,  edge_t *edges, param *params);
-void transferOOBParticles(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles, oob_t *out_of_bounds, param *params);
+void create_compute_grid(int partitions_y, param *params);
+void set_neighbor_ranks(param *params, int awake_ranks);
+void split_awake_ranks(int awake_ranks);
+void update_awake_ranks(param *params, edge_t *edges, int awake_ranks, bool shared_halos);
+void park_rank(param *params);
+int neighbor_direction(int offset_x, int offset_y);
+void neighbor_offset(int direction, int *offset_x, int *offset_y);
+void pack_particle(fluid_particles_t *particles, int i, fluid_particle *record);
+void unpack_particle(fluid_particle *record, fluid_particles_t *particles, int i);
+void alloc_halo_buffers(edge_t *edges);
+void free_halo_buffers(edge_t *edges);
+bool reserve_halo_buffer(float **buffer, int *max_particles, int number_particles);
+void init_halo_requests(edge_t *edges, param *params);
+size_t init_shared_halos(edge_t *edges, param *params);
+size_t alloc_shared_segment(edge_t *edges, int direction);
+void free_shared_segment(edge_t *edges, int direction);
+void free_shared_halos(edge_t *edges);
+void reserve_shared_halos(edge_t *edges);
+int *shared_halo_count(void *segment, int parity);
+float *shared_halo_records(edge_t *edges, void *segment, int parity, int direction);
+bool halo_computed(int direction);
+int halo_direction(int n);
+void apply_returned_displacement(fluid_particles_t *particles, int i, float *record, float dt);
+void startReturnExchange(fluid_particles_t *particles, edge_t *edges, param *params);
+void finishReturnExchange(fluid_particles_t *particles, edge_t *edges, param *params, bool halo_refreshed);
+int receive_halo(float **buffer, int *max_particles, int source, int tag, int record);
+int halo_record_fields(int record);
+void pack_halo_particle(fluid_particles_t *particles, int i, float *record, int layout);
+void unpack_halo_particle(float *record, fluid_particles_t *particles, int i, int layout);
+bool reserve_edge_indicies(edge_t *edges, int number_indicies);
+void add_edge_particle(edge_t *edges, int i, float x, float y, float width, param *params);
+void select_edge_particles(fluid_particles_t *particles, edge_t *edges, neighbor_grid_t *grid, param *params, bool remaining);
+void startHaloExchange(fluid_particles_t *particles, edge_t *edges, param *params, bool update_edges, int record);
+void finishHaloExchange(fluid_particles_t *particles, edge_t *edges, param *params);
+void alloc_oob_buffers(oob_t *out_of_bounds);
+void free_oob_buffers(oob_t *out_of_bounds);
+bool reserve_oob_buffer(fluid_particle **buffer, int *max_particles, int number_particles);
+bool reserve_oob_indicies(oob_t *out_of_bounds, int number_indicies);
+int oob_direction(float x, float y, param *params);
+bool reserve_removed_indicies(oob_t *out_of_bounds, int number_removed);
+int remove_oob_particles(fluid_particles_t *particles, oob_t *out_of_bounds, param *params);
+void remap_moved_indicies(int *indicies, int number_indicies, oob_t *out_of_bounds);
+void transferOOBParticles(fluid_particles_t *particles, oob_t *out_of_bounds, param *params);
+int pack_exchange(fluid_particles_t *particles, int *oob_indicies, int number_oob, int *edge_indicies, int number_edge, float boundary_x, float width, float **buffer, int *max_records);
+int receive_exchange(float **buffer, int *max_records, int source, int tag);
+void exchange_counts(float *buffer, int floats, int *number_oob, int *number_kept, int *number_halo);
+float diffusion_shift(double load_before, float width_before, double load_after, float width_after, float h);
+void diffuse_partitions(param *params, float busy_time);
+void exchangeParticles(fluid_particles_t *particles, edge_t *edges, oob_t *out_of_bounds, neighbor_grid_t *grid, param *params);
 
 #endif
@@ -400,37 +400,37 @@ void set_fluid_b(render_t *render_state)
     }
 }
 
-// Set last partition to be outside of simulation bounds
-// Effectively removing it from the simulation
+// Remove the last partition from the simulation
+// Its node hands its particles to the node before it over several frames and is then parked, see update_partition_handover()
 void remove_partition(render_t *render_state)
 {
     if(render_state->num_compute_procs_active == 1) 
 	return;
 
-    int num_compute_procs_active = render_state->num_compute_procs_active;
-
-    int removed_rank = num_compute_procs_active-1;
-
-    // Set new end position of last active proc to end of simulation
-    render_state->master_params[removed_rank-1].node_end_x = render_state->master_params[removed_rank].node_end_x;
+    // Only slabs can be removed, a 2-D grid of ranks keeps every rank active
+    // Ranks balancing their own partitions also stay active
+    if(render_state->partitions_y > 1 || render_state->compute_balanced)
+        return;
 
-    // Send start and end x out of sim bounds
-    float position = render_state->master_params[removed_rank].node_end_x + 1.0; // +1.0 ensures it's out of the simulation bounds
-    render_state->master_params[removed_rank].node_start_x = position;
-    render_state->master_params[removed_rank].node_end_x = position;
+    int removed_rank = render_state->num_compute_procs_active-1;
 
     // Set active to false for removed rank
     render_state->master_params[removed_rank].active = false;
+    render_state->joining[removed_rank] = false;
 
     render_state->num_compute_procs_active -= 1;
 }
 
 // Add on partition to right side that has been removed
+// Its node is woken if parked and grows from the end of the tank over several frames
 void add_partition(render_t *render_state)
 {
     if(render_state->num_compute_procs_active == render_state->num_compute_procs)
 	return;
 
+    if(render_state->partitions_y > 1 || render_state->compute_balanced)
+        return;
+
     // Length of currently last partiion
     int num_compute_procs_active = render_state->num_compute_procs_active;
     float length = render_state->master_params[num_compute_procs_active-1].node_end_x - render_state->master_params[num_compute_procs_active-1].node_start_x;
@@ -440,16 +440,9 @@ void add_partition(render_t *render_state)
     if(length < 2.5*h)
 	return;
 
-    // Set end of added partition to current end location
-    render_state->master_params[num_compute_procs_active].node_end_x = render_state->master_params[num_compute_procs_active-1].node_end_x;
-    
-    // Divide the current last partition in half
-    float new_x = render_state->master_params[num_compute_procs_active-1].node_start_x + length*0.5;
-    render_state->master_params[num_compute_procs_active-1].node_end_x = new_x;
-    render_state->master_params[num_compute_procs_active].node_start_x = new_x;
-
     // Set active to true for added rank
     render_state->master_params[num_compute_procs_active].active = true;
+    render_state->joining[num_compute_procs_active] = true;
 
     render_state->num_compute_procs_active += 1;
 }
@@ -24,6 +24,7 @@ THE SOFTWARE.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <limits.h>
 
@@ -33,6 +34,8 @@ THE SOFTWARE.
 #include "geometry.h"
 #include "fluid.h"
 #include "communication.h"
+#include "simd.h"
+#include "threads.h"
 
 #ifdef LIGHT
 #include "rgb_light.h"
@@ -43,13 +46,28 @@ THE SOFTWARE.
 #include "blink1_light.h"
 #endif
 
+// The bench target supplies its own main
+#ifndef BENCH
 int main(int argc, char *argv[])
 {
-    int return_value;
+    int i, return_value;
+
+    // Progress outstanding halo and render sends from a separate thread while compute ranks compute, enabled by --progress
+    // Off by default as MPI_THREAD_MULTIPLE can slow every MPI call and the thread takes a core from the thread pool
+    // Every rank is passed the same arguments so all agree on it
+    bool progress = false;
+    for(i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--progress") == 0)
+            progress = true;
+    }
 
     // Initialize MPI
-    MPI_Init(&argc, &argv);
-    int rank;
+    // The progress thread calls MPI alongside the main thread which needs MPI_THREAD_MULTIPLE
+    int rank, provided;
+    if(progress)
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    else
+        MPI_Init(&argc, &argv);
 
     // Rank in world space
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
@@ -62,13 +80,14 @@ int main(int argc, char *argv[])
     if(rank == 0)
         return_value = start_renderer();
     else
-        start_simulation();
+        start_simulation(progress);
 
     MPI_Finalize();
     return return_value;
 }
+#endif
 
-void start_simulation()
+void start_simulation(bool progress)
 {
     int rank, nprocs;
 
@@ -77,7 +96,22 @@ void start_simulation()
 
     printf("compute rank: %d, num compute procs: %d \n",rank, nprocs);
 
+    // Select the pair kernels for this nodes CPU
+    init_simd_kernels();
+
+    // Started before the thread pool which leaves the progress thread a core
+    init_progress_thread(progress);
+
+    // Threads per compute rank, 0 divides the cores of each node among the ranks on it
+    int threads_per_rank = 0;
+    init_thread_pool(threads_per_rank ? threads_per_rank : default_thread_count());
+
     param params;
+
+    // Rows of compute ranks, 1 splits the tank into x slabs and 0 lets MPI choose a 2-D decomposition
+    // Rank 0 is at the lower left of the grid and ranks increase along y first
+    int partitions_y = 1;
+    create_compute_grid(partitions_y, &params);
     AABB_t water_volume_global;
     AABB_t boundary_global;
     edge_t edges;
@@ -87,6 +121,7 @@ void start_simulation()
 
     params.tunable_params.kill_sim = false;
     params.tunable_params.active = true;
+    params.tunable_params.awake_ranks = nprocs;
     params.tunable_params.g = 6.0f;
     params.tunable_params.time_step = 1.0f/30.0f;
     params.tunable_params.k = 0.2f;
@@ -106,6 +141,10 @@ void start_simulation()
     params.tunable_params.time_step /= (float)steps_per_frame;
     #endif
 
+    // Number of steps between reordering particle storage by cell, 0 disables
+    int steps_per_sort = 10;
+    int next_sort_step = 0;
+
     // The number of particles used may differ slightly
     #ifdef RASPI
     params.number_fluid_particles_global = 1500;
@@ -136,6 +175,8 @@ void start_simulation()
 
     int start_x;  // where in x direction this nodes particles start
     int number_particles_x; // number of particles in x direction for this node
+    int start_y;
+    int number_particles_y;
 
     // Fluid area in initial configuration
     float area = (water_volume_global.max_x - water_volume_global.min_x) * (water_volume_global.max_y - water_volume_global.min_y);
@@ -144,22 +185,38 @@ void start_simulation()
     float spacing_particle = pow(area/params.number_fluid_particles_global,1.0/2.0);
 
     // Divide problem set amongst nodes
-    partitionProblem(&boundary_global, &water_volume_global, &start_x, &number_particles_x, spacing_particle, &params);
+    partitionProblem(&boundary_global, &water_volume_global, &start_x, &number_particles_x, &start_y, &number_particles_y, spacing_particle, &params);
 
     // Set local/global number of particles to allocate
     setParticleNumbers(&boundary_global, &water_volume_global, &edges, &out_of_bounds, number_particles_x, spacing_particle, &params);
 
-    // We will allocate enough room for all particles on single node
-    // We also must take into account halo particles are placed onto the end of the max particle index
-    // So this value can be even greater than the number of global
-    // Before reaching this point the program should, but doesn't, intelligenly clean up fluid_particles
-    int max_fluid_particles_local = 2*params.number_fluid_particles_global;
+    // Storage is sized by the initial local particles and grows as particles arrive
+    // Halo particles are placed directly after the local particles so room is left for them
+    int max_fluid_particles_local = 2*number_particles_x*number_particles_y;
 
     // Smoothing radius, h
     params.tunable_params.smoothing_radius = 2.0f*spacing_particle;
 
     printf("smoothing radius: %f\n", params.tunable_params.smoothing_radius);
 
+    // Neighbor lists are reused until a particle moves skin/2, 0 rebuilds the lists every hash
+    params.skin = 0.25f*params.tunable_params.smoothing_radius;
+
+    // Store pair geometry with the neighbor lists so kernels may skip the sqrt and divide
+    // Relaxation leaves the geometry stale for the next viscosity sweep, so only relax_cached_geometry reads it,
+    // otherwise the pair storage is only overhead, see make bench
+    bool cache_pair_geometry = false;
+    // Relaxation displaces particles using the geometry from before relaxation, false uses live positions
+    // Stale geometry ignores the displacements earlier cells made, turning the Gauss-Seidel like relaxation into a Jacobi one
+    // whose displacements converge more slowly
+    params.relax_cached_geometry = false;
+
+    // Neighbors on the same host read halo particles from shared memory, false sends them as messages
+    bool shared_halos = true;
+
+    // Compute ranks move the partitions by diffusing load between neighbors, false leaves balancing to the render node
+    bool balance_locally = false;
+
     // Send initial world dimensions and max particle count to render node
     if(rank == 0) {
         float world_dims[2];
@@ -167,76 +224,98 @@ void start_simulation()
         world_dims[1] = boundary_global.max_y;
         MPI_Send(world_dims, 2, MPI_FLOAT, 0, 8, MPI_COMM_WORLD);
 	MPI_Send(&params.number_fluid_particles_global, 1, MPI_INT, 0, 9, MPI_COMM_WORLD);
+        int partitions[3];
+        partitions[0] = params.partitions_x;
+        partitions[1] = params.partitions_y;
+        partitions[2] = balance_locally;
+        MPI_Send(partitions, 3, MPI_INT, 0, 10, MPI_COMM_WORLD);
     }
 
     // Neighbor grid setup
     neighbor_grid_t neighbor_grid;
-    neighbor_grid.max_bucket_size = 100;
-    neighbor_grid.max_neighbors = neighbor_grid.max_bucket_size*4;
-    neighbor_grid.spacing = params.tunable_params.smoothing_radius;
+    neighbor_grid.spacing = params.tunable_params.smoothing_radius + params.skin;
+    neighbor_grid.force_rebuild = true;
+    neighbor_grid.interior_begin_x = 0;
+    neighbor_grid.interior_end_x = 0;
+    neighbor_grid.interior_begin_y = 0;
+    neighbor_grid.interior_end_y = 0;
 
     size_t total_bytes = 0;
     size_t bytes;
-    // Allocate fluid particles array
-    bytes = max_fluid_particles_local * sizeof(fluid_particle);
-    total_bytes+=bytes;
-    fluid_particle *fluid_particles = malloc(bytes);
-    if(fluid_particles == NULL)
-        printf("Could not allocate fluid_particles\n");
-
-    // Allocate (x,y) coordinate array, transfer pixel coords
-    bytes = 2 * max_fluid_particles_local * sizeof(short);
+    // Allocate fluid particle arrays
+    fluid_particles_t particles;
+    total_bytes += alloc_fluid_particles(&particles, max_fluid_particles_local);
+
+    // Allocate scratch arrays used to reorder fluid particles by cell
+    fluid_particles_t sorted_particles;
+    if(steps_per_sort)
+        total_bytes += alloc_fluid_particles(&sorted_particles, max_fluid_particles_local);
+
+    // Allocate (x,y) coordinate array, transfer pixel coords, grown with the particle arrays
+    int max_coords = max_fluid_particles_local;
+    bytes = 2 * max_coords * sizeof(short);
     total_bytes+=bytes;
     short *fluid_particle_coords = malloc(bytes);
     if(fluid_particle_coords == NULL)
         printf("Could not allocate fluid_particle coords\n");
 
-    // Allocate pointer array used to traverse non vacant particles
-    bytes = max_fluid_particles_local * sizeof(fluid_particle*);
-    total_bytes+=bytes;
-    fluid_particle **fluid_particle_pointers = malloc(bytes);
-    if(fluid_particle_pointers == NULL)
-        printf("Could not allocate fluid_particle_pointers\n");
-
-    // Allocate neighbor array
-    neighbor *neighbors = calloc(max_fluid_particles_local, sizeof(neighbor));
-    fluid_particle **fluid_neighbors = calloc(max_fluid_particles_local * neighbor_grid.max_neighbors, sizeof(fluid_particle *));
-    // Set pointer in each bucket
-    for(i=0; i< max_fluid_particles_local; i++ )
-        neighbors[i].fluid_neighbors = &(fluid_neighbors[i*neighbor_grid.max_neighbors]);
-
-    neighbor_grid.neighbors = neighbors;
-    total_bytes+= (max_fluid_particles_local*sizeof(neighbor) + neighbor_grid.max_neighbors*sizeof(fluid_particle *));
-    if(neighbors == NULL || fluid_neighbors == NULL)
-        printf("Could not allocate neighbors\n");
+    // Allocate neighbor lists, pair storage grows with the number of pairs found and rows with the particle arrays
+    total_bytes += alloc_neighbor_list(&neighbor_grid.fluid_neighbors, max_fluid_particles_local, cache_pair_geometry);
+    total_bytes += alloc_neighbor_list(&neighbor_grid.halo_neighbors, max_fluid_particles_local, cache_pair_geometry);
+    total_bytes += alloc_neighbor_list(&neighbor_grid.mirror_neighbors, max_fluid_particles_local, cache_pair_geometry);
 
     // UNIFORM GRID HASH
-    neighbor_grid.size_x = ceil((boundary_global.max_x - boundary_global.min_x) / neighbor_grid.spacing);
-    neighbor_grid.size_y = ceil((boundary_global.max_y - boundary_global.min_y) / neighbor_grid.spacing);
-    unsigned int length_hash = neighbor_grid.size_x * neighbor_grid.size_y;
+    // The grid only covers the cells of the domain around this nodes partition and is moved with it, see place_grid()
+    neighbor_grid.domain_size_x = ceil((boundary_global.max_x - boundary_global.min_x) / neighbor_grid.spacing);
+    neighbor_grid.domain_size_y = ceil((boundary_global.max_y - boundary_global.min_y) / neighbor_grid.spacing);
+    // Cell list, sized by number of cells plus number of particles(fluid + halo)
+    // Cell arrays grow as the partition widens and per particle arrays grow with the particle arrays
+    // Counts start zeroed as the pair sweeps walk the cells before the first hash
+    neighbor_grid.max_cells = 0;
+    neighbor_grid.number_blocks = 0;
+    neighbor_grid.cell_starts = NULL;
+    neighbor_grid.cell_counts = NULL;
+    place_grid(&neighbor_grid, &params);
+    unsigned int length_hash = neighbor_grid.max_cells;
     printf("grid x: %d grid y %d\n", neighbor_grid.size_x, neighbor_grid.size_y);
-    bucket_t* grid_buckets = calloc(length_hash, sizeof(bucket_t));
-    fluid_particle **bucket_particles = calloc(length_hash * neighbor_grid.max_bucket_size, sizeof(fluid_particle *));
-    neighbor_grid.grid_buckets = grid_buckets;
-    for(i=0; i < length_hash; i++)
-	grid_buckets[i].fluid_particles = &(bucket_particles[i*neighbor_grid.max_bucket_size]);
-    total_bytes+= (length_hash * sizeof(bucket_t) + neighbor_grid.max_bucket_size * sizeof(fluid_particle *));
-    if(grid_buckets == NULL || bucket_particles == NULL)
+    neighbor_grid.max_particles = max_fluid_particles_local;
+    neighbor_grid.cell_particles = malloc(max_fluid_particles_local * sizeof(unsigned int));
+    neighbor_grid.particle_cells = malloc(max_fluid_particles_local * sizeof(unsigned int));
+    total_bytes+= ((2*length_hash+1) * sizeof(unsigned int) + 2*max_fluid_particles_local * sizeof(unsigned int));
+    if(neighbor_grid.cell_starts == NULL || neighbor_grid.cell_counts == NULL || neighbor_grid.cell_particles == NULL || neighbor_grid.particle_cells == NULL)
         printf("Could not allocate hash\n");
-
-    // Allocate edge index arrays
-    edges.edge_pointers_left = malloc(edges.max_edge_particles * sizeof(fluid_particle*));
-    edges.edge_pointers_right = malloc(edges.max_edge_particles * sizeof(fluid_particle*));
-    // Allocate out of bound index arrays
-    out_of_bounds.oob_pointer_indicies_left = malloc(out_of_bounds.max_oob_particles * sizeof(int));
-    out_of_bounds.oob_pointer_indicies_right = malloc(out_of_bounds.max_oob_particles * sizeof(int));
-    out_of_bounds.vacant_indicies = malloc(2*out_of_bounds.max_oob_particles * sizeof(int));
+    // Positions the neighbor lists were built from
+    neighbor_grid.build_x = malloc(max_fluid_particles_local * sizeof(float));
+    neighbor_grid.build_y = malloc(max_fluid_particles_local * sizeof(float));
+    total_bytes+= 2*max_fluid_particles_local * sizeof(float);
+    if(neighbor_grid.build_x == NULL || neighbor_grid.build_y == NULL)
+        printf("Could not allocate neighbor build positions\n");
+    // Particles near the node edges gathered from the cell list
+    neighbor_grid.candidates = malloc(max_fluid_particles_local * sizeof(int));
+    total_bytes+= max_fluid_particles_local * sizeof(int);
+    if(neighbor_grid.candidates == NULL)
+        printf("Could not allocate edge candidates\n");
+    // The threaded build splits the grid into blocks that can be stolen so dense rows are balanced
+    total_bytes += alloc_build_blocks(&neighbor_grid, thread_pool.number_blocks, cache_pair_geometry);
+
+    // Edge index arrays and packed halo buffers for each neighbor grow as edges are selected
+    for(i=0; i<NUMBER_NEIGHBORS; i++)
+        edges.edge_indicies[i] = NULL;
+    alloc_halo_buffers(&edges);
+    if(shared_halos)
+        total_bytes += init_shared_halos(&edges, &params);
+    // Requests for the empty halo, returns may be exchanged before the first halo
+    init_halo_requests(&edges, &params);
+    // Out of bound index arrays and packed transfer buffers for each neighbor grow as particles leave
+    for(i=0; i<NUMBER_NEIGHBORS; i++)
+        out_of_bounds.oob_indicies[i] = NULL;
+    alloc_oob_buffers(&out_of_bounds);
 
     printf("bytes allocated: %lu\n", total_bytes);
 
     // Initialize particles
-    initParticles(fluid_particle_pointers, fluid_particles, &water_volume_global, start_x,
-		  number_particles_x, &edges, max_fluid_particles_local, spacing_particle, &params);
+    initParticles(&particles, &water_volume_global, start_x, number_particles_x,
+                  start_y, number_particles_y, &edges, spacing_particle, &params);
 
     // Print some parameters
     printf("Rank: %d, fluid_particles: %d, smoothing radius: %f \n", rank, params.number_fluid_particles_local, params.tunable_params.smoothing_radius);
@@ -258,31 +337,53 @@ void start_simulation()
     sleep(1);
     #endif    
 
-    fluid_particle *p;
-    fluid_particle *null_particle = NULL;
-    float *null_float = NULL;
+    // Coordinate and balance report sends to the render node
+    MPI_Request render_reqs[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
 
-    MPI_Request coords_req = MPI_REQUEST_NULL;
+    // Time spent computing this frame, waiting on communication is not counted
+    double busy_time = 0.0;
+    float balance_report[BALANCE_REPORT_FIELDS];
+    balance_report[0] = 0.0f;
+    int bin;
+    float node_bounds[4];
+
+    int awake_ranks = nprocs;
 
     int sub_step = 0; // substep range from 0 to < steps_per_frame
+    int step = 0;
+    bool rebuild;
+    int rebuild_vote;
+    MPI_Request rebuild_req;
+
+    // With a skin the lists are only rebuilt before the density, where particles that left the partition change rank
+    // Without one they are also rebuilt after relaxation by an exchange that moves them
+    #ifdef RASPI
+    bool transfer_before_density = true;
+    #else
+    bool transfer_before_density = params.skin > 0.0f;
+    #endif
 
     // Main simulation loop
     while(1) {
 
+        busy_time -= MPI_Wtime();
+
         // Initialize velocities
-        apply_gravity(fluid_particle_pointers, &params);
+        apply_gravity(&particles, &params);
 
         // Viscosity impluse
-        viscosity_impluses(fluid_particle_pointers, neighbors, &params);
+        viscosity_impluses(&particles, &neighbor_grid, &params);
 
         // Advance to predicted position and set OOB particles
-        predict_positions(fluid_particle_pointers, &boundary_global, &params);
+        predict_positions(&particles, &boundary_global, &params);
+
+        busy_time += MPI_Wtime();
 
         // Make sure that async send to render node is complete
         if(sub_step == 0)
         {
-            if(coords_req != MPI_REQUEST_NULL)
-	        MPI_Wait(&coords_req, MPI_STATUS_IGNORE);
+            end_progress_requests();
+            MPI_Waitall(2, render_reqs, MPI_STATUSES_IGNORE);
         }
 
         #if defined LIGHT || defined BLINK1
@@ -290,8 +391,21 @@ void start_simulation()
         #endif
 
         // Receive updated paramaters from render nodes
-        if(sub_step == steps_per_frame-1)
-            MPI_Scatterv(null_tunable_param, 0, null_displs, TunableParamtype, &params.tunable_params, 1, TunableParamtype, 0,  MPI_COMM_WORLD);
+        // Partitions balanced locally keep their own bounds and move them using the busy time of the last frame
+        if(sub_step == steps_per_frame-1) {
+            node_bounds[0] = params.tunable_params.node_start_x;
+            node_bounds[1] = params.tunable_params.node_end_x;
+            node_bounds[2] = params.tunable_params.node_start_y;
+            node_bounds[3] = params.tunable_params.node_end_y;
+            MPI_Scatterv(null_tunable_param, 0, null_displs, TunableParamtype, &params.tunable_params, 1, TunableParamtype, 0,  MPI_COMM_AWAKE);
+            if(balance_locally) {
+                params.tunable_params.node_start_x = node_bounds[0];
+                params.tunable_params.node_end_x = node_bounds[1];
+                params.tunable_params.node_start_y = node_bounds[2];
+                params.tunable_params.node_end_y = node_bounds[3];
+                diffuse_partitions(&params, balance_report[0]);
+            }
+        }
 
         #if defined LIGHT || defined BLINK1
         // If recently added to computation turn light to light state color
@@ -303,65 +417,184 @@ void start_simulation()
             rgb_light_white(&light_state);
         #endif
 
+        // The render node parks ranks that have handed over all their particles and wakes them when they are added back
+        // A parked rank waits here, each change of the awake ranks is made by every rank together
+        while(params.tunable_params.awake_ranks != awake_ranks) {
+            awake_ranks = params.tunable_params.awake_ranks;
+            update_awake_ranks(&params, &edges, awake_ranks, shared_halos);
+            neighbor_grid.force_rebuild = true;
+            if(MPI_COMM_AWAKE == MPI_COMM_NULL)
+                park_rank(&params);
+        }
+
         if(params.tunable_params.kill_sim)
             break;
 
-        // Identify out of bounds particles and send them to appropriate rank
-        identify_oob_particles(fluid_particle_pointers, fluid_particles, &out_of_bounds, &boundary_global, &params);
+        // Neighbor lists and edge particles are only updated on a rebuild, decided once per substep by all awake compute ranks
+        // The votes are combined by a nonblocking reduction, a rank that needs the rebuild starts it without waiting
+        // and the others compute their boundary densities in case the lists are kept
+        rebuild = neighbors_need_rebuild(&particles, &neighbor_grid, &params);
+        rebuild_vote = rebuild;
+        MPI_Iallreduce(MPI_IN_PLACE, &rebuild_vote, 1, MPI_INT, MPI_LOR, MPI_COMM_COMPUTE_AWAKE, &rebuild_req);
+
+        if(!rebuild) {
+            busy_time -= MPI_Wtime();
+            compute_cell_densities(&particles, &neighbor_grid, &params, CELLS_BOUNDARY);
+            busy_time += MPI_Wtime();
+
+            MPI_Wait(&rebuild_req, MPI_STATUS_IGNORE);
+            rebuild = rebuild_vote;
+
+            // Another rank needs the rebuild, the densities are recomputed by the hash
+            if(rebuild) {
+                memset(particles.density, 0, params.number_fluid_particles_local*sizeof(float));
+                memset(particles.density_near, 0, params.number_fluid_particles_local*sizeof(float));
+            }
+        }
+
+        if(rebuild) {
+            // Viscosity displacements of the halo particles are returned before the edge particles are reselected
+            startReturnExchange(&particles, &edges, &params);
+            finishReturnExchange(&particles, &edges, &params, false);
 
-        // Hash the non halo regions
-        // This will update the densities so when the halo is exchanged the halo particles are up to date
-        // This works well on the raspi's but destroys communication/computation overlap
-        hash_fluid(fluid_particle_pointers, &neighbor_grid, &params, true);
+            // Out of bounds particles are sent to the appropriate rank before the lists are rebuilt
+            if(transfer_before_density) {
+                identify_oob_particles(&particles, &out_of_bounds, &neighbor_grid, &edges, &params);
+                transferOOBParticles(&particles, &out_of_bounds, &params);
+            }
+
+            busy_time -= MPI_Wtime();
+
+            // Periodically reorder particle storage so neighbors are close in memory
+            if(steps_per_sort && step >= next_sort_step) {
+                sort_fluid_particles(&particles, &sorted_particles, &neighbor_grid, &edges, &params);
+                next_sort_step = step + steps_per_sort;
+            }
+
+            // Hash the boundary cells of the non halo regions
+            // This will update the edge particle densities so when the halo is exchanged the halo particles are up to date
+            hash_fluid(&particles, &neighbor_grid, &params, true, CELLS_BOUNDARY);
+
+            // The fluid particles were just binned so edge particles are found from the boundary cells
+            select_edge_particles(&particles, &edges, &neighbor_grid, &params, false);
+
+            busy_time += MPI_Wtime();
+        }
+        MPI_Wait(&rebuild_req, MPI_STATUS_IGNORE);
 
          // Exchange halo particles
-        startHaloExchange(fluid_particle_pointers,fluid_particles, &edges, &params);
-        finishHaloExchange(fluid_particle_pointers,fluid_particles, &edges, &params);
+        startHaloExchange(&particles, &edges, &params, rebuild, HALO_DENSITY);
+        begin_progress();
+        busy_time -= MPI_Wtime();
+
+        // The interior cells do not need the halo and are hashed while it is in flight
+        if(rebuild)
+            hash_fluid(&particles, &neighbor_grid, &params, true, CELLS_INTERIOR);
+        else
+            compute_cell_densities(&particles, &neighbor_grid, &params, CELLS_INTERIOR);
+
+        busy_time += MPI_Wtime();
+        end_progress();
+        finishHaloExchange(&particles, &edges, &params);
+
+        busy_time -= MPI_Wtime();
 
         // Add the halo particles to neighbor buckets
         // Also update density
-        hash_halo(fluid_particle_pointers, &neighbor_grid, &params, true);
+        if(rebuild)
+            hash_halo(&particles, &neighbor_grid, &params, true);
+        else {
+            compute_densities(&particles, &neighbor_grid.halo_neighbors, &params);
+            compute_densities(&particles, &neighbor_grid.mirror_neighbors, &params);
+        }
 
         // double density relaxation
-        // halo particles will be missing origin contributions to density/pressure
-        double_density_relaxation(fluid_particle_pointers, neighbors, &params);
+        // halo particles will be missing the contributions of their owners other halo particles to density/pressure
+        double_density_relaxation(&particles, &neighbor_grid, &params);
 
         // update velocity
-        updateVelocities(fluid_particle_pointers, &edges, &boundary_global, &params);
+        updateVelocities(&particles, &edges, &boundary_global, &params);
+
+        busy_time += MPI_Wtime();
 
         // Not updating halo particles and hash after relax can be used to speed things up
         // Not updating these can cause unstable behavior
 
+        // Lists with a skin are kept through relaxation and its displacements are left to the next substeps rebuild decision,
+        // until then the viscosity impulses use lists that miss a pair only if relaxation moved its particles through what remained of the skin
+        // Without a skin the lists are only valid for the positions they were built from and are rebuilt from the relaxed positions
         #ifndef RASPI
-        // Exchange halo particles from relaxed positions
-        startHaloExchange(fluid_particle_pointers,fluid_particles, &edges, &params);
-        #endif
+        if(params.skin == 0.0f) {
+            // Displacements of the halo particles are returned to their owners before particles change owner
+            startReturnExchange(&particles, &edges, &params);
+            finishReturnExchange(&particles, &edges, &params, false);
+
+            // Out of bounds particles are sent to the appropriate rank in the same message as the halo
+            identify_oob_particles(&particles, &out_of_bounds, &neighbor_grid, &edges, &params);
+            exchangeParticles(&particles, &edges, &out_of_bounds, &neighbor_grid, &params);
+
+            // Update hash with relaxed positions
+            busy_time -= MPI_Wtime();
+            hash_fluid(&particles, &neighbor_grid, &params, false, CELLS_ALL);
+            hash_halo(&particles, &neighbor_grid, &params, false);
+            busy_time += MPI_Wtime();
+        }
+        else {
+            // Exchange halo particles from relaxed positions while their displacements are returned to their owners
+            startReturnExchange(&particles, &edges, &params);
+            startHaloExchange(&particles, &edges, &params, false, HALO_MOTION);
+            finishHaloExchange(&particles, &edges, &params);
+            finishReturnExchange(&particles, &edges, &params, true);
+        }
+        #else
+        // Displacements of the halo particles are returned to their owners, halo particles keep their displaced positions
+        startReturnExchange(&particles, &edges, &params);
+        finishReturnExchange(&particles, &edges, &params, false);
 
-        // We can hash during exchange as the density is not needed
-        hash_fluid(fluid_particle_pointers, &neighbor_grid, &params, false);
+        busy_time -= MPI_Wtime();
 
-        #ifndef RASPI
-        // Finish asynch halo exchange
-        finishHaloExchange(fluid_particle_pointers,fluid_particles, &edges, &params);
+        if(params.skin == 0.0f)
+            hash_fluid(&particles, &neighbor_grid, &params, false, CELLS_ALL);
 
-        // Update hash with relaxed positions
-        hash_halo(fluid_particle_pointers, &neighbor_grid, &params, false);
+        busy_time += MPI_Wtime();
         #endif
 
-        // We do not transfer particles that have gone OOB since relaxation
-        // to reduce communication cost
-
         // Pack fluid particle coordinates
         // This sends results as short in pixel coordinates
+        // The balance report is filled in the same pass
         if(sub_step == steps_per_frame-1)
         {
+            // Coordinates grow with the particle arrays, the previous send has completed
+            if(max_coords < particles.max_particles) {
+                short *grown_coords = realloc(fluid_particle_coords, 2 * particles.max_particles * sizeof(short));
+                if(grown_coords == NULL)
+                    printf("Could not allocate fluid_particle coords\n");
+                else {
+                    fluid_particle_coords = grown_coords;
+                    max_coords = particles.max_particles;
+                }
+            }
+            for(i=0; i<BALANCE_BINS; i++)
+                balance_report[1+i] = 0.0f;
             for(i=0; i<params.number_fluid_particles_local; i++) {
-                p = fluid_particle_pointers[i];
-                fluid_particle_coords[i*2] = (2.0f*p->x/boundary_global.max_x - 1.0f) * SHRT_MAX; // convert to short using full range
-                fluid_particle_coords[(i*2)+1] = (2.0f*p->y/boundary_global.max_y - 1.0f) * SHRT_MAX; // convert to short using full range
+                fluid_particle_coords[i*2] = (2.0f*particles.x[i]/boundary_global.max_x - 1.0f) * SHRT_MAX; // convert to short using full range
+                fluid_particle_coords[(i*2)+1] = (2.0f*particles.y[i]/boundary_global.max_y - 1.0f) * SHRT_MAX; // convert to short using full range
+                bin = particles.x[i]/boundary_global.max_x * BALANCE_BINS;
+                bin = bin < 0 ? 0 : (bin < BALANCE_BINS ? bin : BALANCE_BINS-1);
+                balance_report[1+bin] += 1.0f;
             }
+            balance_report[0] = busy_time;
+            busy_time = 0.0;
+            balance_report[BALANCE_REPORT_BOUNDS] = params.tunable_params.node_start_x;
+            balance_report[BALANCE_REPORT_BOUNDS+1] = params.tunable_params.node_end_x;
+            balance_report[BALANCE_REPORT_BOUNDS+2] = params.tunable_params.node_start_y;
+            balance_report[BALANCE_REPORT_BOUNDS+3] = params.tunable_params.node_end_y;
+
             // Async send fluid particle coordinates to render node
-            MPI_Isend(fluid_particle_coords, 2*params.number_fluid_particles_local, MPI_SHORT, 0, 17, MPI_COMM_WORLD, &coords_req);
+            // The progress thread closes their window as soon as they complete rather than at the next frame
+            MPI_Isend(fluid_particle_coords, 2*params.number_fluid_particles_local, MPI_SHORT, 0, 17, MPI_COMM_WORLD, &render_reqs[0]);
+            MPI_Isend(balance_report, BALANCE_REPORT_FIELDS, MPI_FLOAT, 0, 18, MPI_COMM_WORLD, &render_reqs[1]);
+            begin_progress_requests(render_reqs, 2);
         }
 
         if(sub_step == steps_per_frame-1)
@@ -369,6 +602,8 @@ void start_simulation()
         else
 	    sub_step++;
 
+        step++;
+
     }
 
     #if defined LIGHT || defined BLINK1
@@ -376,237 +611,550 @@ void start_simulation()
     #endif
 
     // Release memory
-    free(fluid_particles);
+    free_fluid_particles(&particles);
+    if(steps_per_sort)
+        free_fluid_particles(&sorted_particles);
     free(fluid_particle_coords);
-    free(fluid_particle_pointers);
-    free(neighbors);
-    free(fluid_neighbors);
-    free(grid_buckets);
-    free(bucket_particles);
-    free(edges.edge_pointers_left);
-    free(edges.edge_pointers_right);
-    free(out_of_bounds.oob_pointer_indicies_left);
-    free(out_of_bounds.oob_pointer_indicies_right);
-    free(out_of_bounds.vacant_indicies);
+    free_neighbor_list(&neighbor_grid.fluid_neighbors);
+    free_neighbor_list(&neighbor_grid.halo_neighbors);
+    free_neighbor_list(&neighbor_grid.mirror_neighbors);
+    free(neighbor_grid.cell_starts);
+    free(neighbor_grid.cell_counts);
+    free(neighbor_grid.cell_particles);
+    free(neighbor_grid.particle_cells);
+    free(neighbor_grid.build_x);
+    free(neighbor_grid.build_y);
+    free(neighbor_grid.candidates);
+    free_build_blocks(&neighbor_grid);
+    for(i=0; i<NUMBER_NEIGHBORS; i++) {
+        free(edges.edge_indicies[i]);
+        free(out_of_bounds.oob_indicies[i]);
+    }
+    free_halo_buffers(&edges);
+    free_oob_buffers(&out_of_bounds);
+    free_progress_thread();
+    free_thread_pool();
 
     // Close MPI
     freeMpiTypes();
 
 }
 
+// Allocate structure of arrays particle storage
+// Each array is padded to a multiple of 8 floats so every array is 32 byte aligned
+// Returns the number of bytes allocated
+size_t alloc_fluid_particles(fluid_particles_t *particles, int max_particles)
+{
+    size_t length = (max_particles + 7) & ~7;
+    size_t hot_bytes = HOT_PARTICLE_ARRAYS * length * sizeof(float);
+    size_t cold_bytes = COLD_PARTICLE_ARRAYS * length * sizeof(float);
+    void *block;
+
+    particles->max_particles = max_particles;
+
+    if(posix_memalign(&block, 32, hot_bytes)) {
+        printf("Could not allocate hot fluid particle arrays\n");
+        block = NULL;
+    }
+    particles->hot_block = block;
+    if(posix_memalign(&block, 32, cold_bytes)) {
+        printf("Could not allocate cold fluid particle arrays\n");
+        block = NULL;
+    }
+    particles->cold_block = block;
+
+    particles->x            = particles->hot_block;
+    particles->y            = particles->hot_block + length;
+    particles->v_x          = particles->hot_block + 2*length;
+    particles->v_y          = particles->hot_block + 3*length;
+    particles->density      = particles->hot_block + 4*length;
+    particles->density_near = particles->hot_block + 5*length;
+
+    particles->pressure      = particles->cold_block;
+    particles->pressure_near = particles->cold_block + length;
+    particles->x_prev        = particles->cold_block + 2*length;
+    particles->y_prev        = particles->cold_block + 3*length;
+    particles->halo_d_x      = particles->cold_block + 4*length;
+    particles->halo_d_y      = particles->cold_block + 5*length;
+
+    return hot_bytes + cold_bytes;
+}
+
+void free_fluid_particles(fluid_particles_t *particles)
+{
+    free(particles->hot_block);
+    free(particles->cold_block);
+}
+
+// Make room for number_particles fluid and halo particles, growing the arrays geometrically
+// The stored particles are kept, pointers to the old arrays are invalid once the arrays have grown
+// Returns false if the arrays could not be grown
+bool reserve_fluid_particles(fluid_particles_t *particles, int number_particles)
+{
+    int k, max;
+    size_t length, grown_length;
+    fluid_particles_t grown;
+
+    if(number_particles <= particles->max_particles)
+        return true;
+
+    max = particles->max_particles ? 2*particles->max_particles : 64;
+    while(max < number_particles)
+        max *= 2;
+
+    alloc_fluid_particles(&grown, max);
+    if(grown.hot_block == NULL || grown.cold_block == NULL) {
+        free_fluid_particles(&grown);
+        return false;
+    }
+
+    // Each array is at the same position in the larger blocks
+    length = (particles->max_particles + 7) & ~7;
+    grown_length = (max + 7) & ~7;
+    for(k=0; k<HOT_PARTICLE_ARRAYS; k++)
+        memcpy(grown.hot_block + k*grown_length, particles->hot_block + k*length, length*sizeof(float));
+    for(k=0; k<COLD_PARTICLE_ARRAYS; k++)
+        memcpy(grown.cold_block + k*grown_length, particles->cold_block + k*length, length*sizeof(float));
+
+    free_fluid_particles(particles);
+    *particles = grown;
+    debug_print("fluid particles grown to %d\n", max);
+
+    return true;
+}
+
+// Copy all fields of particle from, in from_particles, to particle to, in to_particles
+void copy_particle(fluid_particles_t *from_particles, int from, fluid_particles_t *to_particles, int to)
+{
+    to_particles->x[to] = from_particles->x[from];
+    to_particles->y[to] = from_particles->y[from];
+    to_particles->v_x[to] = from_particles->v_x[from];
+    to_particles->v_y[to] = from_particles->v_y[from];
+    to_particles->density[to] = from_particles->density[from];
+    to_particles->density_near[to] = from_particles->density_near[from];
+    to_particles->pressure[to] = from_particles->pressure[from];
+    to_particles->pressure_near[to] = from_particles->pressure_near[from];
+    to_particles->x_prev[to] = from_particles->x_prev[from];
+    to_particles->y_prev[to] = from_particles->y_prev[from];
+}
+
 // This should go into the hash, perhaps with the viscocity?
-void apply_gravity(fluid_particle **fluid_particle_pointers, param *params)
+void apply_gravity(fluid_particles_t *particles, param *params)
 {
-    int i;
-    fluid_particle *p;
-    float dt = params->tunable_params.time_step;
-    float g = -params->tunable_params.g;
+    phase_task_t task;
+    task.particles = particles;
+    task.params = params;
+    task.number_particles = params->number_fluid_particles_local + params->number_halo_particles;
 
-    for(i=0; i<(params->number_fluid_particles_local + params->number_halo_particles); i++) {
-        p = fluid_particle_pointers[i];
-        p->v_y += g*dt;
+    run_tasks(apply_gravity_block, &task, thread_pool.number_blocks);
+}
+
+void apply_gravity_block(void *args, int block)
+{
+    phase_task_t *task = args;
+    int i, begin, end;
+    float dt = task->params->tunable_params.time_step;
+    float g = -task->params->tunable_params.g;
+    float *v_y = task->particles->v_y;
+    float *density = task->particles->density;
+    float *density_near = task->particles->density_near;
+
+    block_range(block, thread_pool.number_blocks, task->number_particles, &begin, &end);
+
+    for(i=begin; i<end; i++) {
+        v_y[i] += g*dt;
 
         // Zero out density as well
-        p->density = 0.0f;
-        p->density_near = 0.0f;
+        density[i] = 0.0f;
+        density_near[i] = 0.0f;
      }
 }
 
 // Add viscosity impluses
-void viscosity_impluses(fluid_particle **fluid_particle_pointers, neighbor* neighbors, param *params)
+// Fluid neighbors are processed before halo neighbors, the mirror halo pairs are computed by their owners
+// Neighbors are processed in batches of SIMD_BATCH, pair impulses within a batch use p's velocity at the start of the batch
+void viscosity_impluses(fluid_particles_t *particles, neighbor_grid_t *grid, param *params)
+{
+    int colour;
+    pair_task_t task;
+    task.particles = particles;
+    task.grid = grid;
+    task.params = params;
+
+    // Same coloured cells are run in parallel, each colour is finished before the next is started
+    for(colour=NUMBER_COLOURS; colour-- > 0; ) {
+        task.colour = colour;
+        run_tasks(viscosity_cell, &task, number_colour_cells(grid, colour));
+    }
+}
+
+// Apply the viscosity impulses of the particles in a cell
+void viscosity_cell(void *args, int task_index)
+{
+    pair_task_t *task = args;
+    neighbor_grid_t *grid = task->grid;
+    unsigned int c, p;
+    unsigned int cell = colour_cell(grid, task->colour, task_index);
+    unsigned int start = grid->cell_starts[cell];
+
+    // Iterating through the cell in reverse reduces biased particle movement
+    for(c=grid->cell_counts[cell]; c-- > 0; ) {
+        p = grid->cell_particles[start+c];
+        if(p < task->params->number_fluid_particles_local)
+            viscosity_row(task->particles, &grid->fluid_neighbors, &grid->halo_neighbors, p, task->params);
+    }
+}
+
+// Apply the viscosity impulses between particle i and its fluid and halo neighbors
+void viscosity_row(fluid_particles_t *particles, neighbor_list_t *fluid_neighbors, neighbor_list_t *halo_neighbors, int i, param *params)
 {
-    int i, j, num_fluid;
-    fluid_particle *p, *q;
-    neighbor* n;
-    float r, r_recip, ratio, u, imp, imp_x, imp_y;
-    float p_x, p_y;
-    float QmP_x, QmP_y;
-    float h_recip, sigma, beta, dt;
+    int j, l, q, k, count, number_neighbors, num_fluid;
+    unsigned int start, *row;
+    bool cached;
+    neighbor_list_t *lists[2] = {fluid_neighbors, halo_neighbors};
+    simd_batch_t batch;
+    float *x = particles->x;
+    float *y = particles->y;
+    float *v_x = particles->v_x;
+    float *v_y = particles->v_y;
+    // An impulse moves a particle by impulse*time_step before its velocity is recomputed from its displacement
+    float dt = params->tunable_params.time_step;
 
     num_fluid = params->number_fluid_particles_local;
-    h_recip = 1.0f/params->tunable_params.smoothing_radius;
-    sigma = params->tunable_params.sigma;
-    beta = params->tunable_params.beta;
-    dt = params->tunable_params.time_step;
-
-
-    for(i=num_fluid; i-- > 0; ) {
-        p = fluid_particle_pointers[i];
-        n = &neighbors[i];
- 	    p_x = p->x;
-	    p_y = p->y;
-
-        for(j=0; j<n->number_fluid_neighbors; j++) {
-            q = n->fluid_neighbors[j];
-	
-            QmP_x = (q->x-p_x);
-            QmP_y = (q->y-p_y);
-            r = sqrt(QmP_x*QmP_x + QmP_y*QmP_y);
-
-            r_recip = 1.0f/r;
-            ratio = r*h_recip;
-
-            //Inward radial velocity
-            u = ((p->v_x-q->v_x)*QmP_x + (p->v_y-q->v_y)*QmP_y)*r_recip;
-            if(u>0.0f)
-            {
-                imp = dt * (1-ratio)*(sigma * u + beta * u*u);
-                imp_x = imp*QmP_x*r_recip;
-                imp_y = imp*QmP_y*r_recip;
-
-		// Not correct to use velocity check but will stop velocity from
-		// blowing up
-		checkVelocity(&imp_x, &imp_y);
-
-                p->v_x -= imp_x*0.5f;
-                p->v_y -= imp_y*0.5f;
-
-                if(q->id < num_fluid) {
-                    q->v_x += imp_x*0.5f;
-                    q->v_y += imp_y*0.5f;
 
-                }
-                else { // Only apply half of the impulse to halo particles as they are missing "home" contribution
-                    q->v_x += imp_x*0.125f;
-                    q->v_y += imp_y*0.125f;
-                }
-                
+    for(k=0; k<2; k++) {
+        start = lists[k]->starts[i];
+        row = &lists[k]->neighbor_indicies[start];
+        number_neighbors = lists[k]->counts[i];
+        // Positions are unchanged if the lists were built after the last relaxation
+        cached = lists[k]->geometry_current;
+
+        for(j=0; j<number_neighbors; j+=SIMD_BATCH) {
+            count = number_neighbors - j;
+            if(count > SIMD_BATCH)
+                count = SIMD_BATCH;
+
+            // Gather neighbor state
+            for(l=0; l<count; l++) {
+                q = row[j+l];
+                batch.q_x[l] = x[q];
+                batch.q_y[l] = y[q];
+                batch.q_v_x[l] = v_x[q];
+                batch.q_v_y[l] = v_y[q];
+                if(cached)
+                    load_pair_geometry(lists[k], start+j+l, &batch, l);
             }
+            pad_batch(&batch, count, x[i], y[i], v_x[i], v_y[i], params);
 
+            if(cached)
+                simd_kernels.viscosity_terms_cached(v_x[i], v_y[i], &batch, params);
+            else
+                simd_kernels.viscosity_terms(x[i], y[i], v_x[i], v_y[i], &batch, params);
+
+            // Apply impulses in neighbor order, non approaching pairs have zero impulse
+            for(l=0; l<count; l++) {
+                q = row[j+l];
+
+                v_x[i] -= batch.out_x[l]*0.5f;
+                v_y[i] -= batch.out_y[l]*0.5f;
+
+                v_x[q] += batch.out_x[l]*0.5f;
+                v_y[q] += batch.out_y[l]*0.5f;
+
+                // The owner of a halo particle is sent the displacement the impulse causes
+                if(q >= num_fluid) {
+                    particles->halo_d_x[q] += batch.out_x[l]*0.5f*dt;
+                    particles->halo_d_y[q] += batch.out_y[l]*0.5f*dt;
+                }
+            }
         }
     }
 }
 
 // Identify out of bounds particles and send them to appropriate rank
-void identify_oob_particles(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles, oob_t *out_of_bounds, AABB_t *boundary_global, param *params)
+void identify_oob_particles(fluid_particles_t *particles, oob_t *out_of_bounds, neighbor_grid_t *grid, edge_t *edges, param *params)
 {
-    int i;
-    fluid_particle *p;
+    int i, n, d, number_candidates;
+    float *x = particles->x;
+    float *y = particles->y;
 
     // Reset OOB numbers
-    out_of_bounds->number_oob_particles_left = 0;
-    out_of_bounds->number_oob_particles_right = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        out_of_bounds->number_oob_particles[d] = 0;
 
-    for(i=0; i<params->number_fluid_particles_local; i++) {
-        p = fluid_particle_pointers[i];
+    // Only particles binned near an edge can have crossed it
+    number_candidates = edge_candidates(grid, params, edges->returned_displacement);
+    reserve_oob_indicies(out_of_bounds, number_candidates);
 
+    for(n=0; n<number_candidates; n++) {
         // Set OOB particle indicies and update number
-        if (p->x < params->tunable_params.node_start_x)
-            out_of_bounds->oob_pointer_indicies_left[out_of_bounds->number_oob_particles_left++] = i;
-        else if (p->x > params->tunable_params.node_end_x)
-            out_of_bounds->oob_pointer_indicies_right[out_of_bounds->number_oob_particles_right++] = i;
+        i = grid->candidates[n];
+        d = oob_direction(x[i], y[i], params);
+        if (d >= 0)
+            out_of_bounds->oob_indicies[d][out_of_bounds->number_oob_particles[d]++] = i;
     }
- 
-   // Transfer particles that have left the processor bounds
-   transferOOBParticles(fluid_particle_pointers, fluid_particles, out_of_bounds, params);
 }
 
 
 
 // Predict position
-void predict_positions(fluid_particle **fluid_particle_pointers, AABB_t *boundary_global, param *params)
+void predict_positions(fluid_particles_t *particles, AABB_t *boundary_global, param *params)
 {
-    int i;
-    fluid_particle *p;
-    float dt = params->tunable_params.time_step;
+    phase_task_t task;
+    task.particles = particles;
+    task.boundary_global = boundary_global;
+    task.params = params;
+    task.number_particles = params->number_fluid_particles_local;
 
-    for(i=0; i<params->number_fluid_particles_local; i++) {
-        p = fluid_particle_pointers[i];
-	p->x_prev = p->x;
-        p->y_prev = p->y;
-	p->x += (p->v_x * dt);
-        p->y += (p->v_y * dt);
+    run_tasks(predict_positions_block, &task, thread_pool.number_blocks);
+}
+
+void predict_positions_block(void *args, int block)
+{
+    phase_task_t *task = args;
+    fluid_particles_t *particles = task->particles;
+    int i, begin, end;
+    float dt = task->params->tunable_params.time_step;
+    float *x = particles->x;
+    float *y = particles->y;
+
+    block_range(block, thread_pool.number_blocks, task->number_particles, &begin, &end);
+
+    for(i=begin; i<end; i++) {
+	particles->x_prev[i] = x[i];
+        particles->y_prev[i] = y[i];
+	x[i] += (particles->v_x[i] * dt);
+        y[i] += (particles->v_y[i] * dt);
 
 	// Enforce boundary conditions
-        boundaryConditions(p, boundary_global, params);
+        boundaryConditions(particles, i, task->boundary_global, task->params);
     }
 }
 
-// Calculate the density contribution of p on q and q on p
-// r is passed in as this function is called in the hash which must also calculate r
-void calculate_density(fluid_particle *p, fluid_particle *q, float ratio)
+// Add the density contribution of p on q and q on p
+// w and w_near are computed by the density pair kernel as the hash must also calculate r
+void calculate_density(fluid_particles_t *particles, int p, int q, float w, float w_near)
+{
+    particles->density[p] += w;
+    particles->density_near[p] += w_near;
+
+    particles->density[q] += w;
+    particles->density_near[q] += w_near;
+}
+
+// Recompute density from a neighbor list when the lists are reused
+// The fluid and halo lists are passed separately to match hash_fluid() and hash_halo() so halo particles receive fluid densities first
+void compute_densities(fluid_particles_t *particles, neighbor_list_t *neighbors, param *params)
 {
+    int i;
+
+    for(i=0; i<params->number_fluid_particles_local; i++)
+        compute_row_densities(particles, neighbors, i, params);
 
-    float OmR2 = (1.0f-ratio)*(1.0f-ratio); // (one - r)^2
-    if(ratio < 1.0f) {
-	p->density += OmR2;
-	p->density_near += OmR2*(1.0f-ratio);
+    neighbors->geometry_current = neighbors->cache_geometry;
+}
 
-	q->density += OmR2;
-	q->density_near += OmR2*(1.0f-ratio);
+// Recompute density from the fluid rows of the particles binned in a region of cells
+// The boundary cells are recomputed before the interior cells as in hash_fluid()
+void compute_cell_densities(fluid_particles_t *particles, neighbor_grid_t *grid, param *params, int region)
+{
+    int i, j, c;
+    int n_f = params->number_fluid_particles_local;
+    unsigned int index, p;
+
+    for (j=0; j<grid->size_y; j++) {
+        for(i=0; i<grid->size_x; i++) {
+            if(!cell_in_region(grid, i, j, region))
+                continue;
+            index = j*grid->size_x + i;
+            for(c=0; c<grid->cell_counts[index]; c++) {
+                p = grid->cell_particles[grid->cell_starts[index]+c];
+                if(p >= n_f)
+                    continue;
+                compute_row_densities(particles, &grid->fluid_neighbors, p, params);
+            }
+        }
     }
 
+    grid->fluid_neighbors.geometry_current = grid->fluid_neighbors.cache_geometry;
 }
 
-void double_density_relaxation(fluid_particle **fluid_particle_pointers, neighbor *neighbors, param *params)
+// Add the density contributions of the pairs in particle i's row
+// The pair geometry is refreshed at the same time if cached
+void compute_row_densities(fluid_particles_t *particles, neighbor_list_t *neighbors, int i, param *params)
 {
-    int i, j, num_fluid;
-    fluid_particle *p, *q;
-    neighbor* n;
-    float r,ratio,dt,h,h_recip,r_recip,D,D_x,D_y;
-    float k, k_near, k_spring, p_pressure, p_pressure_near, rest_density;
-    float OmR;
+    int j, l, q, count, number_neighbors;
+    unsigned int start, *row;
+    simd_batch_t batch;
+    float *x = particles->x;
+    float *y = particles->y;
+
+    start = neighbors->starts[i];
+    row = &neighbors->neighbor_indicies[start];
+    number_neighbors = neighbors->counts[i];
+
+    for(j=0; j<number_neighbors; j+=SIMD_BATCH) {
+        count = number_neighbors - j;
+        if(count > SIMD_BATCH)
+            count = SIMD_BATCH;
+
+        for(l=0; l<count; l++) {
+            q = row[j+l];
+            batch.q_x[l] = x[q];
+            batch.q_y[l] = y[q];
+        }
+        pad_batch(&batch, count, x[i], y[i], 0.0f, 0.0f, params);
 
-    num_fluid = params->number_fluid_particles_local;
-    k = params->tunable_params.k;
-    k_near = params->tunable_params.k_near;
-    k_spring = params->tunable_params.k_spring;
-    h = params->tunable_params.smoothing_radius;
-    h_recip = 1.0f/h;
-    dt = params->tunable_params.time_step;
-    rest_density = params->tunable_params.rest_density;
+        // Pairs that have moved beyond h have zero contribution
+        if(neighbors->cache_geometry)
+            simd_kernels.geometry_terms(x[i], y[i], &batch, params);
+        else
+            simd_kernels.density_terms(x[i], y[i], &batch, params);
+
+        for(l=0; l<count; l++) {
+            calculate_density(particles, i, row[j+l], batch.w[l], batch.w_near[l]);
+            if(neighbors->cache_geometry)
+                store_pair_geometry(neighbors, start+j+l, &batch, l);
+        }
+    }
+}
+
+// Fluid neighbors are processed before halo neighbors, the mirror halo pairs are computed by their owners
+// Neighbors are processed in batches of SIMD_BATCH, pair displacements within a batch use p's position at the start of the batch
+void double_density_relaxation(fluid_particles_t *particles, neighbor_grid_t *grid, param *params)
+{
+    int colour;
+    phase_task_t pressure_task;
+    pair_task_t task;
 
     // Calculate the pressure of all particles, including halo
-    for(i=0; i<num_fluid + params->number_halo_particles; i++) {
-        p = fluid_particle_pointers[i];
+    pressure_task.particles = particles;
+    pressure_task.params = params;
+    pressure_task.number_particles = params->number_fluid_particles_local + params->number_halo_particles;
+    run_tasks(compute_pressures_block, &pressure_task, thread_pool.number_blocks);
+
+    task.particles = particles;
+    task.grid = grid;
+    task.params = params;
+
+    // Same coloured cells are run in parallel, each colour is finished before the next is started
+    // With live positions relaxation remains Gauss-Seidel like as later colours see the displacements of earlier colours,
+    // with relax_cached_geometry the pair geometry is from before relaxation and the displacements are Jacobi like
+    for(colour=NUMBER_COLOURS; colour-- > 0; ) {
+        task.colour = colour;
+        run_tasks(relaxation_cell, &task, number_colour_cells(grid, colour));
+    }
+
+    // Particles have moved so the cached geometry is stale
+    grid->fluid_neighbors.geometry_current = false;
+    grid->halo_neighbors.geometry_current = false;
+}
+
+void compute_pressures_block(void *args, int block)
+{
+    phase_task_t *task = args;
+    fluid_particles_t *particles = task->particles;
+    int i, begin, end;
+    float k_pressure = task->params->tunable_params.k;
+    float k_near = task->params->tunable_params.k_near;
+    float rest_density = task->params->tunable_params.rest_density;
+
+    block_range(block, thread_pool.number_blocks, task->number_particles, &begin, &end);
+
+    for(i=begin; i<end; i++) {
         // Compute pressure and near pressure
-        p->pressure = k * (p->density - rest_density);
-        p->pressure_near = k_near * p->density_near;
+        particles->pressure[i] = k_pressure * (particles->density[i] - rest_density);
+        particles->pressure_near[i] = k_near * particles->density_near[i];
     }
+}
 
-    // Iterating through the array in reverse reduces biased particle movement
-    for(i=num_fluid; i-- > 0; ) {
-        p = fluid_particle_pointers[i];
-        n = &neighbors[i];
-        p_pressure = p->pressure;
-        p_pressure_near = p->pressure_near;
+// Relax the particles in a cell
+// Pairs are computed from the positions left by earlier colours unless relax_cached_geometry is set,
+// in which case the cached geometry ignores every displacement made in this relaxation
+void relaxation_cell(void *args, int task_index)
+{
+    pair_task_t *task = args;
+    neighbor_grid_t *grid = task->grid;
+    unsigned int c, p;
+    unsigned int cell = colour_cell(grid, task->colour, task_index);
+    unsigned int start = grid->cell_starts[cell];
+
+    // Iterating through the cell in reverse reduces biased particle movement
+    for(c=grid->cell_counts[cell]; c-- > 0; ) {
+        p = grid->cell_particles[start+c];
+        if(p < task->params->number_fluid_particles_local)
+            relaxation_row(task->particles, &grid->fluid_neighbors, &grid->halo_neighbors, p, task->params);
+    }
+}
 
-        for(j=0; j<n->number_fluid_neighbors; j++) {
+// Displace particle i and its fluid and halo neighbors
+void relaxation_row(fluid_particles_t *particles, neighbor_list_t *fluid_neighbors, neighbor_list_t *halo_neighbors, int i, param *params)
+{
+    int j, l, q, k, count, clustered, number_neighbors, num_fluid;
+    unsigned int start, *row;
+    bool cached;
+    neighbor_list_t *lists[2] = {fluid_neighbors, halo_neighbors};
+    simd_batch_t batch;
+    float *x = particles->x;
+    float *y = particles->y;
+    float *pressure = particles->pressure;
+    float *pressure_near = particles->pressure_near;
 
-            q = n->fluid_neighbors[j];
-            r = sqrt((p->x-q->x)*(p->x-q->x) + (p->y-q->y)*(p->y-q->y));
-	        r_recip = 1.0f/r;
-	        ratio = r*h_recip;
-	        OmR = 1.0f - ratio;
+    num_fluid = params->number_fluid_particles_local;
 
-            // Attempt to move clustered particles apart
-            if(r <= 0.000001f) {
-                p->x += 0.000001f;
-                p->y += 0.000001f;
+    for(k=0; k<2; k++) {
+        start = lists[k]->starts[i];
+        row = &lists[k]->neighbor_indicies[start];
+        number_neighbors = lists[k]->counts[i];
+        // Cached geometry ignores displacements made earlier in this relaxation
+        cached = params->relax_cached_geometry && lists[k]->geometry_current;
+
+        for(j=0; j<number_neighbors; j+=SIMD_BATCH) {
+            count = number_neighbors - j;
+            if(count > SIMD_BATCH)
+                count = SIMD_BATCH;
+
+            // Gather neighbor state
+            for(l=0; l<count; l++) {
+                q = row[j+l];
+                batch.q_x[l] = x[q];
+                batch.q_y[l] = y[q];
+                batch.q_pressure[l] = pressure[q];
+                batch.q_pressure_near[l] = pressure_near[q];
+                if(cached)
+                    load_pair_geometry(lists[k], start+j+l, &batch, l);
             }
+            pad_batch(&batch, count, x[i], y[i], 0.0f, 0.0f, params);
+
+            if(cached)
+                clustered = simd_kernels.relaxation_terms_cached(pressure[i], pressure_near[i], &batch, params);
+            else
+                clustered = simd_kernels.relaxation_terms(x[i], y[i], pressure[i], pressure_near[i], &batch, params);
 
-	    if(ratio < 1.0f && r > 0.0f) {
-                // Updating both neighbor pairs at the same time, slightly different than the paper but quicker
-                // Also the running sum of D for particle p seems to produce more bias/instability so is removed
-                D = dt*dt*((p_pressure+q->pressure)*OmR + (p_pressure_near+q->pressure_near)*OmR*OmR + k_spring*(h-r)*0.5);
-                D_x = D*(q->x-p->x)*r_recip;
-                D_y = D*(q->y-p->y)*r_recip;
-
-                // Do not move the halo particles full D
-                // Halo particles are missing D from their origin so I believe this is appropriate
-                if(q->id < num_fluid) {
-                    q->x += D_x;
-                    q->y += D_y;
-                }	
-                else { // Move the halo particles only half way to account for other sides missing contribution
-                    q->x += D_x*0.125f;
-                    q->y += D_y*0.125f;
+            // Updating both neighbor pairs at the same time, slightly different than the paper but quicker
+            // Also the running sum of D for particle p seems to produce more bias/instability so is removed
+            for(l=0; l<count; l++) {
+                q = row[j+l];
+
+                x[q] += batch.out_x[l];
+                y[q] += batch.out_y[l];
+
+                // Halo particles are moved the full D and the owner of the particle is sent the displacement
+                if(q >= num_fluid) {
+                    particles->halo_d_x[q] += batch.out_x[l];
+                    particles->halo_d_y[q] += batch.out_y[l];
                 }
- 
-                p->x -= D_x;
-                p->y -= D_y;
-           }
-       }
+
+                x[i] -= batch.out_x[l];
+                y[i] -= batch.out_y[l];
+            }
+
+            // Attempt to move clustered particles apart
+            for(l=0; l<clustered; l++) {
+                x[i] += 0.000001f;
+                y[i] += 0.000001f;
+            }
+        }
     }
 }
 
@@ -624,40 +1172,53 @@ void checkVelocity(float *v_x, float *v_y)
         *v_y = -v_max;
 }
 
-void updateVelocity(fluid_particle *p, param *params)
+void updateVelocity(fluid_particles_t *particles, int i, param *params)
 {
     float dt = params->tunable_params.time_step;
     float v_x, v_y;
 
-    v_x = (p->x-p->x_prev)/dt;
-    v_y = (p->y-p->y_prev)/dt;
+    v_x = (particles->x[i]-particles->x_prev[i])/dt;
+    v_y = (particles->y[i]-particles->y_prev[i])/dt;
 
     checkVelocity(&v_x, &v_y);
 
-    p->v_x = v_x;
-    p->v_y = v_y;
+    particles->v_x[i] = v_x;
+    particles->v_y[i] = v_y;
 }
 
 // Update particle position and check boundary
-void updateVelocities(fluid_particle **fluid_particle_pointers, edge_t *edges, AABB_t *boundary_global, param *params)
+void updateVelocities(fluid_particles_t *particles, edge_t *edges, AABB_t *boundary_global, param *params)
 {
-    int i;
-    fluid_particle *p;
+    phase_task_t task;
+    task.particles = particles;
+    task.boundary_global = boundary_global;
+    task.params = params;
+    task.number_particles = params->number_fluid_particles_local;
 
-    for(i=0; i<params->number_fluid_particles_local; i++) {
-        p = fluid_particle_pointers[i];
-        boundaryConditions(p, boundary_global, params);
-        updateVelocity(p, params);
+    run_tasks(update_velocities_block, &task, thread_pool.number_blocks);
+}
+
+void update_velocities_block(void *args, int block)
+{
+    phase_task_t *task = args;
+    int i, begin, end;
 
+    block_range(block, thread_pool.number_blocks, task->number_particles, &begin, &end);
+
+    for(i=begin; i<end; i++) {
+        boundaryConditions(task->particles, i, task->boundary_global, task->params);
+        updateVelocity(task->particles, i, task->params);
     }
 }
 
 // Assume AABB with min point being axis origin
-void boundaryConditions(fluid_particle *p, AABB_t *boundary, param *params)
+void boundaryConditions(fluid_particles_t *particles, int i, AABB_t *boundary, param *params)
 {
 
     float center_x = params->tunable_params.mover_center_x;
     float center_y = params->tunable_params.mover_center_y;
+    float *x = &particles->x[i];
+    float *y = &particles->y[i];
 
     // Boundary condition for sphere mover
     if(params->tunable_params.mover_type == SPHERE_MOVER)
@@ -670,16 +1231,16 @@ void boundaryConditions(fluid_particle *p, AABB_t *boundary, param *params)
         // Both circle tests can be combined if no impulse is used
         // Test if inside of circle
         float d;
-        float d2 = (p->x - center_x)*(p->x - center_x) + (p->y - center_y)*(p->y - center_y);
+        float d2 = (*x - center_x)*(*x - center_x) + (*y - center_y)*(*y - center_y);
         if(d2 <= radius*radius && d2 > 0.0f) {
             d = sqrt(d2);
-            norm_x = (center_x-p->x)/d;
-            norm_y = (center_y-p->y)/d;
+            norm_x = (center_x-*x)/d;
+            norm_y = (center_y-*y)/d;
 	    
 	    // With no collision impulse we can handle penetration here
             float pen_dist = radius - d;
-            p->x -= pen_dist * norm_x;
-            p->y -= pen_dist * norm_y;
+            *x -= pen_dist * norm_x;
+            *y -= pen_dist * norm_y;
         }
 
     }
@@ -691,8 +1252,8 @@ void boundaryConditions(fluid_particle *p, AABB_t *boundary, param *params)
         float half_height = params->tunable_params.mover_height*0.5;
 
         // Particle possition relative to mover center
-        float pos_center_x = p->x - center_x;
-        float pos_center_y = p->y - center_y;
+        float pos_center_x = *x - center_x;
+        float pos_center_y = *y - center_y;
 
         // Distance from particle to mover center
 	float dist_center_x = fabs(pos_center_x);
@@ -712,16 +1273,16 @@ void boundaryConditions(fluid_particle *p, AABB_t *boundary, param *params)
             if(pen_depth_x < pen_depth_y){
                 // Entered left side
                 if(pos_center_x < 0.0f)
-                    p->x -= pen_depth_x;
+                    *x -= pen_depth_x;
                 else // Entered right side
-                    p->x += pen_depth_x;
+                    *x += pen_depth_x;
             }
             else { // Particle closer to top/bottom
                 // Entered bottom
                 if(pos_center_y < 0.0f)
-                    p->y -= pen_depth_y;
+                    *y -= pen_depth_y;
                 else // Entered top
-                    p->y += pen_depth_y;
+                    *y += pen_depth_y;
             }
         }
     }
@@ -729,40 +1290,32 @@ void boundaryConditions(fluid_particle *p, AABB_t *boundary, param *params)
     // Make sure object is not outside boundary
     // The particle must not be equal to boundary max or hash potentially won't pick it up
     // as the particle will in the 'next' after last bin
-    if(p->x < boundary->min_x) {
-        p->x = boundary->min_x;
+    if(*x < boundary->min_x) {
+        *x = boundary->min_x;
     }
-    else if(p->x > boundary->max_x){
-        p->x = boundary->max_x-0.001f;
+    else if(*x > boundary->max_x){
+        *x = boundary->max_x-0.001f;
     }
-    if(p->y <  boundary->min_y) {
-        p->y = boundary->min_y;
+    if(*y <  boundary->min_y) {
+        *y = boundary->min_y;
     }
-    else if(p->y > boundary->max_y){
-        p->y = boundary->max_y-0.001f;
+    else if(*y > boundary->max_y){
+        *y = boundary->max_y-0.001f;
     }
 }
 
 // Initialize particles
-void initParticles(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles,
-                   AABB_t *water, int start_x, int number_particles_x,    
-                   edge_t *edges, int max_fluid_particles_local, float spacing, param* params)
+void initParticles(fluid_particles_t *particles, AABB_t *water, int start_x, int number_particles_x,
+                   int start_y, int number_particles_y, edge_t *edges, float spacing, param* params)
 {
     int i;
-    fluid_particle *p;
 
     // Create fluid volume
-    constructFluidVolume(fluid_particle_pointers, fluid_particles, water, start_x, number_particles_x, edges, spacing, params);
-
-    // NULL out unused fluid pointers
-    for(i=params->number_fluid_particles_local; i<max_fluid_particles_local; i++)
-        fluid_particle_pointers[i] = NULL;
+    constructFluidVolume(particles, water, start_x, number_particles_x, start_y, number_particles_y, edges, spacing, params);
 
     // Initialize particle values
     for(i=0; i<params->number_fluid_particles_local; i++) {
-        fluid_particle_pointers[i]->a_x = 0.0f;
-        fluid_particle_pointers[i]->a_y = 0.0f;
-        fluid_particle_pointers[i]->v_x = 0.0f;
-        fluid_particle_pointers[i]->v_y = 0.0f;
+        particles->v_x[i] = 0.0f;
+        particles->v_y[i] = 0.0f;
     }
 }
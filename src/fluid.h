@@ -26,9 +26,11 @@ THE SOFTWARE.
 #define fluid_fluid_h
 
 typedef struct FLUID_PARTICLE fluid_particle;
-typedef struct NEIGHBOR neighbor;
+typedef struct FLUID_PARTICLES fluid_particles_t;
 typedef struct PARAM param;
 typedef struct TUNABLE_PARAMETERS tunable_parameters;
+typedef struct PHASE_TASK_T phase_task_t;
+typedef struct PAIR_TASK_T pair_task_t;
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -43,6 +45,13 @@ typedef struct TUNABLE_PARAMETERS tunable_parameters;
 #define debug_print(...) \
             do { if (DEBUG) fprintf(stderr, __VA_ARGS__); } while (0)
 
+// Each frame compute ranks report the time they spent computing and a histogram of their particles along x
+// to the render node, BALANCE_BINS bins evenly divide the tank width
+// The report ends with the node start/end x and y, adopted by the render node when compute ranks balance the partitions
+#define BALANCE_BINS 128
+#define BALANCE_REPORT_BOUNDS (1 + BALANCE_BINS)
+#define BALANCE_REPORT_FIELDS (5 + BALANCE_BINS)
+
 // MPI doesn't have a C enum type
 // Defines will be ok for our use
 #define SPHERE_MOVER 0
@@ -53,6 +62,7 @@ typedef struct TUNABLE_PARAMETERS tunable_parameters;
 ////////////////////////////////////////////////
 
 // Standard fluid particle paramaters
+// Particles are stored as arrays in fluid_particles_t, this record is used to pack them for MPI
 struct FLUID_PARTICLE {
     float x_prev;
     float y_prev;
@@ -60,20 +70,39 @@ struct FLUID_PARTICLE {
     float y;
     float v_x;
     float v_y;
-    float a_x;
-    float a_y;
     float density;
     float density_near;
     float pressure;
     float pressure_near;
-    int id; // Id is 'local' index within the fluid particle pointer array
 };
 
-struct NEIGHBOR{
-    fluid_particle **fluid_neighbors;
-    int number_fluid_neighbors;
+// Structure of arrays fluid particle storage
+// Particles [0, number_fluid_particles_local) are owned by the node and halo particles directly follow them
+// Hot arrays are touched by every sweep and are allocated apart from the rarely used cold arrays
+struct FLUID_PARTICLES {
+    // Hot
+    float *x;
+    float *y;
+    float *v_x;
+    float *v_y;
+    float *density;
+    float *density_near;
+    // Cold
+    float *pressure;
+    float *pressure_near;
+    float *x_prev;
+    float *y_prev;
+    float *halo_d_x; // Displacement this rank gave each halo particle, returned to the owner of the particle
+    float *halo_d_y;
+    float *hot_block;  // Allocations backing the hot and cold arrays
+    float *cold_block;
+    int max_particles; // Length of each array, grown as particles arrive
 };
 
+// Arrays in each of the hot and cold blocks
+#define HOT_PARTICLE_ARRAYS 6
+#define COLD_PARTICLE_ARRAYS 6
+
 // These parameters are tunable by the render node
 struct TUNABLE_PARAMETERS {
     float rest_density;
@@ -87,6 +116,8 @@ struct TUNABLE_PARAMETERS {
     float time_step;
     float node_start_x;
     float node_end_x;
+    float node_start_y;
+    float node_end_y;
     float mover_center_x;
     float mover_center_y;
     float mover_width;
@@ -94,35 +125,77 @@ struct TUNABLE_PARAMETERS {
     char mover_type;
     char kill_sim;
     char active;
+    int awake_ranks; // Compute ranks taking part in each frame, the rest are parked by the render node
 };
 
 // Full parameters struct for simulation
 struct PARAM {
     tunable_parameters tunable_params;
     int number_fluid_particles_global;
-    int number_fluid_particles_local; // Number of non vacant particles not including halo
-    int max_fluid_particle_index;     // Max index used in actual particle array
-    int number_halo_particles;        // Starting at max_fluid_particle_index
+    int number_fluid_particles_local; // Number of particles not including halo
+    int number_halo_particles;        // Starting at number_fluid_particles_local
+    int number_computed_halo_particles; // Halo particles whose pairs this rank computes, the first of the halo particles
+    float skin;                       // Neighbor lists hold pairs within smoothing_radius + skin, 0 rebuilds them every hash
+    bool relax_cached_geometry;       // Relaxation uses pair geometry cached before relaxation instead of live positions, a Jacobi like relaxation
+    int partitions_x;                 // Columns and rows of the Cartesian grid of compute ranks
+    int partitions_y;
+    int partition_x;                  // Column and row of this rank
+    int partition_y;
+    int neighbor_ranks[NUMBER_NEIGHBORS]; // Compute rank in each neighbor direction, MPI_PROC_NULL beyond the edge of the grid
+    MPI_Comm column_comm;             // Compute ranks in this ranks column, which share its x bounds
+    MPI_Comm row_comm;                // Compute ranks in this ranks row, which share its y bounds
 }; // Simulation paramaters
 
+// Arguments shared by the blocks of a per particle phase run on the thread pool
+// Particle storage is periodically sorted by cell so a block of particles covers a run of neighboring cells
+struct PHASE_TASK_T {
+    fluid_particles_t *particles;
+    AABB_t *boundary_global;
+    param *params;
+    int number_particles;
+};
+
+// Arguments shared by the cells of a pair phase run on the thread pool
+// Each task is one cell of the colour being run
+struct PAIR_TASK_T {
+    fluid_particles_t *particles;
+    neighbor_grid_t *grid;
+    param *params;
+    int colour;
+};
+
 ////////////////////////////////////////////////
 // Function prototypes
 ////////////////////////////////////////////////
 //void collisionImpulse(fluid_particle *p, float norm_x, float norm_y, param *params);
-void boundaryConditions(fluid_particle *p, AABB_t *boundary, param *params);
-void initParticles(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles,
-                   AABB_t *water, int start_x, int number_particles_x, 
-		   edge_t *edges, int max_fluid_particles_local, float spacing, param* params);
-
-void start_simulation();
-void calculate_density(fluid_particle *p, fluid_particle *q, float ratio);
-void apply_gravity(fluid_particle **fluid_particle_pointers, param *params);
-void viscosity_impluses(fluid_particle **fluid_particle_pointers, neighbor* neighbors, param *params);
-void predict_positions(fluid_particle **fluid_particle_pointers, AABB_t *boundary_global, param *params);
-void double_density_relaxation(fluid_particle **fluid_particle_pointers, neighbor *neighbors, param *params);
-void updateVelocity(fluid_particle *p, param *params);
-void updateVelocities(fluid_particle **fluid_particle_pointers, edge_t *edges, AABB_t *boundary_global, param *params);
+size_t alloc_fluid_particles(fluid_particles_t *particles, int max_particles);
+bool reserve_fluid_particles(fluid_particles_t *particles, int number_particles);
+void free_fluid_particles(fluid_particles_t *particles);
+void copy_particle(fluid_particles_t *from_particles, int from, fluid_particles_t *to_particles, int to);
+void boundaryConditions(fluid_particles_t *particles, int i, AABB_t *boundary, param *params);
+void initParticles(fluid_particles_t *particles, AABB_t *water, int start_x, int number_particles_x,
+                   int start_y, int number_particles_y, edge_t *edges, float spacing, param* params);
+
+void start_simulation(bool progress);
+void calculate_density(fluid_particles_t *particles, int p, int q, float w, float w_near);
+void compute_densities(fluid_particles_t *particles, neighbor_list_t *neighbors, param *params);
+void compute_cell_densities(fluid_particles_t *particles, neighbor_grid_t *grid, param *params, int region);
+void compute_row_densities(fluid_particles_t *particles, neighbor_list_t *neighbors, int i, param *params);
+void apply_gravity(fluid_particles_t *particles, param *params);
+void apply_gravity_block(void *args, int block);
+void viscosity_impluses(fluid_particles_t *particles, neighbor_grid_t *grid, param *params);
+void viscosity_cell(void *args, int task_index);
+void viscosity_row(fluid_particles_t *particles, neighbor_list_t *fluid_neighbors, neighbor_list_t *halo_neighbors, int i, param *params);
+void predict_positions(fluid_particles_t *particles, AABB_t *boundary_global, param *params);
+void predict_positions_block(void *args, int block);
+void double_density_relaxation(fluid_particles_t *particles, neighbor_grid_t *grid, param *params);
+void compute_pressures_block(void *args, int block);
+void relaxation_cell(void *args, int task_index);
+void relaxation_row(fluid_particles_t *particles, neighbor_list_t *fluid_neighbors, neighbor_list_t *halo_neighbors, int i, param *params);
+void updateVelocity(fluid_particles_t *particles, int i, param *params);
+void updateVelocities(fluid_particles_t *particles, edge_t *edges, AABB_t *boundary_global, param *params);
+void update_velocities_block(void *args, int block);
 void checkVelocity(float *v_x, float *v_y);
-void identify_oob_particles(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles, oob_t *out_of_bounds, AABB_t *boundary_global, param *params);
+void identify_oob_particles(fluid_particles_t *particles, oob_t *out_of_bounds, neighbor_grid_t *grid, edge_t *edges, param *params);
 
 #endif
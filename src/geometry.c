@@ -26,34 +26,25 @@ THE SOFTWARE.
 #include "geometry.h"
 #include "fluid.h"
 
-void constructFluidVolume(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles, AABB_t *fluid, int start_x, 
-			  int number_particles_x, edge_t *edges, float spacing, param *params)
+void constructFluidVolume(fluid_particles_t *particles, AABB_t *fluid, int start_x, int number_particles_x,
+                          int start_y, int number_particles_y, edge_t *edges, float spacing, param *params)
 {
-    int num_y;
-    
-    // Number of particles in y,z, number in x is passed in
-    num_y = floor((fluid->max_y - fluid->min_y ) / spacing);
-    
+    int d;
+
     // zero out number of edge particles
-    edges->number_edge_particles_left = 0;
-    edges->number_edge_particles_right = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        edges->number_edge_particles[d] = 0;
     
     // Place particles inside bounding volume
     float x,y;
     int nx,ny;
     int i = 0;
-    fluid_particle *p;
-    for(ny=0; ny<num_y; ny++) {
-        y = fluid->min_y + ny*spacing;
+    for(ny=0; ny<number_particles_y; ny++) {
+        y = fluid->min_y + (start_y + ny)*spacing;
         for(nx=0; nx<number_particles_x; nx++) {
             x = fluid->min_x + (start_x + nx)*spacing;
-            p = fluid_particles + i;
-            p->x = x;
-            p->y = y;
-            
-            // Set pointer array
-            fluid_particle_pointers[i] = p;
-	    fluid_particle_pointers[i]->id = i;
+            particles->x[i] = x;
+            particles->y[i] = y;
             i++;
         }
     }
@@ -63,7 +54,6 @@ void constructFluidVolume(fluid_particle **fluid_particle_pointers, fluid_partic
     printf("rank %d max fluid x: %f\n", rank,fluid->min_x + (start_x + nx-1)*spacing);
 
     params->number_fluid_particles_local = i;
-    params->max_fluid_particle_index = i - 1;
 }
 
 // Sets upper bound on number of particles, used for memory allocation
@@ -78,13 +68,9 @@ void setParticleNumbers(AABB_t *boundary_global, AABB_t *fluid_global, edge_t *e
     num_y = floor((fluid_global->max_y - fluid_global->min_y ) / spacing);
     max_y = floor((boundary_global->max_y - boundary_global->min_y ) / spacing);
 
-    // Maximum edge(halo) particles
-    edges->max_edge_particles = params->number_fluid_particles_global;
-
-    // The out of bounds particles can become quite large
-    // If a flood of particles flows into and then out of a node
-    // This will be large
-    out_of_bounds->max_oob_particles = params->number_fluid_particles_global;
+    // Edge and out of bounds index arrays start empty and grow with the particles near the node edges
+    edges->max_edge_particles = 0;
+    out_of_bounds->max_oob_particles = 0;
 
     // Initial fluid particles
     int num_initial = num_x * num_y;
@@ -92,71 +78,58 @@ void setParticleNumbers(AABB_t *boundary_global, AABB_t *fluid_global, edge_t *e
 
     // Allow space for all particles if neccessary
     int num_local_max = params->number_fluid_particles_global;
+}
 
-    out_of_bounds->number_vacancies = 0;
-    
+// Split number_particles lattice points among number_partitions partitions
+// Remaining points from the equal division are added sequentially to the lowest partitions
+void partition_particles(int number_particles, int number_partitions, int partition, int *start, int *length)
+{
+    int i;
+    int equal_spacing = number_particles/number_partitions;
+    int remaining = number_particles - (equal_spacing * number_partitions);
+
+    *start = 0;
+    for (i=0; i<partition; i++)
+        *start += equal_spacing + (i<remaining?1:0);
+    *length = equal_spacing + (partition<remaining?1:0);
 }
 
 // Set local boundary and fluid particle
-void partitionProblem(AABB_t *boundary_global, AABB_t *fluid_global, int *x_start, int *length_x, float spacing, param *params)
+// The fluid lattice is split into the columns and rows of the grid of compute ranks
+void partitionProblem(AABB_t *boundary_global, AABB_t *fluid_global, int *x_start, int *length_x, int *y_start, int *length_y, float spacing, param *params)
 {
-    int i;
     int rank;
     MPI_Comm_rank(MPI_COMM_COMPUTE, &rank);
-    int nprocs;
-    MPI_Comm_size(MPI_COMM_COMPUTE, &nprocs);
 
     // number of fluid particles in x direction
     // +1 added for zeroth particle
     int fluid_particles_x = floor((fluid_global->max_x - fluid_global->min_x ) / spacing) + 1;
-    
-    // number of particles x direction
-    int *particle_length_x = malloc(nprocs*sizeof(int));
-    
-    // Number of particles in x direction assuming equal spacing
-    int equal_spacing = floor(fluid_particles_x/nprocs);
-    
-    // Initialize each node to have equal width
-    for (i=0; i<nprocs; i++)
-        particle_length_x[i] = equal_spacing;
-    
-    // Remaining particles from equal division
-    int remaining = fluid_particles_x - (equal_spacing * nprocs);
-    
-    // Add any remaining particles sequantially to left most nodes
-    for (i=0; i<nprocs; i++)
-        particle_length_x[i] += (i<remaining?1:0);
-    
-    // Number of particles to left of current node
-    int number_to_left = 0;
-    for (i=0; i<rank; i++)
-        number_to_left+=particle_length_x[i];
-       
-    // starting position of nodes x particles
-    *x_start = number_to_left;
-    // Number of particles in x direction for node
-    *length_x = particle_length_x[rank];
-        
+    int fluid_particles_y = floor((fluid_global->max_y - fluid_global->min_y ) / spacing);
+
+    // Starting lattice position and number of particles in each direction for node
+    partition_particles(fluid_particles_x, params->partitions_x, params->partition_x, x_start, length_x);
+    partition_particles(fluid_particles_y, params->partitions_y, params->partition_y, y_start, length_y);
+
     // Set node partition values
-    params->tunable_params.node_start_x = fluid_global->min_x + ((number_to_left-1) * spacing);
-    params->tunable_params.node_end_x   = params->tunable_params.node_start_x + (particle_length_x[rank] * spacing);
-    
-    if (rank == 0)
+    params->tunable_params.node_start_x = fluid_global->min_x + ((*x_start-1) * spacing);
+    params->tunable_params.node_end_x   = params->tunable_params.node_start_x + (*length_x * spacing);
+    params->tunable_params.node_start_y = fluid_global->min_y + ((*y_start-1) * spacing);
+    params->tunable_params.node_end_y   = params->tunable_params.node_start_y + (*length_y * spacing);
+
+    if (params->partition_x == 0)
         params->tunable_params.node_start_x  = boundary_global->min_x;
-    if (rank == nprocs-1)
+    if (params->partition_x == params->partitions_x-1)
         params->tunable_params.node_end_x   = boundary_global->max_x;
+    if (params->partition_y == 0)
+        params->tunable_params.node_start_y  = boundary_global->min_y;
+    if (params->partition_y == params->partitions_y-1)
+        params->tunable_params.node_end_y   = boundary_global->max_y;
 
-    printf("Rank %d start_x: %f, end_x :%f\n", rank, params->tunable_params.node_start_x, params->tunable_params.node_end_x);
+    printf("Rank %d start_x: %f, end_x :%f, start_y: %f, end_y: %f\n", rank, params->tunable_params.node_start_x, params->tunable_params.node_end_x,
+           params->tunable_params.node_start_y, params->tunable_params.node_end_y);
 
     // Update requested number of particles with actual value used
-    int num_y = floor((fluid_global->max_y - fluid_global->min_y ) / spacing);
-    int total_x = 0;
-    for(i=0; i<nprocs; i++)
-        total_x += particle_length_x[i];
-    params->number_fluid_particles_global = total_x * num_y;
-
-    free(particle_length_x);
-
+    params->number_fluid_particles_global = fluid_particles_x * fluid_particles_y;
 }
 
 ////////////////////////////////////////////////
@@ -42,10 +42,11 @@ struct AABB_T {
 float min(float a, float b);
 float max(float a, float b);
 int sgn(float x);
-void partitionProblem(AABB_t *boundary_global, AABB_t *fluid_global, int *x_start, int *length_x, float spacing, param *params);
+void partition_particles(int number_particles, int number_partitions, int partition, int *start, int *length);
+void partitionProblem(AABB_t *boundary_global, AABB_t *fluid_global, int *x_start, int *length_x, int *y_start, int *length_y, float spacing, param *params);
 void setParticleNumbers(AABB_t *boundary_global, AABB_t *fluid_global, edge_t *edges, oob_t *out_of_bounds, int number_particles_x, float spacing, param *params);
 
-void constructFluidVolume(fluid_particle **fluid_particle_pointers, fluid_particle *fluid_particles, AABB_t* fluid, int start_x, 
-                          int number_particles_x, edge_t *edges, float spacing, param *params);
+void constructFluidVolume(fluid_particles_t *particles, AABB_t* fluid, int start_x, int number_particles_x,
+                          int start_y, int number_particles_y, edge_t *edges, float spacing, param *params);
 
 #endif
@@ -23,6 +23,8 @@ THE SOFTWARE.
 */
 
 #include "hash.h"
+#include "simd.h"
+#include "threads.h"
 #include "fluid.h"
 #include <math.h>
 #include <stdbool.h>
@@ -31,212 +33,931 @@ THE SOFTWARE.
 #include <assert.h>
 
 // Uniform grid hash, this prevents having to check duplicates when inserting
-// Fabs needed as neighbor search can go out of bounds
-unsigned int hash_val(float x, float y, neighbor_grid_t *grid, param *params)
+// Coordinates are clamped to the grid so no particle can index outside of it
+// Clamping keeps particles within a cell of each other in neighboring cells so no pairs are lost
+unsigned int hash_val(float x, float y, neighbor_grid_t *grid)
 {
     const float spacing = grid->spacing;
+    const int size_x = grid->size_x;
+    const int size_y = grid->size_y;
 
     // Calculate grid coordinates
-    unsigned int grid_x,grid_y;
-    grid_x = floor(x/spacing);
-    grid_y = floor(y/spacing);
+    int grid_x,grid_y;
+    grid_x = (int)floor(x/spacing) - grid->origin_x;
+    grid_y = (int)floor(y/spacing) - grid->origin_y;
 
-    unsigned int grid_position = (grid_y * grid->size_x + grid_x);
+    if(grid_x < 0)
+        grid_x = 0;
+    else if(grid_x >= size_x)
+        grid_x = size_x - 1;
+    if(grid_y < 0)
+        grid_y = 0;
+    else if(grid_y >= size_y)
+        grid_y = size_y - 1;
+
+    unsigned int grid_position = (grid_y * size_x + grid_x);
 
     return grid_position;
 }
 
-// Add halo particles to neighbors array
-// We also calculate the density as it's convenient
-void hash_halo(fluid_particle **fluid_particle_pointers,  neighbor_grid_t *grid, param *params, bool compute_density)
-{
-    int index,i,dx,dy,n, grid_x, grid_y;
-    float x,y,r2, r;
-    fluid_particle *h_p, *p;
-
-    int n_start = params->number_fluid_particles_local; // Start of halo particles
-    int n_finish = n_start + params->number_halo_particles;  // End of halo particles
-    float h = params->tunable_params.smoothing_radius;
-    float h_recip = 1.0f/h;
-
-    unsigned int max_neighbors = grid->max_neighbors;
-    float spacing = grid->spacing;
-    neighbor *neighbors = grid->neighbors;
-    bucket_t *grid_buckets = grid->grid_buckets;
-
-    float ratio;
-    float h2 = h*h;
-    neighbor *ne;
-
-    // Loop over each halo particle
-    for(i=n_start; i<n_finish; i++)
-    {
-	// Retrieve hash index for halo particle
-        h_p = fluid_particle_pointers[i];
-
-	// Calculate coordinates within bucket grid
-	grid_x = floor(h_p->x/spacing);
-	grid_y = floor(h_p->y/spacing);
-
-        // Check neighbors of current bucket
-        // This only checks 'behind' neighbors as 'forward' neighbors are fluid particles
-        for (dx=-1; dx<=1; dx++) {
-    	    for (dy=-1; dy<=1; dy++) {
-
-                // If the neighbor is outside of the grid we don't process it
-                if ( grid_y+dy < 0 || grid_x+dx < 0 || (grid_x+dx) >= grid->size_x || (grid_y+dy) >= grid->size_y)
-                    continue;
+// Counting sort of the first number_particles particles into the cell list
+// cell_particles holds particle indicies ordered by cell, cell_starts[cell] is the
+// offset of the cells first particle and cell_counts[cell] the number of particles in it
+// The sort is stable so particles within a cell remain in index order
+// The per particle arrays of the grid are grown to match the particle arrays
+void bin_particles(fluid_particles_t *particles, int number_particles, neighbor_grid_t *grid, param *params)
+{
+    int i;
+    unsigned int index, offset;
+
+    reserve_grid_particles(grid, particles->max_particles);
+
+    unsigned int length_hash = grid->size_x * grid->size_y;
+    unsigned int *cell_starts = grid->cell_starts;
+    unsigned int *cell_counts = grid->cell_counts;
+    unsigned int *particle_cells = grid->particle_cells;
+
+    // Threaded binning gives each block of particles its own histogram so no counts are shared
+    if(grid->number_blocks > 1) {
+        int b;
+        unsigned int count;
+        unsigned int *block_cell_counts = grid->block_cell_counts;
+        build_task_t task;
+        task.particles = particles;
+        task.grid = grid;
+        task.params = params;
+        task.number_particles = number_particles;
+
+        run_tasks(count_block_cells, &task, grid->number_blocks);
+
+        // Exclusive prefix sum over cells and then blocks within a cell
+        // Lower blocks hold lower particle indicies so the sort remains stable
+        // Each blocks histogram is replaced with its first fill offset in each cell
+        offset = 0;
+        for (index=0; index<length_hash; index++) {
+            cell_starts[index] = offset;
+            for (b=0; b<grid->number_blocks; b++) {
+                count = block_cell_counts[b*length_hash + index];
+                block_cell_counts[b*length_hash + index] = offset;
+                offset += count;
+            }
+            cell_counts[index] = offset - cell_starts[index];
+        }
+        cell_starts[length_hash] = offset;
+
+        run_tasks(scatter_block_cells, &task, grid->number_blocks);
+
+        return;
+    }
+
+    // zero out number of particles in each cell
+    memset(cell_counts, 0, length_hash*sizeof(unsigned int));
+
+    // Count particles in each cell
+    for (i=0; i<number_particles; i++) {
+        index = hash_val(particles->x[i], particles->y[i], grid);
+        particle_cells[i] = index;
+        cell_counts[index]++;
+    }
+
+    // Exclusive prefix sum gives the start of each cell
+    offset = 0;
+    for (index=0; index<length_hash; index++) {
+        cell_starts[index] = offset;
+        offset += cell_counts[index];
+    }
+    cell_starts[length_hash] = offset;
+
+    // Scatter particle indicies into their cells, cell_counts is rebuilt as the fill count
+    memset(cell_counts, 0, length_hash*sizeof(unsigned int));
+    for (i=0; i<number_particles; i++) {
+        index = particle_cells[i];
+        grid->cell_particles[cell_starts[index] + cell_counts[index]++] = i;
+    }
+}
 
-	        // Calculate index of neighbor cell
-	        index = (grid_y + dy)*grid->size_x + (grid_x + dx);
+// Count the particles of a block in each cell
+void count_block_cells(void *args, int block)
+{
+    build_task_t *task = args;
+    neighbor_grid_t *grid = task->grid;
+    int i;
+    int begin, end;
+    unsigned int index;
+    unsigned int length_hash = grid->size_x * grid->size_y;
+    unsigned int *cell_counts = &grid->block_cell_counts[block*length_hash];
+
+    block_range(block, grid->number_blocks, task->number_particles, &begin, &end);
+
+    memset(cell_counts, 0, length_hash*sizeof(unsigned int));
+
+    for (i=begin; i<end; i++) {
+        index = hash_val(task->particles->x[i], task->particles->y[i], grid);
+        grid->particle_cells[i] = index;
+        cell_counts[index]++;
+    }
+}
 
-                // Go through each fluid particle, p, in neighbor point bucket
-                for (n=0; n<grid_buckets[index].number_fluid; n++) {
-                    p = grid_buckets[index].fluid_particles[n];
-	
-		    // Enforce cutoff
-                    r2 = (h_p->x-p->x)*(h_p->x-p->x) + (h_p->y-p->y)*(h_p->y-p->y);
-                    if(r2 > h2)
-                        continue;
-	
-                     // Get neighbor bucket for particle p and add halo particle to it
-                     ne = &neighbors[p->id];
-                     if (ne->number_fluid_neighbors < max_neighbors) {
-                         ne->fluid_neighbors[ne->number_fluid_neighbors++] = h_p;
-			 if(compute_density) {
-			    r = sqrt(r2);
-                            ratio = r*h_recip;
-                            calculate_density(p, h_p, ratio);
-		  	  }
-                     }
-		     else
-			debug_print("halo overflowing\n");
+// Scatter the particles of a block into the cell list from the blocks fill offsets
+void scatter_block_cells(void *args, int block)
+{
+    build_task_t *task = args;
+    neighbor_grid_t *grid = task->grid;
+    int i;
+    int begin, end;
+    unsigned int index;
+    unsigned int length_hash = grid->size_x * grid->size_y;
+    unsigned int *cell_offsets = &grid->block_cell_counts[block*length_hash];
+
+    block_range(block, grid->number_blocks, task->number_particles, &begin, &end);
+
+    for (i=begin; i<end; i++) {
+        index = grid->particle_cells[i];
+        grid->cell_particles[cell_offsets[index]++] = i;
+    }
+}
 
-                }
+// Allocate the per block storage used by the threaded build
+// The grid must already be sized, fewer than 2 blocks builds serially
+// Returns the number of bytes allocated
+size_t alloc_build_blocks(neighbor_grid_t *grid, int number_blocks, bool cache_geometry)
+{
+    int b;
+    unsigned int length_hash = grid->max_cells;
+
+    grid->number_blocks = 0;
+    grid->block_cell_counts = NULL;
+    grid->block_rows = NULL;
+    grid->block_neighbors = NULL;
+    if(number_blocks < 2)
+        return 0;
+
+    grid->block_cell_counts = malloc(number_blocks*length_hash*sizeof(unsigned int));
+    grid->block_rows = malloc((number_blocks+1)*sizeof(unsigned int));
+    grid->block_neighbors = calloc(number_blocks, sizeof(neighbor_list_t));
+    if(grid->block_cell_counts == NULL || grid->block_rows == NULL || grid->block_neighbors == NULL) {
+        printf("Could not allocate build blocks\n");
+        return 0;
+    }
+
+    // Block lists only hold pairs, their rows are written directly to the list being filled
+    for(b=0; b<number_blocks; b++)
+        grid->block_neighbors[b].cache_geometry = cache_geometry;
+
+    grid->number_blocks = number_blocks;
+
+    return (number_blocks*length_hash + number_blocks+1)*sizeof(unsigned int) + number_blocks*sizeof(neighbor_list_t);
+}
+
+void free_build_blocks(neighbor_grid_t *grid)
+{
+    int b;
+
+    for(b=0; b<grid->number_blocks; b++) {
+        grid->block_neighbors[b].starts = NULL;
+        grid->block_neighbors[b].counts = NULL;
+        free_neighbor_list(&grid->block_neighbors[b]);
+    }
+    free(grid->block_cell_counts);
+    free(grid->block_rows);
+    free(grid->block_neighbors);
+}
 
-            } // End neighbor search y
-        } // End neighbor search x
+// Allocate the per particle rows of a neighbor list
+// Pair storage is allocated as pairs are added
+// Returns the number of bytes allocated
+size_t alloc_neighbor_list(neighbor_list_t *neighbors, int max_particles, bool cache_geometry)
+{
+    neighbors->starts = calloc(max_particles, sizeof(unsigned int));
+    neighbors->counts = calloc(max_particles, sizeof(unsigned int));
+    neighbors->neighbor_indicies = NULL;
+    neighbors->number_pairs = 0;
+    neighbors->max_pairs = 0;
+    neighbors->cache_geometry = cache_geometry;
+    neighbors->geometry_current = false;
+    neighbors->pair_r = NULL;
+    neighbors->pair_u_x = NULL;
+    neighbors->pair_u_y = NULL;
+    neighbors->pair_OmR = NULL;
+    if(neighbors->starts == NULL || neighbors->counts == NULL)
+        printf("Could not allocate neighbor rows\n");
+
+    return 2*max_particles*sizeof(unsigned int);
+}
 
-    } // End halo particle loop
+void free_neighbor_list(neighbor_list_t *neighbors)
+{
+    free(neighbors->starts);
+    free(neighbors->counts);
+    free(neighbors->neighbor_indicies);
+    free(neighbors->pair_r);
+    free(neighbors->pair_u_x);
+    free(neighbors->pair_u_y);
+    free(neighbors->pair_OmR);
+}
 
-} 
+// Make room for number_pairs more pairs, growing the pair storage geometrically
+// Returns false if the storage could not be grown
+bool reserve_neighbors(neighbor_list_t *neighbors, unsigned int number_pairs)
+{
+    unsigned int max_pairs;
+    unsigned int *neighbor_indicies;
+    float *pair_r, *pair_u_x, *pair_u_y, *pair_OmR;
+
+    if(neighbors->number_pairs + number_pairs <= neighbors->max_pairs)
+        return true;
+
+    max_pairs = neighbors->max_pairs ? 2*neighbors->max_pairs : 1024;
+    while(max_pairs < neighbors->number_pairs + number_pairs)
+        max_pairs *= 2;
+
+    neighbor_indicies = realloc(neighbors->neighbor_indicies, max_pairs*sizeof(unsigned int));
+    if(neighbor_indicies == NULL) {
+        printf("Could not allocate neighbors\n");
+        return false;
+    }
+    neighbors->neighbor_indicies = neighbor_indicies;
+
+    if(neighbors->cache_geometry) {
+        pair_r = realloc(neighbors->pair_r, max_pairs*sizeof(float));
+        if(pair_r != NULL) neighbors->pair_r = pair_r;
+        pair_u_x = realloc(neighbors->pair_u_x, max_pairs*sizeof(float));
+        if(pair_u_x != NULL) neighbors->pair_u_x = pair_u_x;
+        pair_u_y = realloc(neighbors->pair_u_y, max_pairs*sizeof(float));
+        if(pair_u_y != NULL) neighbors->pair_u_y = pair_u_y;
+        pair_OmR = realloc(neighbors->pair_OmR, max_pairs*sizeof(float));
+        if(pair_OmR != NULL) neighbors->pair_OmR = pair_OmR;
+        if(pair_r == NULL || pair_u_x == NULL || pair_u_y == NULL || pair_OmR == NULL) {
+            printf("Could not allocate pair geometry\n");
+            return false;
+        }
+    }
 
-// The following function will fill the i'th neighbor bucket with the i'th fluid_particle_pointers particle neighbors
-// Only the forward half of the neighbors are added as the forces are symmetrized.
-// We also calculate the density as it's convenient
-void hash_fluid(fluid_particle **fluid_particle_pointers, neighbor_grid_t *grid, param *params, bool compute_density)
-{
-        int i,j,dx,dy,n,c;
-        float x,y, px,py;
-        float h = params->tunable_params.smoothing_radius;
-        float h_recip = 1.0f/h;
-        float h2 = h*h;
-        int n_f = params->number_fluid_particles_local;
-
-        unsigned int max_neighbors = grid->max_neighbors;
-        unsigned int max_bucket_size = grid->max_bucket_size;
-        neighbor *neighbors = grid->neighbors;
-        bucket_t *grid_buckets = grid->grid_buckets; 
-        unsigned int length_hash = grid->size_x * grid->size_y;
-
-        fluid_particle *p, *q, *q_neighbor;
-        neighbor *ne;
-        float r,r2, ratio; 
-        unsigned int index, neighbor_index;
-
-        // zero out number of particles in bucket
-        for (index=0; index<length_hash; index++){
-            grid_buckets[index].number_fluid = 0;
+    neighbors->max_pairs = max_pairs;
+    debug_print("neighbor pairs grown to %u\n", max_pairs);
+
+    return true;
+}
+
+// Grow the per particle rows of a neighbor list from old_max_particles to max_particles, new rows are empty
+// Returns false if the rows could not be grown
+bool reserve_neighbor_rows(neighbor_list_t *neighbors, int old_max_particles, int max_particles)
+{
+    unsigned int *starts, *counts;
+
+    starts = realloc(neighbors->starts, max_particles*sizeof(unsigned int));
+    if(starts != NULL)
+        neighbors->starts = starts;
+    counts = realloc(neighbors->counts, max_particles*sizeof(unsigned int));
+    if(counts != NULL)
+        neighbors->counts = counts;
+    if(starts == NULL || counts == NULL) {
+        printf("Could not allocate neighbor rows\n");
+        return false;
+    }
+    memset(&neighbors->counts[old_max_particles], 0, (max_particles - old_max_particles)*sizeof(unsigned int));
+
+    return true;
+}
+
+// Make room for number_cells cells, growing the cell arrays geometrically
+// Cells are binned before they are walked, counts of new cells start zeroed as counts did before the first hash
+// Returns false if the arrays could not be grown
+bool reserve_grid_cells(neighbor_grid_t *grid, unsigned int number_cells)
+{
+    unsigned int max;
+    unsigned int *cell_starts, *cell_counts, *block_cell_counts;
+
+    if(number_cells <= grid->max_cells)
+        return true;
+
+    max = grid->max_cells ? 2*grid->max_cells : number_cells;
+    while(max < number_cells)
+        max *= 2;
+
+    cell_starts = realloc(grid->cell_starts, (max+1)*sizeof(unsigned int));
+    if(cell_starts != NULL)
+        grid->cell_starts = cell_starts;
+    cell_counts = realloc(grid->cell_counts, max*sizeof(unsigned int));
+    if(cell_counts != NULL)
+        grid->cell_counts = cell_counts;
+    if(cell_starts == NULL || cell_counts == NULL) {
+        printf("Could not allocate hash\n");
+        return false;
+    }
+    memset(&grid->cell_counts[grid->max_cells], 0, (max - grid->max_cells)*sizeof(unsigned int));
+
+    if(grid->number_blocks > 1) {
+        block_cell_counts = realloc(grid->block_cell_counts, grid->number_blocks*max*sizeof(unsigned int));
+        if(block_cell_counts == NULL) {
+            printf("Could not allocate build blocks\n");
+            return false;
+        }
+        grid->block_cell_counts = block_cell_counts;
+    }
+
+    grid->max_cells = max;
+    debug_print("grid cells grown to %u\n", max);
+
+    return true;
+}
+
+// Place the grid over the cells of the domain holding this ranks partition and a margin of one cell for its halo
+// Cells are aligned with the cells of the domain and the grid never extends beyond it
+// Must be called before the fluid particles are binned so the grid follows the partition as it moves
+// Returns false if the cell arrays could not be grown
+bool place_grid(neighbor_grid_t *grid, param *params)
+{
+    int begin_x, end_x, begin_y, end_y;
+
+    begin_x = floor(params->tunable_params.node_start_x/grid->spacing) - 1;
+    end_x = floor(params->tunable_params.node_end_x/grid->spacing) + 2;
+    begin_y = floor(params->tunable_params.node_start_y/grid->spacing) - 1;
+    end_y = floor(params->tunable_params.node_end_y/grid->spacing) + 2;
+    clamp_interior_cells(&begin_x, &end_x, grid->domain_size_x);
+    clamp_interior_cells(&begin_y, &end_y, grid->domain_size_y);
+
+    // Cells keep the colour they have in the domain, so the pair sweeps add pairs in the same order wherever the partition is
+    begin_x -= begin_x % 3;
+    begin_y -= begin_y % 3;
+
+    grid->origin_x = begin_x;
+    grid->origin_y = begin_y;
+    grid->size_x = end_x - begin_x;
+    grid->size_y = end_y - begin_y;
+
+    return reserve_grid_cells(grid, grid->size_x * grid->size_y);
+}
+
+// Grow the per particle arrays of the grid and the neighbor list rows to max_particles, the length of the particle arrays
+// The arrays are only reallocated after the particle arrays have grown, which they do geometrically
+// Returns false if the arrays could not be grown
+bool reserve_grid_particles(neighbor_grid_t *grid, int max_particles)
+{
+    unsigned int *cell_particles, *particle_cells;
+    float *build_x, *build_y;
+    int *candidates;
+
+    if(max_particles <= grid->max_particles)
+        return true;
+
+    cell_particles = realloc(grid->cell_particles, max_particles*sizeof(unsigned int));
+    if(cell_particles != NULL)
+        grid->cell_particles = cell_particles;
+    particle_cells = realloc(grid->particle_cells, max_particles*sizeof(unsigned int));
+    if(particle_cells != NULL)
+        grid->particle_cells = particle_cells;
+    build_x = realloc(grid->build_x, max_particles*sizeof(float));
+    if(build_x != NULL)
+        grid->build_x = build_x;
+    build_y = realloc(grid->build_y, max_particles*sizeof(float));
+    if(build_y != NULL)
+        grid->build_y = build_y;
+    candidates = realloc(grid->candidates, max_particles*sizeof(int));
+    if(candidates != NULL)
+        grid->candidates = candidates;
+    if(cell_particles == NULL || particle_cells == NULL || build_x == NULL || build_y == NULL || candidates == NULL) {
+        printf("Could not allocate hash\n");
+        return false;
+    }
+
+    if(!reserve_neighbor_rows(&grid->fluid_neighbors, grid->max_particles, max_particles)
+       || !reserve_neighbor_rows(&grid->halo_neighbors, grid->max_particles, max_particles)
+       || !reserve_neighbor_rows(&grid->mirror_neighbors, grid->max_particles, max_particles))
+        return false;
+
+    grid->max_particles = max_particles;
+    debug_print("grid particles grown to %d\n", max_particles);
+
+    return true;
+}
+
+// Copy a lane of geometry computed by geometry_terms into the pair cache
+void store_pair_geometry(neighbor_list_t *neighbors, unsigned int pair, simd_batch_t *batch, int lane)
+{
+    neighbors->pair_r[pair] = batch->r[lane];
+    neighbors->pair_u_x[pair] = batch->u_x[lane];
+    neighbors->pair_u_y[pair] = batch->u_y[lane];
+    neighbors->pair_OmR[pair] = batch->OmR[lane];
+}
+
+// Copy cached geometry into a lane for the cached kernels
+void load_pair_geometry(neighbor_list_t *neighbors, unsigned int pair, simd_batch_t *batch, int lane)
+{
+    batch->r[lane] = neighbors->pair_r[pair];
+    batch->u_x[lane] = neighbors->pair_u_x[pair];
+    batch->u_y[lane] = neighbors->pair_u_y[pair];
+    batch->OmR[lane] = neighbors->pair_OmR[pair];
+}
+
+// Test p against number_candidates candidate neighbors and append those within h + skin to p's row
+// Candidates are processed in batches of SIMD_BATCH by the density pair kernel and appended in candidate order
+// Pairs beyond h but within the skin are added with zero density contribution
+// If the list caches geometry the geometry kernel is used instead and its results are stored with the pairs
+// If halo is PAIRS_HALO or PAIRS_MIRROR only the computed or mirror halo candidates are tested
+void add_neighbors(fluid_particles_t *particles, int p, unsigned int *candidates, int number_candidates, neighbor_list_t *neighbors, param *params, bool compute_density, int halo)
+{
+    int j, l, count;
+    unsigned int q;
+    unsigned int batch_candidates[SIMD_BATCH];
+    // Pairs out to the skin are kept so the lists remain valid as particles move
+    float cutoff = params->tunable_params.smoothing_radius + params->skin;
+    float cutoff2 = cutoff*cutoff;
+    int n_f = params->number_fluid_particles_local;
+    float *x = particles->x;
+    float *y = particles->y;
+    simd_batch_t batch;
+
+    // Computed halo particles are first in the halo, the mirror halo particles follow them
+    unsigned int halo_begin = n_f;
+    unsigned int halo_end = n_f + params->number_computed_halo_particles;
+    if(halo == PAIRS_MIRROR) {
+        halo_begin = halo_end;
+        halo_end = n_f + params->number_halo_particles;
+    }
+
+    j = 0;
+    while(j < number_candidates) {
+        // Gather the next batch of candidates
+        count = 0;
+        for(; j<number_candidates && count<SIMD_BATCH; j++) {
+            q = candidates[j];
+            if(halo && (q < halo_begin || q >= halo_end))
+                continue;
+            batch_candidates[count] = q;
+            batch.q_x[count] = x[q];
+            batch.q_y[count] = y[q];
+            count++;
+        }
+        if(count == 0)
+            break;
+        pad_batch(&batch, count, x[p], y[p], 0.0f, 0.0f, params);
+
+        if(neighbors->cache_geometry)
+            simd_kernels.geometry_terms(x[p], y[p], &batch, params);
+        else
+            simd_kernels.density_terms(x[p], y[p], &batch, params);
+
+        if(!reserve_neighbors(neighbors, count))
+            return;
+
+        for(l=0; l<count; l++) {
+            if(batch.r2[l] > cutoff2)
+                continue;
+            q = batch_candidates[l];
+            if(neighbors->cache_geometry)
+                store_pair_geometry(neighbors, neighbors->number_pairs, &batch, l);
+            neighbors->neighbor_indicies[neighbors->number_pairs++] = q;
+            neighbors->counts[p]++;
+            if(compute_density)
+                calculate_density(particles, p, q, batch.w[l], batch.w_near[l]);
         }
-        
-        // First pass - insert fluid particles into hash
-        for (i=0; i<n_f; i++) {
-            p = fluid_particle_pointers[i];
-
-            neighbors[i].number_fluid_neighbors = 0;
-            
-            index = hash_val(p->x, p->y, grid, params);
-
-            if (grid_buckets[index].number_fluid < max_bucket_size) {
-                grid_buckets[index].fluid_particles[grid_buckets[index].number_fluid] = p;
-                grid_buckets[index].number_fluid++;
+    }
+}
+
+// Walk the cells of a region in grid rows [row_begin, row_end) of the binned cell list and append a row for each walked particle
+// Each particles row is written contiguously so the rows are in cell order
+// The fluid pass checks the rest of the particles cell and the "forward" neighbor cells so each pair is found once
+// The halo pass walks only fluid particles and checks every neighbor cell for halo particles
+void fill_neighbor_rows(fluid_particles_t *particles, neighbor_grid_t *grid, neighbor_list_t *neighbors, param *params, bool compute_density, int halo, int region, int row_begin, int row_end)
+{
+    int i,j,dx,dy,c;
+    int n_f = params->number_fluid_particles_local;
+
+    unsigned int *cell_starts = grid->cell_starts;
+    unsigned int *cell_counts = grid->cell_counts;
+    unsigned int *cell_particles = grid->cell_particles;
+
+    unsigned int index, neighbor_index, start, count, neighbor_start, neighbor_count;
+    unsigned int p;
+
+    for (j=row_begin; j<row_end; j++) {
+        for(i=0; i<grid->size_x; i++) {
+            if(!cell_in_region(grid, i, j, region))
+                continue;
+
+            index = (j * grid->size_x + i);
+            count = cell_counts[index];
+            if(count == 0)
+                continue;
+            start = cell_starts[index];
+
+            for(c=0; c<count; c++) {
+                p = cell_particles[start+c];
+                if(halo && p >= n_f)
+                    continue;
+
+                neighbors->starts[p] = neighbors->number_pairs;
+                neighbors->counts[p] = 0;
+
+                // Process current cells own particle interactions
+                // This will only add one neighbor entry per force-pair
+                if(!halo)
+                    add_neighbors(particles, p, &cell_particles[start+c+1], count-c-1, neighbors, params, compute_density, halo);
+
+                // Check neighbors of current cell
+                for (dx=(halo?-1:0); dx<=1; dx++) {
+                    for (dy=((halo||dx)?-1:1); dy<=1; dy++) {
+
+                        // If the neighbor is outside of the grid we don't process it
+                        if ( j+dy < 0 || i+dx < 0 || (i+dx) >= grid->size_x || (j+dy) >= grid->size_y)
+                            continue;
+
+                        neighbor_index = (j+dy)*grid->size_x + (i+dx);
+                        neighbor_count = cell_counts[neighbor_index];
+                        if(neighbor_count == 0)
+                            continue;
+                        neighbor_start = cell_starts[neighbor_index];
+
+                        add_neighbors(particles, p, &cell_particles[neighbor_start], neighbor_count, neighbors, params, compute_density, halo);
+
+                    } // end dy
+                }  // end dx
+            } // end cell particles
+        } // end grid x
+    } // end grid y
+}
+
+// Fill the rows of a block of grid rows into the blocks own pair storage
+// Row starts are relative to the block until the blocks are joined
+void fill_block_neighbors(void *args, int block)
+{
+    build_task_t *task = args;
+    neighbor_grid_t *grid = task->grid;
+    neighbor_list_t *block_neighbors = &grid->block_neighbors[block];
+
+    // Each particle is walked by a single block so the rows can be shared
+    block_neighbors->starts = task->neighbors->starts;
+    block_neighbors->counts = task->neighbors->counts;
+    block_neighbors->number_pairs = 0;
+
+    fill_neighbor_rows(task->particles, grid, block_neighbors, task->params, false, task->halo, task->region, grid->block_rows[block], grid->block_rows[block+1]);
+}
+
+// Copy a blocks pairs into the list after the pairs of lower blocks and offset its row starts to match
+// The pairs already in the list are kept
+void join_block_neighbors(void *args, int block)
+{
+    build_task_t *task = args;
+    neighbor_grid_t *grid = task->grid;
+    neighbor_list_t *neighbors = task->neighbors;
+    neighbor_list_t *block_neighbors = &grid->block_neighbors[block];
+    int b, i, j, c;
+    int n_f = task->params->number_fluid_particles_local;
+    unsigned int index, p;
+    unsigned int offset = neighbors->number_pairs;
+    unsigned int number_pairs = block_neighbors->number_pairs;
+
+    for(b=0; b<block; b++)
+        offset += grid->block_neighbors[b].number_pairs;
+
+    memcpy(&neighbors->neighbor_indicies[offset], block_neighbors->neighbor_indicies, number_pairs*sizeof(unsigned int));
+    if(neighbors->cache_geometry) {
+        memcpy(&neighbors->pair_r[offset], block_neighbors->pair_r, number_pairs*sizeof(float));
+        memcpy(&neighbors->pair_u_x[offset], block_neighbors->pair_u_x, number_pairs*sizeof(float));
+        memcpy(&neighbors->pair_u_y[offset], block_neighbors->pair_u_y, number_pairs*sizeof(float));
+        memcpy(&neighbors->pair_OmR[offset], block_neighbors->pair_OmR, number_pairs*sizeof(float));
+    }
+
+    for (j=grid->block_rows[block]; j<grid->block_rows[block+1]; j++) {
+        for(i=0; i<grid->size_x; i++) {
+            if(!cell_in_region(grid, i, j, task->region))
+                continue;
+            index = j*grid->size_x + i;
+            for(c=0; c<grid->cell_counts[index]; c++) {
+                p = grid->cell_particles[grid->cell_starts[index]+c];
+                if(task->halo && p >= n_f)
+                    continue;
+                neighbors->starts[p] += offset;
             }
-	    else
-		debug_print("first pass overflow\n");
         }
+    }
+}
 
-        // Second pass - fill particle neighbors by processing grid of buckets
+// Fill a neighbor list from the binned cell list
+// The threaded build fills blocks of grid rows in parallel and joins them in row order
+// so the list, and any densities computed, are identical to the serial build
+// The interior cells are appended to a list started by the boundary cells
+void fill_neighbors(fluid_particles_t *particles, neighbor_grid_t *grid, neighbor_list_t *neighbors, param *params, bool compute_density, int halo, int region)
+{
+    int b, i, j, c, row;
+    int n_f = params->number_fluid_particles_local;
+    int number_blocks = grid->number_blocks;
+    unsigned int index, p, number_binned, number_pairs;
+    build_task_t task;
+
+    if(region != CELLS_INTERIOR) {
+        neighbors->number_pairs = 0;
+        neighbors->geometry_current = neighbors->cache_geometry;
+    }
+
+    if(number_blocks < 2) {
+        fill_neighbor_rows(particles, grid, neighbors, params, compute_density, halo, region, 0, grid->size_y);
+        return;
+    }
+
+    // Split the grid rows into blocks holding similar numbers of binned particles
+    number_binned = grid->cell_starts[grid->size_x*grid->size_y];
+    row = 0;
+    for(b=0; b<number_blocks; b++) {
+        while(row < grid->size_y && grid->cell_starts[row*grid->size_x] < (unsigned long)b*number_binned/number_blocks)
+            row++;
+        grid->block_rows[b] = row;
+    }
+    grid->block_rows[number_blocks] = grid->size_y;
+
+    task.particles = particles;
+    task.grid = grid;
+    task.neighbors = neighbors;
+    task.params = params;
+    task.halo = halo;
+    task.region = region;
+
+    run_tasks(fill_block_neighbors, &task, number_blocks);
+
+    number_pairs = 0;
+    for(b=0; b<number_blocks; b++)
+        number_pairs += grid->block_neighbors[b].number_pairs;
+    // Leave the whole list empty if the joined pairs do not fit, an interior build would otherwise keep rows pointing past the pairs held
+    if(!reserve_neighbors(neighbors, number_pairs)) {
+        neighbors->number_pairs = 0;
+        neighbors->geometry_current = false;
+        memset(neighbors->starts, 0, n_f*sizeof(unsigned int));
+        memset(neighbors->counts, 0, n_f*sizeof(unsigned int));
+        for(b=0; b<number_blocks; b++)
+            grid->block_neighbors[b].number_pairs = 0;
+        return;
+    }
+
+    run_tasks(join_block_neighbors, &task, number_blocks);
+    neighbors->number_pairs += number_pairs;
+
+    // Densities are accumulated serially in the order the serial build would add them
+    if(compute_density) {
         for (j=0; j<grid->size_y; j++) {
             for(i=0; i<grid->size_x; i++) {
-
-            index = (j * grid->size_x + i);
-	    if(grid_buckets[index].number_fluid == 0)
-	        continue;
-
-            // Process current buckets own particle interactions
-            // This will only add one neighbor entry per force-pair
-            for(c=0; c<grid_buckets[index].number_fluid; c++) {
-                p = grid_buckets[index].fluid_particles[c];
-                ne = &neighbors[p->id];
-                for(n=c+1; n<grid_buckets[index].number_fluid; n++) {
-                   q = grid_buckets[index].fluid_particles[n];
-                   // Append q to p's neighbor list
-                    r2 = (p->x-q->x)*(p->x-q->x) + (p->y-q->y)*(p->y-q->y);
-                    if(r2 > h2)
+                if(!cell_in_region(grid, i, j, region))
+                    continue;
+                index = j*grid->size_x + i;
+                for(c=0; c<grid->cell_counts[index]; c++) {
+                    p = grid->cell_particles[grid->cell_starts[index]+c];
+                    if(halo && p >= n_f)
                         continue;
-
-                   if(ne->number_fluid_neighbors < max_neighbors) {
-                       ne->fluid_neighbors[ne->number_fluid_neighbors++] = q;
-                       if(compute_density) {
-                           r = sqrt(r2);
-                           ratio = r*h_recip;
-                           calculate_density(p, q, ratio);
-		       }
-                   }
-                   else
-                      debug_print("self bucket overflow\n");
+                    compute_row_densities(particles, neighbors, p, params);
                 }
             }
+        }
+    }
+}
 
-            // Check neighbors of current bucket
-            // This only checks "forward" neighbors
-            for (dx=0; dx<=1; dx++) {
-                for (dy=(dx?-1:1); dy<=1; dy++) {
-		
-	  	    // If the neighbor is outside of the grid we don't process it
-		    if ( j+dy < 0 || i+dx < 0 || (i+dx) >= grid->size_x || (j+dy) >= grid->size_y)
-		        continue;
-
-		    neighbor_index = (j+dy)*grid->size_x + (i+dx);
-			
-                    // Add neighbor particles to particles in current bucket
-                    for (c=0; c<grid_buckets[index].number_fluid; c++) {
-		        // Particle in currently being worked on buccket
-                        q = grid_buckets[index].fluid_particles[c];
-                        ne = &neighbors[q->id];
-	                for(n=0; n<grid_buckets[neighbor_index].number_fluid; n++){
-                            // Append neighbor to q's neighbor list
-		            q_neighbor = grid_buckets[neighbor_index].fluid_particles[n];
-                             r2 = (q_neighbor->x-q->x)*(q_neighbor->x-q->x) + (q_neighbor->y-q->y)*(q_neighbor->y-q->y);
-                            if(r2 > h2)
-                                continue;
-                            if(ne->number_fluid_neighbors < max_neighbors) {
-		                ne->fluid_neighbors[ne->number_fluid_neighbors++] = q_neighbor;
-		                if(compute_density) {
-                                    r = sqrt(r2);
-                                    ratio = r*h_recip;
-			            calculate_density(q_neighbor, q, ratio);
-                                 }
-                             }
-                             else
-                                 debug_print("neighbor overflow\n");
-		        }
-                    }
-                      
-                } // end dy
-             }  // end dx
-	     
-            } // end grid y
-        } // end grid x
+// Fill the halo and mirror neighbor lists
+// Halo particles are binned into the same cell list as the fluid particles
+// We also calculate the density as it's convenient
+void hash_halo(fluid_particles_t *particles, neighbor_grid_t *grid, param *params, bool compute_density)
+{
+    int n_total = params->number_fluid_particles_local + params->number_halo_particles;
+
+    // Rebin fluid and halo particles together
+    bin_particles(particles, n_total, grid, params);
+
+    // Add fluid-halo pairs to the fluid particles halo rows
+    // Densities of the pairs computed by this rank are added before those of the mirror pairs
+    fill_neighbors(particles, grid, &grid->halo_neighbors, params, compute_density, PAIRS_HALO, CELLS_ALL);
+    fill_neighbors(particles, grid, &grid->mirror_neighbors, params, compute_density, PAIRS_MIRROR, CELLS_ALL);
+}
+
+// Clamp the cell range [*begin, *end) to size cells
+void clamp_interior_cells(int *begin, int *end, int size)
+{
+    if(*begin < 0)
+        *begin = 0;
+    if(*end > size)
+        *end = size;
+    if(*end < *begin)
+        *end = *begin;
+}
+
+// Cells further than an edge width plus the list cutoff from the node edges
+// Neighbors of an edge particle can not be in them, the interior is empty for narrow nodes
+// Rows only exclude a band toward neighbors above and below so a 1-D decomposition keeps every row
+void set_interior_cells(neighbor_grid_t *grid, param *params)
+{
+    float reach = 2.0f*(params->tunable_params.smoothing_radius + params->skin);
+
+    grid->interior_begin_x = (int)floor((params->tunable_params.node_start_x + reach)/grid->spacing) + 1 - grid->origin_x;
+    grid->interior_end_x = (int)floor((params->tunable_params.node_end_x - reach)/grid->spacing) - grid->origin_x;
+    clamp_interior_cells(&grid->interior_begin_x, &grid->interior_end_x, grid->size_x);
+
+    grid->interior_begin_y = 0;
+    grid->interior_end_y = grid->size_y;
+    if(params->neighbor_ranks[NEIGHBOR_DOWN] != MPI_PROC_NULL)
+        grid->interior_begin_y = (int)floor((params->tunable_params.node_start_y + reach)/grid->spacing) + 1 - grid->origin_y;
+    if(params->neighbor_ranks[NEIGHBOR_UP] != MPI_PROC_NULL)
+        grid->interior_end_y = (int)floor((params->tunable_params.node_end_y - reach)/grid->spacing) - grid->origin_y;
+    clamp_interior_cells(&grid->interior_begin_y, &grid->interior_end_y, grid->size_y);
+}
+
+int compare_indicies(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+// Gather the fluid particles that may be within reach of a node edge shared with a neighbor into grid->candidates
+// Only cells outside of the rectangle further than reach from every shared edge are walked, as binned particles
+// may have moved up to grid->max_displacement the band is widened by it
+// Every fluid particle is a candidate if the cell list does not describe them
+// Candidates are sorted so they are visited in storage order, returns the number of candidates
+int edge_candidates(neighbor_grid_t *grid, param *params, float reach)
+{
+    int i, j, begin_x, end_x, begin_y, end_y;
+    unsigned int n, cell, p;
+    int number_candidates = 0;
+    int n_f = params->number_fluid_particles_local;
+    // A small tolerance keeps particles binned exactly at the band edge from being missed due to rounding
+    float band = reach + grid->max_displacement + 0.001f*grid->spacing;
+
+    if(grid->force_rebuild) {
+        for(i=0; i<n_f; i++)
+            grid->candidates[number_candidates++] = i;
+        return number_candidates;
+    }
+
+    begin_x = 0;
+    end_x = grid->size_x;
+    begin_y = 0;
+    end_y = grid->size_y;
+    if(params->neighbor_ranks[NEIGHBOR_LEFT] != MPI_PROC_NULL)
+        begin_x = (int)floor((params->tunable_params.node_start_x + band)/grid->spacing) + 1 - grid->origin_x;
+    if(params->neighbor_ranks[NEIGHBOR_RIGHT] != MPI_PROC_NULL)
+        end_x = (int)floor((params->tunable_params.node_end_x - band)/grid->spacing) - grid->origin_x;
+    if(params->neighbor_ranks[NEIGHBOR_DOWN] != MPI_PROC_NULL)
+        begin_y = (int)floor((params->tunable_params.node_start_y + band)/grid->spacing) + 1 - grid->origin_y;
+    if(params->neighbor_ranks[NEIGHBOR_UP] != MPI_PROC_NULL)
+        end_y = (int)floor((params->tunable_params.node_end_y - band)/grid->spacing) - grid->origin_y;
+    clamp_interior_cells(&begin_x, &end_x, grid->size_x);
+    clamp_interior_cells(&begin_y, &end_y, grid->size_y);
+
+    for(j=0; j<grid->size_y; j++) {
+        for(i=0; i<grid->size_x; i++) {
+            // Skip over the rectangle
+            if(j >= begin_y && j < end_y && i >= begin_x && i < end_x) {
+                i = end_x - 1;
+                continue;
+            }
+            cell = j*grid->size_x + i;
+            for(n=0; n<grid->cell_counts[cell]; n++) {
+                p = grid->cell_particles[grid->cell_starts[cell] + n];
+                // Halo particles binned with the fluid particles are skipped
+                if(p < n_f)
+                    grid->candidates[number_candidates++] = p;
+            }
+        }
+    }
+
+    qsort(grid->candidates, number_candidates, sizeof(int), compare_indicies);
+
+    return number_candidates;
+}
+
+// True if cell (i, j) is in the region
+bool cell_in_region(neighbor_grid_t *grid, int i, int j, int region)
+{
+    bool interior = i >= grid->interior_begin_x && i < grid->interior_end_x
+                 && j >= grid->interior_begin_y && j < grid->interior_end_y;
+
+    return region == CELLS_ALL || interior == (region == CELLS_INTERIOR);
+}
+
+// Fill the fluid neighbor list with each fluid particles neighbors
+// Only the forward half of the neighbors are added as the forces are symmetrized.
+// We also calculate the density as it's convenient
+// The particles are binned by the CELLS_ALL or CELLS_BOUNDARY pass, CELLS_INTERIOR completes the list
+void hash_fluid(fluid_particles_t *particles, neighbor_grid_t *grid, param *params, bool compute_density, int region)
+{
+    int n_f = params->number_fluid_particles_local;
+
+    if(region == CELLS_INTERIOR) {
+        fill_neighbors(particles, grid, &grid->fluid_neighbors, params, compute_density, PAIRS_FLUID, region);
+        return;
+    }
+
+    // Sort fluid particles into the cell list, the grid is moved with the partition first
+    place_grid(grid, params);
+    bin_particles(particles, n_f, grid, params);
+
+    // The halo lists refer to the previous halo and are empty until hash_halo() is called
+    memset(grid->halo_neighbors.counts, 0, n_f*sizeof(unsigned int));
+    grid->halo_neighbors.number_pairs = 0;
+    grid->halo_neighbors.geometry_current = grid->halo_neighbors.cache_geometry;
+    memset(grid->mirror_neighbors.counts, 0, n_f*sizeof(unsigned int));
+    grid->mirror_neighbors.number_pairs = 0;
+    grid->mirror_neighbors.geometry_current = grid->mirror_neighbors.cache_geometry;
+    set_interior_cells(grid, params);
+    grid->max_displacement = 0.0f;
+
+    // Fill particle neighbors by processing the cell list
+    fill_neighbors(particles, grid, &grid->fluid_neighbors, params, compute_density, PAIRS_FLUID, region);
+
+    // Record the state the lists were built from
+    memcpy(grid->build_x, particles->x, n_f*sizeof(float));
+    memcpy(grid->build_y, particles->y, n_f*sizeof(float));
+    grid->build_start_x = params->tunable_params.node_start_x;
+    grid->build_end_x = params->tunable_params.node_end_x;
+    grid->build_start_y = params->tunable_params.node_start_y;
+    grid->build_end_y = params->tunable_params.node_end_y;
+    grid->force_rebuild = false;
 
 }// end function
+
+// Number of cells of the given colour
+// Colour c covers the cells with x%3 == c%3 and y%3 == c/3
+int number_colour_cells(neighbor_grid_t *grid, int colour)
+{
+    int colour_size_x = ((int)grid->size_x - colour%3 + 2)/3;
+    int colour_size_y = ((int)grid->size_y - colour/3 + 2)/3;
+
+    return colour_size_x*colour_size_y;
+}
+
+// Cell index of the nth cell of the given colour, cells are numbered in row order
+unsigned int colour_cell(neighbor_grid_t *grid, int colour, int n)
+{
+    int colour_size_x = ((int)grid->size_x - colour%3 + 2)/3;
+    unsigned int x = colour%3 + 3*(n%colour_size_x);
+    unsigned int y = colour/3 + 3*(n/colour_size_x);
+
+    return y*grid->size_x + x;
+}
+
+// Returns true if this ranks neighbor lists must be rebuilt before they are used
+// Lists are valid until a particle has moved more than skin/2 from where the lists were built
+// or the node bounds have changed, as edge and out of bounds particles are only updated on a rebuild
+// All compute ranks must agree on the rebuild as halo particle indicies depend on the neighbors edge particles,
+// the returned vote is combined by the caller
+bool neighbors_need_rebuild(fluid_particles_t *particles, neighbor_grid_t *grid, param *params)
+{
+    int i;
+    bool rebuild;
+    float d_x, d_y, d2;
+    float max_d = 0.5f*params->skin;
+    float moved2 = 0.0f;
+    float *x = particles->x;
+    float *y = particles->y;
+
+    // The largest displacement also bounds how far particles are from the cells they were binned in
+    // Build positions are not set before the first build or after a sort
+    for(i=0; i<params->number_fluid_particles_local && !grid->force_rebuild; i++) {
+        d_x = x[i] - grid->build_x[i];
+        d_y = y[i] - grid->build_y[i];
+        d2 = d_x*d_x + d_y*d_y;
+        if(d2 > moved2)
+            moved2 = d2;
+    }
+    grid->max_displacement = sqrtf(moved2);
+
+    // Without a skin the lists are only valid for the positions they were built from
+    rebuild = params->skin == 0.0f
+           || grid->force_rebuild
+           || grid->build_start_x != params->tunable_params.node_start_x
+           || grid->build_end_x != params->tunable_params.node_end_x
+           || grid->build_start_y != params->tunable_params.node_start_y
+           || grid->build_end_y != params->tunable_params.node_end_y
+           || moved2 > max_d*max_d;
+
+    return rebuild;
+}
+
+// Reorder the fluid particle storage so particles sharing a cell are adjacent in memory
+// Particles are gathered in cell list order into sorted_particles whose arrays are then swapped with particles
+// Halo and edge particles referenced the old ordering and are reset
+void sort_fluid_particles(fluid_particles_t *particles, fluid_particles_t *sorted_particles, neighbor_grid_t *grid, edge_t *edges, param *params)
+{
+    int i, d;
+    int n_f = params->number_fluid_particles_local;
+    unsigned int *cell_particles;
+    fluid_particles_t unsorted_particles;
+
+    // The scratch arrays are swapped in so must be as long as the particle arrays
+    reserve_fluid_particles(sorted_particles, particles->max_particles);
+
+    // Order fluid particles by cell
+    place_grid(grid, params);
+    bin_particles(particles, n_f, grid, params);
+    cell_particles = grid->cell_particles;
+
+    // Gather particles in cell order
+    for (i=0; i<n_f; i++)
+        copy_particle(particles, cell_particles[i], sorted_particles, i);
+
+    // Swap sorted arrays in, the unsorted arrays become the scratch arrays
+    unsorted_particles = *particles;
+    *particles = *sorted_particles;
+    *sorted_particles = unsorted_particles;
+
+    // Halo particles, edge particles and neighbor lists referenced the old storage
+    params->number_halo_particles = 0;
+    params->number_computed_halo_particles = 0;
+    for(d=0; d<NUMBER_NEIGHBORS; d++)
+        edges->number_edge_particles[d] = 0;
+    grid->force_rebuild = true;
+}
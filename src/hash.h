@@ -27,29 +27,130 @@ THE SOFTWARE.
 
 #include <stdbool.h>
 
-typedef struct BUCKET_T bucket_t;
 typedef struct NEIGHBOR_GRID_T neighbor_grid_t;
+typedef struct NEIGHBOR_LIST neighbor_list_t;
+typedef struct BUILD_TASK_T build_task_t;
 
 #include "fluid.h"
+#include "communication.h"
+#include "simd.h"
 
-struct BUCKET_T {
-    fluid_particle **fluid_particles;
-    unsigned int number_fluid;
-}; // neighbor 'bucket' for hash value
+// Cells are coloured in a 3x3 pattern for the symmetric pair sweeps
+// A cells pairs reach at most one cell in each direction, so cells of the same colour never share a particle
+#define NUMBER_COLOURS 9
 
+// Cell regions walked when filling neighbor lists
+// Boundary cells hold every edge particle and every neighbor of an edge particle so their pass completes the edge densities,
+// interior cells are the rest and can be filled while the halo is exchanged
+#define CELLS_ALL 0
+#define CELLS_BOUNDARY 1
+#define CELLS_INTERIOR 2
+
+// Pairs added to a neighbor list
+// A pair across a node boundary is computed by the rank the other rank is in an odd direction from, see halo_computed()
+#define PAIRS_FLUID 0  // Forward fluid-fluid pairs
+#define PAIRS_HALO 1   // Fluid-halo pairs computed by this rank
+#define PAIRS_MIRROR 2 // Fluid-halo pairs computed by the halo particles owner, only used for densities
+
+// Neighbor lists stored as compressed rows
+// Particle i's neighbors are neighbor_indicies[starts[i]] through neighbor_indicies[starts[i] + counts[i] - 1]
+// Rows are written in the order the grid is walked so starts is not ordered by particle
+struct NEIGHBOR_LIST {
+    unsigned int *starts;            // Offset of each particles row in neighbor_indicies
+    unsigned int *counts;            // Number of neighbors in each particles row
+    unsigned int *neighbor_indicies; // Particle array indicies of neighbors
+    unsigned int number_pairs;       // Number of neighbor_indicies in use
+    unsigned int max_pairs;          // Allocated length of neighbor_indicies, grown as required
+    // Optional pair geometry cache, parallel to neighbor_indicies
+    bool cache_geometry;             // Geometry is stored with each pair
+    bool geometry_current;           // Positions have not changed since the geometry was stored
+    float *pair_r;                   // Distance from p to q
+    float *pair_u_x;                 // Unit vector from p to q
+    float *pair_u_y;
+    float *pair_OmR;                 // 1 - r/h
+};
+
+// Particles are binned into a counting sorted cell list
+// A cells particles are cell_particles[cell_starts[cell]] through cell_particles[cell_starts[cell] + cell_counts[cell] - 1]
 struct NEIGHBOR_GRID_T {
-    float spacing;  // Spacing between buckets
-    unsigned int size_x; // Number of buckets in x
-    unsigned int size_y; // Number of buckets in y
-    neighbor *neighbors; // Particle neighbor buckets
-    bucket_t *grid_buckets; // Grid to place hashed particles into
-    unsigned int max_neighbors; // Maximum neighbors allowed for each particle
-    unsigned int max_bucket_size; // Maximum particles in hash bucket
+    float spacing;  // Spacing between cells
+    unsigned int size_x; // Number of cells in x
+    unsigned int size_y; // Number of cells in y
+    int origin_x; // Cell of the domain that is the grids first column and row, the grid covers the partition and a margin
+    int origin_y;
+    unsigned int domain_size_x; // Number of cells covering the whole domain
+    unsigned int domain_size_y;
+    unsigned int max_cells; // Allocated length of the cell arrays, grown as the partition widens
+    neighbor_list_t fluid_neighbors; // Forward fluid-fluid pairs
+    neighbor_list_t halo_neighbors;  // Fluid-halo pairs computed by this rank, stored with the fluid particle
+    neighbor_list_t mirror_neighbors; // Fluid-halo pairs computed by the neighbor, stored with the fluid particle
+    unsigned int *cell_starts; // Offset into cell_particles of each cells first particle, size_x*size_y+1 entries in use
+    unsigned int *cell_counts; // Number of particles in each cell
+    unsigned int *cell_particles; // Particle indicies sorted by cell
+    unsigned int *particle_cells; // Cell of each particle
+    int max_particles; // Allocated length of the per particle arrays and neighbor list rows, grown with the particle arrays
+    float *build_x; // Fluid particle positions when the neighbor lists were last built
+    float *build_y;
+    float build_start_x; // Node bounds when the neighbor lists were last built
+    float build_end_x;
+    float build_start_y;
+    float build_end_y;
+    bool force_rebuild; // Set if the neighbor lists must be rebuilt regardless of displacement
+    float max_displacement; // Furthest a fluid particle has moved from the position it was binned at, set by neighbors_need_rebuild()
+    int *candidates; // Fluid particles gathered by edge_candidates()
+    int interior_begin_x; // Columns [interior_begin_x, interior_end_x) and rows [interior_begin_y, interior_end_y) are interior cells
+    int interior_end_x;   // set when the fluid particles are binned
+    int interior_begin_y;
+    int interior_end_y;
+    // Threaded build, each block is a range of particles when binning and a range of grid rows when filling lists
+    int number_blocks;                // 0 builds the lists serially
+    unsigned int *block_cell_counts;  // Per block cell histograms, number_blocks*max_cells entries
+    unsigned int *block_rows;         // First grid row of each block, number_blocks+1 entries
+    neighbor_list_t *block_neighbors; // Pairs found by each block before they are joined into one list
+};
+
+// Arguments shared by the tasks of a threaded build
+struct BUILD_TASK_T {
+    fluid_particles_t *particles;
+    neighbor_grid_t *grid;
+    neighbor_list_t *neighbors;
+    param *params;
+    int number_particles;
+    int halo; // Pairs added, PAIRS_FLUID, PAIRS_HALO or PAIRS_MIRROR
+    int region;
 };
 
-unsigned int hash_val(float x, float y, neighbor_grid_t *grid, param *params);
-void hash_fluid(fluid_particle **fluid_particle_pointers, neighbor_grid_t *grid, param *params, bool compute_density);
-void hash_halo(fluid_particle **fluid_particle_pointers,  neighbor_grid_t *grid, param *params, bool compute_density);
+unsigned int hash_val(float x, float y, neighbor_grid_t *grid);
+void bin_particles(fluid_particles_t *particles, int number_particles, neighbor_grid_t *grid, param *params);
+void count_block_cells(void *args, int block);
+void scatter_block_cells(void *args, int block);
+size_t alloc_build_blocks(neighbor_grid_t *grid, int number_blocks, bool cache_geometry);
+void free_build_blocks(neighbor_grid_t *grid);
+size_t alloc_neighbor_list(neighbor_list_t *neighbors, int max_particles, bool cache_geometry);
+void free_neighbor_list(neighbor_list_t *neighbors);
+bool reserve_neighbors(neighbor_list_t *neighbors, unsigned int number_pairs);
+bool reserve_neighbor_rows(neighbor_list_t *neighbors, int old_max_particles, int max_particles);
+bool reserve_grid_particles(neighbor_grid_t *grid, int max_particles);
+bool reserve_grid_cells(neighbor_grid_t *grid, unsigned int number_cells);
+bool place_grid(neighbor_grid_t *grid, param *params);
+void store_pair_geometry(neighbor_list_t *neighbors, unsigned int pair, simd_batch_t *batch, int lane);
+void load_pair_geometry(neighbor_list_t *neighbors, unsigned int pair, simd_batch_t *batch, int lane);
+void add_neighbors(fluid_particles_t *particles, int p, unsigned int *candidates, int number_candidates, neighbor_list_t *neighbors, param *params, bool compute_density, int halo);
+void fill_neighbor_rows(fluid_particles_t *particles, neighbor_grid_t *grid, neighbor_list_t *neighbors, param *params, bool compute_density, int halo, int region, int row_begin, int row_end);
+void fill_block_neighbors(void *args, int block);
+void join_block_neighbors(void *args, int block);
+void fill_neighbors(fluid_particles_t *particles, neighbor_grid_t *grid, neighbor_list_t *neighbors, param *params, bool compute_density, int halo, int region);
+void set_interior_cells(neighbor_grid_t *grid, param *params);
+void clamp_interior_cells(int *begin, int *end, int size);
+int compare_indicies(const void *a, const void *b);
+int edge_candidates(neighbor_grid_t *grid, param *params, float reach);
+bool cell_in_region(neighbor_grid_t *grid, int i, int j, int region);
+void hash_fluid(fluid_particles_t *particles, neighbor_grid_t *grid, param *params, bool compute_density, int region);
+void hash_halo(fluid_particles_t *particles, neighbor_grid_t *grid, param *params, bool compute_density);
+int number_colour_cells(neighbor_grid_t *grid, int colour);
+unsigned int colour_cell(neighbor_grid_t *grid, int colour, int n);
+bool neighbors_need_rebuild(fluid_particles_t *particles, neighbor_grid_t *grid, param *params);
+void sort_fluid_particles(fluid_particles_t *particles, fluid_particles_t *sorted_particles, neighbor_grid_t *grid, edge_t *edges, param *params);
 
 #endif
 
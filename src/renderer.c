@@ -99,7 +99,7 @@ int start_renderer()
     #endif
 
     // Number of processes
-    int num_procs, num_compute_procs, num_compute_procs_active;
+    int num_procs, num_compute_procs, num_compute_procs_active, num_compute_procs_awake;
     MPI_Comm_size(MPI_COMM_WORLD, &num_procs);
     num_compute_procs = num_procs - 1;
     num_compute_procs_active = num_compute_procs;
@@ -117,6 +117,8 @@ int start_renderer()
     render_state.master_params = master_params;
     render_state.num_compute_procs = num_compute_procs;
     render_state.num_compute_procs_active = num_compute_procs;
+    render_state.num_compute_procs_awake = num_compute_procs;
+    render_state.joining = calloc(num_compute_procs, sizeof(bool));
     render_state.selected_parameter = 0;
     render_state.return_value = 0;
 
@@ -136,6 +138,13 @@ int start_renderer()
     // Receive number of global particles
     int max_particles;
     MPI_Recv(&max_particles, 1, MPI_INT, 1, 9, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // Receive the shape of the compute rank grid
+    int partitions[3];
+    MPI_Recv(partitions, 3, MPI_INT, 1, 10, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    render_state.partitions_x = partitions[0];
+    render_state.partitions_y = partitions[1];
+    render_state.compute_balanced = partitions[2];
+    render_state.balance_reports = malloc(num_compute_procs*BALANCE_REPORT_FIELDS*sizeof(float));
 
     // Calculate world unit to pixel
     float world_to_pix_scale = gl_state.screen_width/render_state.sim_width;
@@ -214,6 +223,7 @@ int start_renderer()
     // Setup MPI requests used to gather particle coordinates
     MPI_Request coord_reqs[num_compute_procs];
     int src, coords_recvd;
+    bool handover;
     float gl_x, gl_y;
     // Particle radius in pixels
     #ifdef RASPI
@@ -245,7 +255,8 @@ int start_renderer()
             for(i=0; i<render_state.num_compute_procs; i++)
                 render_state.node_params[i].kill_sim = true;
             // Send kill paramaters to compute nodes
-            MPI_Scatterv(node_params, param_counts, param_displs, TunableParamtype, MPI_IN_PLACE, 0, TunableParamtype, 0, MPI_COMM_WORLD);
+            send_parked_params(&render_state, render_state.num_compute_procs_awake);
+            MPI_Scatterv(node_params, param_counts, param_displs, TunableParamtype, MPI_IN_PLACE, 0, TunableParamtype, 0, MPI_COMM_AWAKE);
             break;
         }    
 
@@ -261,17 +272,32 @@ int start_renderer()
         if(!input_is_active(&render_state))
             update_inactive_state(&render_state);
 
+        // Hand the partitions of added and removed nodes over gradually, then park or wake nodes
+        handover = update_partition_handover(&render_state);
+        num_compute_procs_awake = awake_compute_procs(&render_state, particle_coordinate_counts);
+        for(i=0; i<render_state.num_compute_procs; i++)
+            master_params[i].awake_ranks = num_compute_procs_awake;
+
         // Update node params with master param values
         update_node_params(&render_state);
 
+        // Parked nodes are only sent paramaters when the awake nodes change
+        if(num_compute_procs_awake != render_state.num_compute_procs_awake)
+            send_parked_params(&render_state, render_state.num_compute_procs_awake);
+
         // Send updated paramaters to compute nodes
-        MPI_Scatterv(node_params, param_counts, param_displs, TunableParamtype, MPI_IN_PLACE, 0, TunableParamtype, 0, MPI_COMM_WORLD);
+        MPI_Scatterv(node_params, param_counts, param_displs, TunableParamtype, MPI_IN_PLACE, 0, TunableParamtype, 0, MPI_COMM_AWAKE);
+
+        if(num_compute_procs_awake != render_state.num_compute_procs_awake) {
+            split_awake_ranks(num_compute_procs_awake);
+            render_state.num_compute_procs_awake = num_compute_procs_awake;
+        }
 
             // Retrieve all particle coordinates (x,y)
   	    // Potentially probe is expensive? Could just allocated num_compute_procs*num_particles_global and async recv
 	    // OR do synchronous recv...very likely that synchronous receive is as fast as anything else
 	    coords_recvd = 0;
-	    for(i=0; i<render_state.num_compute_procs; i++) {
+	    for(i=0; i<render_state.num_compute_procs_awake; i++) {
 	        // Wait until message is ready from any proc
                 MPI_Probe(MPI_ANY_SOURCE, 17, MPI_COMM_WORLD, &status);
 	        // Retrieve probed values
@@ -284,10 +310,22 @@ int start_renderer()
                 coords_recvd += particle_coordinate_counts[src-1];
 	    }
 
+            // Retrieve the balance report sent with the coordinates
+            for(i=0; i<render_state.num_compute_procs_awake; i++)
+                MPI_Recv(&render_state.balance_reports[i*BALANCE_REPORT_FIELDS], BALANCE_REPORT_FIELDS, MPI_FLOAT, i+1, 18, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+        // Partitions balanced by the compute ranks are only mirrored for the dividers
+        if(render_state.compute_balanced)
+            adopt_reported_bounds(&render_state);
+
         // Ensure a balanced partition
         // We pass in number of coordinates instead of particle counts    
-        if(num_steps%frames_per_check == 0)
-            check_partition_left(&render_state, particle_coordinate_counts, coords_recvd);
+        if(!render_state.compute_balanced && !handover && num_steps%frames_per_check == 0) {
+            if(render_state.partitions_y > 1)
+                check_partition_grid(&render_state, particle_coordinate_counts, coords_recvd);
+            else
+                check_partition_cost(&render_state);
+        }
 
         // Clear background
         glClearColor(0.15, 0.15, 0.15, 1.0);
@@ -326,7 +364,7 @@ int start_renderer()
         }
 
         // Wait for all coordinates to be received
-        MPI_Waitall(num_compute_procs, coord_reqs, MPI_STATUSES_IGNORE);
+        MPI_Waitall(render_state.num_compute_procs_awake, coord_reqs, MPI_STATUSES_IGNORE);
 
         // Render liquid or particles
         if(render_state.liquid) {
@@ -381,6 +419,8 @@ int start_renderer()
     exit_exit_menu(&exit_menu_state);
     free(node_params);
     free(master_params);
+    free(render_state.balance_reports);
+    free(render_state.joining);
     free(param_counts);
     free(param_displs);
     free(particle_coords);
@@ -421,61 +461,237 @@ void update_node_params(render_t *render_state)
         render_state->node_params[i] = render_state->master_params[i]; 
 }
 
-// Checks for a balanced number of particles on each compute node
-// If unbalanced the partition between nodes will change 
-// Check from right to left
-void check_partition_left(render_t *render_state, int *particle_counts, int total_particles)
+// Copy the node bounds reported by each compute rank into the master parameters
+void adopt_reported_bounds(render_t *render_state)
 {
-    int rank, diff;
-    float h, dx, length, length_left, length_right;   
+    int rank;
+    float *report;
+
+    for(rank=0; rank<render_state->num_compute_procs; rank++) {
+        report = &render_state->balance_reports[rank*BALANCE_REPORT_FIELDS + BALANCE_REPORT_BOUNDS];
+        render_state->master_params[rank].node_start_x = report[0];
+        render_state->master_params[rank].node_end_x = report[1];
+        render_state->master_params[rank].node_start_y = report[2];
+        render_state->master_params[rank].node_end_y = report[3];
+    }
+}
 
-    // Particles per proc if evenly divided
-    int even_particles = total_particles/render_state->num_compute_procs_active;
-    int max_diff = even_particles/15.0f;
+// Balances the measured cost of the active compute nodes by moving the partitions directly to the cost optimal cuts
+// Each node's particles are weighted by its measured time per particle, the cuts split the prefix sum of the weighted
+// histogram evenly and are interpolated within a bin
+// Partitions are only moved once the slowest node is BALANCE_TOLERANCE slower than the mean, and only by more than h/8
+// A cut stays within the current partitions either side of it so particles move at most one node
+void check_partition_cost(render_t *render_state)
+{
+    int rank, bin;
+    float h, time, total_time, max_time, rank_particles, cost_per_particle;
+    float total_cost, prefix_cost, target_cost, cut, lower, upper, old_start;
+    float bin_cost[BALANCE_BINS];
+    int active = render_state->num_compute_procs_active;
+    float bin_width = render_state->sim_width/BALANCE_BINS;
+    float *report;
+    tunable_parameters *master_params = render_state->master_params;
 
-    // Fixed distance to move partition is 0.125*smoothing radius
-    h = render_state->master_params[0].smoothing_radius;
-    dx = h*0.125;
+    if(active < 2)
+        return;
 
+    h = master_params[0].smoothing_radius;
+
+    total_time = 0.0f;
+    max_time = 0.0f;
+    for(rank=0; rank<active; rank++) {
+        time = render_state->balance_reports[rank*BALANCE_REPORT_FIELDS];
+        total_time += time;
+        if(time > max_time)
+            max_time = time;
+    }
+    if(max_time <= (1.0f + BALANCE_TOLERANCE)*total_time/active)
+        return;
+
+    // Cost of each bin
+    for(bin=0; bin<BALANCE_BINS; bin++)
+        bin_cost[bin] = 0.0f;
+    for(rank=0; rank<active; rank++) {
+        report = &render_state->balance_reports[rank*BALANCE_REPORT_FIELDS];
+        rank_particles = 0.0f;
+        for(bin=0; bin<BALANCE_BINS; bin++)
+            rank_particles += report[1+bin];
+        if(rank_particles == 0.0f)
+            continue;
+        cost_per_particle = report[0]/rank_particles;
+        for(bin=0; bin<BALANCE_BINS; bin++)
+            bin_cost[bin] += report[1+bin]*cost_per_particle;
+    }
+    total_cost = 0.0f;
+    for(bin=0; bin<BALANCE_BINS; bin++)
+        total_cost += bin_cost[bin];
+    if(total_cost == 0.0f)
+        return;
+
+    // Move the left boundary of each rank from left to right
+    bin = 0;
+    prefix_cost = 0.0f;
+    old_start = master_params[0].node_start_x;
+    for(rank=1; rank<active; rank++)
+    {
+        target_cost = rank*total_cost/active;
+        while(bin < BALANCE_BINS-1 && prefix_cost + bin_cost[bin] < target_cost)
+            prefix_cost += bin_cost[bin++];
+        cut = bin*bin_width;
+        if(bin_cost[bin] > 0.0f)
+            cut += fminf((target_cost - prefix_cost)/bin_cost[bin], 1.0f)*bin_width;
+
+        // Keep partitions at least 2h wide
+        lower = fmaxf(old_start, master_params[rank-1].node_start_x) + 2*h;
+        upper = master_params[rank].node_end_x - 2*h;
+        old_start = master_params[rank].node_start_x;
+        if(upper < lower)
+            continue;
+        cut = fminf(fmaxf(cut, lower), upper);
+
+        if(fabsf(cut - master_params[rank].node_start_x) > 0.125f*h) {
+            master_params[rank].node_start_x = cut;
+            master_params[rank-1].node_end_x = cut;
+        }
+    }
+}
+
+// Checks for a balanced number of particles in each column and row of a 2-D compute grid
+// Compute rank column*partitions_y + row covers that column and row, all ranks in a column share x bounds
+// and all ranks in a row share y bounds so column and row boundaries are moved as a whole
+void check_partition_grid(render_t *render_state, int *particle_counts, int total_particles)
+{
+    int rank, column, row, diff;
+    int partitions_x = render_state->partitions_x;
+    int partitions_y = render_state->partitions_y;
+    float h, dx, length, length_before;
     tunable_parameters *master_params = render_state->master_params;
 
-    for(rank=render_state->num_compute_procs_active; rank-- > 1; )
+    // Particles per column and per row if evenly divided
+    int even_column = total_particles/partitions_x;
+    int even_row = total_particles/partitions_y;
+
+    // Fixed distance to move partition is 0.125*smoothing radius
+    h = master_params[0].smoothing_radius;
+    dx = h*0.125;
+
+    // Move the left boundary of each column
+    for(column=partitions_x; column-- > 1; )
     {
-        length =  master_params[rank].node_end_x - master_params[rank].node_start_x;
-        length_left =  master_params[rank-1].node_end_x - master_params[rank-1].node_start_x;
-        diff = particle_counts[rank] - even_particles;
-
-        // current rank has too many particles
-        if( diff > max_diff && length > 2*h) {
-            master_params[rank].node_start_x += dx;
-            master_params[rank-1].node_end_x = master_params[rank].node_start_x;
+        int column_count = 0;
+        for(row=0; row<partitions_y; row++)
+            column_count += particle_counts[column*partitions_y + row];
+        diff = column_count - even_column;
+
+        rank = column*partitions_y;
+        length = master_params[rank].node_end_x - master_params[rank].node_start_x;
+        length_before = master_params[rank-partitions_y].node_end_x - master_params[rank-partitions_y].node_start_x;
+
+        if(diff > even_column/15 && length > 2*h) {
+            for(row=0; row<partitions_y; row++) {
+                master_params[rank+row].node_start_x += dx;
+                master_params[rank-partitions_y+row].node_end_x = master_params[rank+row].node_start_x;
+            }
         }
-        // current rank has too few particles
-        else if (diff < -max_diff && length_left > 2*h) {
-            master_params[rank].node_start_x -= dx;
-            master_params[rank-1].node_end_x = master_params[rank].node_start_x;
+        else if(diff < -even_column/15 && length_before > 2*h) {
+            for(row=0; row<partitions_y; row++) {
+                master_params[rank+row].node_start_x -= dx;
+                master_params[rank-partitions_y+row].node_end_x = master_params[rank+row].node_start_x;
+            }
         }
     }
 
-    // Left most partition has a tendency to not balance correctly so we test it explicitly
-    if(render_state->num_compute_procs_active > 1)
+    // Move the lower boundary of each row
+    for(row=partitions_y; row-- > 1; )
     {
-        length =  master_params[0].node_end_x - master_params[0].node_start_x;
-        length_right =  master_params[1].node_end_x - master_params[1].node_start_x;
-        diff = particle_counts[0] - even_particles;
-
-        // current rank has too many particles
-        if( diff > max_diff && length > 2*h) {
-            master_params[0].node_end_x -= dx;
-            master_params[1].node_start_x = master_params[0].node_end_x;
+        int row_count = 0;
+        for(column=0; column<partitions_x; column++)
+            row_count += particle_counts[column*partitions_y + row];
+        diff = row_count - even_row;
+
+        length = master_params[row].node_end_y - master_params[row].node_start_y;
+        length_before = master_params[row-1].node_end_y - master_params[row-1].node_start_y;
+
+        if(diff > even_row/15 && length > 2*h) {
+            for(column=0; column<partitions_x; column++) {
+                rank = column*partitions_y + row;
+                master_params[rank].node_start_y += dx;
+                master_params[rank-1].node_end_y = master_params[rank].node_start_y;
+            }
         }
-        else if (diff < -max_diff && length_right > 2*h) {
-            master_params[0].node_end_x += dx;
-            master_params[1].node_start_x = master_params[0].node_end_x;
+        else if(diff < -even_row/15 && length_before > 2*h) {
+            for(column=0; column<partitions_x; column++) {
+                rank = column*partitions_y + row;
+                master_params[rank].node_start_y -= dx;
+                master_params[rank-1].node_end_y = master_params[rank].node_start_y;
+            }
         }
     }
 }
 
+// Move the partitions of added and removed nodes by at most HANDOVER_STEP*h a frame so particles migrate gradually
+// Removed nodes shrink toward the end of the tank, added nodes grow from it until as wide as the partition before them
+// Returns true while any partition is being handed over
+bool update_partition_handover(render_t *render_state)
+{
+    int rank;
+    float gap, step;
+    bool handover = false;
+    tunable_parameters *master_params = render_state->master_params;
+
+    step = HANDOVER_STEP*master_params[0].smoothing_radius;
+
+    // Removed nodes still awake, from the right so each shrinks toward its updated end
+    for(rank=render_state->num_compute_procs_awake-1; rank>=render_state->num_compute_procs_active; rank--) {
+        master_params[rank].node_start_x = fminf(master_params[rank].node_start_x + step, master_params[rank].node_end_x);
+        master_params[rank-1].node_end_x = master_params[rank].node_start_x;
+        handover = true;
+    }
+
+    // Added nodes, from the left so each grows against its updated neighbor
+    for(rank=1; rank<render_state->num_compute_procs_active; rank++) {
+        if(!render_state->joining[rank])
+            continue;
+        gap = 0.5f*((master_params[rank-1].node_end_x - master_params[rank-1].node_start_x)
+                  - (master_params[rank].node_end_x - master_params[rank].node_start_x));
+        if(gap <= step)
+            render_state->joining[rank] = false;
+        master_params[rank].node_start_x -= fmaxf(fminf(gap, step), 0.0f);
+        master_params[rank-1].node_end_x = master_params[rank].node_start_x;
+        handover = true;
+    }
+
+    return handover;
+}
+
+// Number of nodes that should be awake this frame
+// A removed node is parked once it has been sent an empty partition and has reported no particles
+// Parked nodes are woken as soon as they are added
+int awake_compute_procs(render_t *render_state, int *particle_counts)
+{
+    int awake = render_state->num_compute_procs_awake;
+    tunable_parameters *node_params = render_state->node_params;
+
+    while(awake > render_state->num_compute_procs_active
+          && node_params[awake-1].node_start_x == node_params[awake-1].node_end_x
+          && particle_counts[awake-1] == 0)
+        awake--;
+
+    if(awake < render_state->num_compute_procs_active)
+        awake = render_state->num_compute_procs_active;
+
+    return awake;
+}
+
+// Send each node parked from num_parked_from on its paramaters, parked nodes do not take part in the Scatterv
+void send_parked_params(render_t *render_state, int num_parked_from)
+{
+    int i;
+
+    for(i=num_parked_from; i<render_state->num_compute_procs; i++)
+        MPI_Send(&render_state->node_params[i], 1, TunableParamtype, i+1, PARK_TAG, MPI_COMM_WORLD);
+}
+
 // Set time of last user input
 void set_activity_time(render_t *render_state)
 {
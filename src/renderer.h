@@ -30,6 +30,12 @@ THE SOFTWARE.
 
 struct exit_menu_t; //blarg...
 
+// The slowest compute node may be this fraction slower than the mean before the partitions are moved
+#define BALANCE_TOLERANCE 0.1f
+
+// Partitions of added and removed compute nodes grow or shrink by at most this many smoothing radii a frame
+#define HANDOVER_STEP 1.0f
+
 // enum of displayed parameter values
 typedef enum {
     MIN = 0,
@@ -51,6 +57,12 @@ typedef struct render_t {
     tunable_parameters *master_params; // Holds parameters shared by all nodes
     int num_compute_procs;
     int num_compute_procs_active; // Number of nodes participating in simulation, user may "remove" nodes at runtime
+    int num_compute_procs_awake; // Nodes taking part in each frame, removed nodes are parked once their particles are handed over
+    bool *joining; // Added nodes still growing their partition
+    int partitions_x; // Shape of the compute rank grid, partitions_y is 1 unless the domain is split in 2-D
+    int partitions_y;
+    float *balance_reports; // Latest report of each compute rank, BALANCE_REPORT_FIELDS floats each
+    bool compute_balanced; // Compute ranks move the partitions themselves, the render node leaves them alone
     bool show_dividers;
     bool pause;
     bool quit_mode;
@@ -66,7 +78,12 @@ void sim_to_opengl(render_t *render_state, float x, float y, float *gl_x, float
 void update_node_params(render_t *render_state);
 void checkPartitions(render_t *render_state, int *particle_counts, int total_particles);
 void hsv_to_rgb(float* hsv, float *rgb);
-void check_partition_left(render_t *render_state, int *particle_counts, int total_particles);
+void check_partition_cost(render_t *render_state);
+void adopt_reported_bounds(render_t *render_state);
+void check_partition_grid(render_t *render_state, int *particle_counts, int total_particles);
+bool update_partition_handover(render_t *render_state);
+int awake_compute_procs(render_t *render_state, int *particle_counts);
+void send_parked_params(render_t *render_state, int num_parked_from);
 void set_activity_time(render_t *render_state);
 bool input_is_active(render_t *render_state);
 void update_inactive_state(render_t *render_state);
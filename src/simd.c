@@ -0,0 +1,746 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Adam Simpson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <math.h>
+
+#include "simd.h"
+#include "fluid.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if defined(__arm__) && !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+// The kernels must perform exactly the operations written for results to be independent of the ISA
+// -ffast-math would otherwise allow the scalar kernels to be reassociated or vectorized with approximate sqrt
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize ("no-unsafe-math-optimizations")
+#endif
+
+simd_kernels_t simd_kernels;
+
+// Select the widest pair kernels the CPU supports
+// The selection is made at runtime so a single binary runs on every node
+void init_simd_kernels()
+{
+    simd_kernels.isa = "scalar";
+    simd_kernels.density_terms = density_terms_scalar;
+    simd_kernels.geometry_terms = geometry_terms_scalar;
+    simd_kernels.viscosity_terms = viscosity_terms_scalar;
+    simd_kernels.relaxation_terms = relaxation_terms_scalar;
+    // The cached kernels are simple enough to be left to the compiler
+    simd_kernels.viscosity_terms_cached = viscosity_terms_cached_scalar;
+    simd_kernels.relaxation_terms_cached = relaxation_terms_cached_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+        simd_kernels.isa = "sse";
+        simd_kernels.density_terms = density_terms_sse;
+        simd_kernels.geometry_terms = geometry_terms_sse;
+        simd_kernels.viscosity_terms = viscosity_terms_sse;
+        simd_kernels.relaxation_terms = relaxation_terms_sse;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        simd_kernels.isa = "avx2";
+        simd_kernels.density_terms = density_terms_avx2;
+        simd_kernels.geometry_terms = geometry_terms_avx2;
+        simd_kernels.viscosity_terms = viscosity_terms_avx2;
+        simd_kernels.relaxation_terms = relaxation_terms_avx2;
+    }
+#elif defined(__aarch64__)
+    simd_kernels.isa = "neon";
+    simd_kernels.density_terms = density_terms_neon;
+    simd_kernels.geometry_terms = geometry_terms_neon;
+    simd_kernels.viscosity_terms = viscosity_terms_neon;
+    simd_kernels.relaxation_terms = relaxation_terms_neon;
+#elif defined(__arm__)
+    // The original Raspberry Pi does not have NEON
+    if(getauxval(AT_HWCAP) & HWCAP_NEON) {
+        simd_kernels.isa = "neon";
+        simd_kernels.density_terms = density_terms_neon;
+        simd_kernels.geometry_terms = geometry_terms_neon;
+        simd_kernels.viscosity_terms = viscosity_terms_neon;
+        simd_kernels.relaxation_terms = relaxation_terms_neon;
+    }
+#endif
+
+    debug_print("Using %s pair kernels\n", simd_kernels.isa);
+}
+
+// Pad lanes count through SIMD_BATCH-1 with a neighbor outside of the smoothing radius
+// Padded lanes produce zero pair terms and are never applied
+void pad_batch(simd_batch_t *batch, int count, float p_x, float p_y, float p_v_x, float p_v_y, param *params)
+{
+    int i;
+    float h = params->tunable_params.smoothing_radius;
+
+    for(i=count; i<SIMD_BATCH; i++) {
+        batch->q_x[i] = p_x + 2.0f*h;
+        batch->q_y[i] = p_y;
+        batch->q_v_x[i] = p_v_x;
+        batch->q_v_y[i] = p_v_y;
+        batch->q_pressure[i] = 0.0f;
+        batch->q_pressure_near[i] = 0.0f;
+        batch->r[i] = 2.0f*h;
+        batch->u_x[i] = 1.0f;
+        batch->u_y[i] = 0.0f;
+        batch->OmR[i] = -1.0f;
+    }
+}
+
+////////////////////////////////////////////////
+// Scalar kernels
+// These define the operation order the vector kernels must match
+////////////////////////////////////////////////
+
+// Squared distance and density contributions, zero contribution outside of the smoothing radius
+void density_terms_scalar(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float d_x, d_y, r2, ratio, OmR;
+    float h_recip = 1.0f/params->tunable_params.smoothing_radius;
+
+    for(i=0; i<SIMD_BATCH; i++) {
+        d_x = p_x - batch->q_x[i];
+        d_y = p_y - batch->q_y[i];
+        r2 = d_x*d_x + d_y*d_y;
+        ratio = sqrtf(r2)*h_recip;
+        OmR = 1.0f - ratio;
+        OmR = OmR > 0.0f ? OmR : 0.0f;
+        batch->r2[i] = r2;
+        batch->w[i] = OmR*OmR;
+        batch->w_near[i] = OmR*OmR*OmR;
+    }
+}
+
+// Pair geometry along with the squared distance and density contributions of density_terms
+void geometry_terms_scalar(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float QmP_x, QmP_y, r2, r, r_recip, OmR, c;
+    float h_recip = 1.0f/params->tunable_params.smoothing_radius;
+
+    for(i=0; i<SIMD_BATCH; i++) {
+        QmP_x = batch->q_x[i] - p_x;
+        QmP_y = batch->q_y[i] - p_y;
+        r2 = QmP_x*QmP_x + QmP_y*QmP_y;
+        r = sqrtf(r2);
+        r_recip = 1.0f/r;
+        OmR = 1.0f - r*h_recip;
+        c = OmR > 0.0f ? OmR : 0.0f;
+        batch->r2[i] = r2;
+        batch->w[i] = c*c;
+        batch->w_near[i] = c*c*c;
+        batch->r[i] = r;
+        batch->u_x[i] = QmP_x*r_recip;
+        batch->u_y[i] = QmP_y*r_recip;
+        batch->OmR[i] = OmR;
+    }
+}
+
+// Viscosity impulse on each neighbor, zero if the pair is not approaching or is outside of the smoothing radius
+void viscosity_terms_scalar(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float QmP_x, QmP_y, r, r_recip, ratio, u, imp, imp_x, imp_y;
+    float h_recip = 1.0f/params->tunable_params.smoothing_radius;
+    float sigma = params->tunable_params.sigma;
+    float beta = params->tunable_params.beta;
+    float dt = params->tunable_params.time_step;
+
+    for(i=0; i<SIMD_BATCH; i++) {
+        QmP_x = batch->q_x[i] - p_x;
+        QmP_y = batch->q_y[i] - p_y;
+        r = sqrtf(QmP_x*QmP_x + QmP_y*QmP_y);
+        r_recip = 1.0f/r;
+        ratio = r*h_recip;
+
+        //Inward radial velocity
+        u = ((p_v_x - batch->q_v_x[i])*QmP_x + (p_v_y - batch->q_v_y[i])*QmP_y)*r_recip;
+        imp_x = 0.0f;
+        imp_y = 0.0f;
+        if(u > 0.0f && ratio < 1.0f) {
+            imp = dt*(1.0f-ratio)*(sigma*u + beta*u*u);
+            imp_x = imp*QmP_x*r_recip;
+            imp_y = imp*QmP_y*r_recip;
+            checkVelocity(&imp_x, &imp_y);
+        }
+        batch->out_x[i] = imp_x;
+        batch->out_y[i] = imp_y;
+    }
+}
+
+// Relaxation displacement of each neighbor, zero outside of the smoothing radius
+// Returns the number of neighbors clustered on top of p
+int relaxation_terms_scalar(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params)
+{
+    int i, clustered;
+    float QmP_x, QmP_y, r, r_recip, ratio, OmR, D;
+    float h = params->tunable_params.smoothing_radius;
+    float h_recip = 1.0f/h;
+    float dt = params->tunable_params.time_step;
+    float k_spring = params->tunable_params.k_spring;
+
+    clustered = 0;
+    for(i=0; i<SIMD_BATCH; i++) {
+        QmP_x = batch->q_x[i] - p_x;
+        QmP_y = batch->q_y[i] - p_y;
+        r = sqrtf(QmP_x*QmP_x + QmP_y*QmP_y);
+        r_recip = 1.0f/r;
+        ratio = r*h_recip;
+        OmR = 1.0f - ratio;
+
+        if(r <= 0.000001f)
+            clustered++;
+
+        batch->out_x[i] = 0.0f;
+        batch->out_y[i] = 0.0f;
+        if(ratio < 1.0f && r > 0.0f) {
+            D = dt*dt*((p_pressure+batch->q_pressure[i])*OmR + (p_pressure_near+batch->q_pressure_near[i])*OmR*OmR + k_spring*(h-r)*0.5f);
+            batch->out_x[i] = D*QmP_x*r_recip;
+            batch->out_y[i] = D*QmP_y*r_recip;
+        }
+    }
+
+    return clustered;
+}
+
+// Viscosity impulse from cached pair geometry
+void viscosity_terms_cached_scalar(float p_v_x, float p_v_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float u, imp, imp_x, imp_y;
+    float sigma = params->tunable_params.sigma;
+    float beta = params->tunable_params.beta;
+    float dt = params->tunable_params.time_step;
+
+    for(i=0; i<SIMD_BATCH; i++) {
+        //Inward radial velocity
+        u = (p_v_x - batch->q_v_x[i])*batch->u_x[i] + (p_v_y - batch->q_v_y[i])*batch->u_y[i];
+        imp_x = 0.0f;
+        imp_y = 0.0f;
+        if(u > 0.0f && batch->OmR[i] > 0.0f) {
+            imp = dt*batch->OmR[i]*(sigma*u + beta*u*u);
+            imp_x = imp*batch->u_x[i];
+            imp_y = imp*batch->u_y[i];
+            checkVelocity(&imp_x, &imp_y);
+        }
+        batch->out_x[i] = imp_x;
+        batch->out_y[i] = imp_y;
+    }
+}
+
+// Relaxation displacement from cached pair geometry
+int relaxation_terms_cached_scalar(float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params)
+{
+    int i, clustered;
+    float r, OmR, D;
+    float h = params->tunable_params.smoothing_radius;
+    float dt = params->tunable_params.time_step;
+    float k_spring = params->tunable_params.k_spring;
+
+    clustered = 0;
+    for(i=0; i<SIMD_BATCH; i++) {
+        r = batch->r[i];
+        OmR = batch->OmR[i];
+
+        if(r <= 0.000001f)
+            clustered++;
+
+        batch->out_x[i] = 0.0f;
+        batch->out_y[i] = 0.0f;
+        if(OmR > 0.0f && r > 0.0f) {
+            D = dt*dt*((p_pressure+batch->q_pressure[i])*OmR + (p_pressure_near+batch->q_pressure_near[i])*OmR*OmR + k_spring*(h-r)*0.5f);
+            batch->out_x[i] = D*batch->u_x[i];
+            batch->out_y[i] = D*batch->u_y[i];
+        }
+    }
+
+    return clustered;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+////////////////////////////////////////////////
+// SSE kernels, two 4 wide passes per batch
+////////////////////////////////////////////////
+
+__attribute__((target("sse2")))
+void density_terms_sse(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    __m128 d_x, d_y, r2, ratio, OmR, w;
+    __m128 x = _mm_set1_ps(p_x);
+    __m128 y = _mm_set1_ps(p_y);
+    __m128 h_recip = _mm_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        d_x = _mm_sub_ps(x, _mm_loadu_ps(&batch->q_x[i]));
+        d_y = _mm_sub_ps(y, _mm_loadu_ps(&batch->q_y[i]));
+        r2 = _mm_add_ps(_mm_mul_ps(d_x, d_x), _mm_mul_ps(d_y, d_y));
+        ratio = _mm_mul_ps(_mm_sqrt_ps(r2), h_recip);
+        OmR = _mm_max_ps(_mm_sub_ps(one, ratio), zero);
+        w = _mm_mul_ps(OmR, OmR);
+        _mm_storeu_ps(&batch->r2[i], r2);
+        _mm_storeu_ps(&batch->w[i], w);
+        _mm_storeu_ps(&batch->w_near[i], _mm_mul_ps(w, OmR));
+    }
+}
+
+__attribute__((target("sse2")))
+void geometry_terms_sse(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    __m128 QmP_x, QmP_y, r2, r, r_recip, OmR, c, w;
+    __m128 x = _mm_set1_ps(p_x);
+    __m128 y = _mm_set1_ps(p_y);
+    __m128 h_recip = _mm_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        QmP_x = _mm_sub_ps(_mm_loadu_ps(&batch->q_x[i]), x);
+        QmP_y = _mm_sub_ps(_mm_loadu_ps(&batch->q_y[i]), y);
+        r2 = _mm_add_ps(_mm_mul_ps(QmP_x, QmP_x), _mm_mul_ps(QmP_y, QmP_y));
+        r = _mm_sqrt_ps(r2);
+        r_recip = _mm_div_ps(one, r);
+        OmR = _mm_sub_ps(one, _mm_mul_ps(r, h_recip));
+        c = _mm_max_ps(OmR, zero);
+        w = _mm_mul_ps(c, c);
+        _mm_storeu_ps(&batch->r2[i], r2);
+        _mm_storeu_ps(&batch->w[i], w);
+        _mm_storeu_ps(&batch->w_near[i], _mm_mul_ps(w, c));
+        _mm_storeu_ps(&batch->r[i], r);
+        _mm_storeu_ps(&batch->u_x[i], _mm_mul_ps(QmP_x, r_recip));
+        _mm_storeu_ps(&batch->u_y[i], _mm_mul_ps(QmP_y, r_recip));
+        _mm_storeu_ps(&batch->OmR[i], OmR);
+    }
+}
+
+__attribute__((target("sse2")))
+void viscosity_terms_sse(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    __m128 QmP_x, QmP_y, r, r_recip, ratio, u, imp, imp_x, imp_y, approaching;
+    __m128 x = _mm_set1_ps(p_x);
+    __m128 y = _mm_set1_ps(p_y);
+    __m128 v_x = _mm_set1_ps(p_v_x);
+    __m128 v_y = _mm_set1_ps(p_v_y);
+    __m128 h_recip = _mm_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m128 sigma = _mm_set1_ps(params->tunable_params.sigma);
+    __m128 beta = _mm_set1_ps(params->tunable_params.beta);
+    __m128 dt = _mm_set1_ps(params->tunable_params.time_step);
+    __m128 v_max = _mm_set1_ps(5.0f);
+    __m128 v_min = _mm_set1_ps(-5.0f);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        QmP_x = _mm_sub_ps(_mm_loadu_ps(&batch->q_x[i]), x);
+        QmP_y = _mm_sub_ps(_mm_loadu_ps(&batch->q_y[i]), y);
+        r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(QmP_x, QmP_x), _mm_mul_ps(QmP_y, QmP_y)));
+        r_recip = _mm_div_ps(one, r);
+        ratio = _mm_mul_ps(r, h_recip);
+
+        u = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(v_x, _mm_loadu_ps(&batch->q_v_x[i])), QmP_x),
+                                  _mm_mul_ps(_mm_sub_ps(v_y, _mm_loadu_ps(&batch->q_v_y[i])), QmP_y)), r_recip);
+        approaching = _mm_and_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(ratio, one));
+
+        imp = _mm_mul_ps(_mm_mul_ps(dt, _mm_sub_ps(one, ratio)),
+                         _mm_add_ps(_mm_mul_ps(sigma, u), _mm_mul_ps(_mm_mul_ps(beta, u), u)));
+        imp_x = _mm_mul_ps(_mm_mul_ps(imp, QmP_x), r_recip);
+        imp_y = _mm_mul_ps(_mm_mul_ps(imp, QmP_y), r_recip);
+        imp_x = _mm_max_ps(_mm_min_ps(imp_x, v_max), v_min);
+        imp_y = _mm_max_ps(_mm_min_ps(imp_y, v_max), v_min);
+
+        _mm_storeu_ps(&batch->out_x[i], _mm_and_ps(imp_x, approaching));
+        _mm_storeu_ps(&batch->out_y[i], _mm_and_ps(imp_y, approaching));
+    }
+}
+
+__attribute__((target("sse2")))
+int relaxation_terms_sse(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params)
+{
+    int i, clustered;
+    __m128 QmP_x, QmP_y, r, r_recip, ratio, OmR, D, in_range;
+    __m128 x = _mm_set1_ps(p_x);
+    __m128 y = _mm_set1_ps(p_y);
+    __m128 pressure = _mm_set1_ps(p_pressure);
+    __m128 pressure_near = _mm_set1_ps(p_pressure_near);
+    __m128 h = _mm_set1_ps(params->tunable_params.smoothing_radius);
+    __m128 h_recip = _mm_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m128 dt = _mm_set1_ps(params->tunable_params.time_step);
+    __m128 k_spring = _mm_set1_ps(params->tunable_params.k_spring);
+    __m128 cluster_r = _mm_set1_ps(0.000001f);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 zero = _mm_setzero_ps();
+
+    clustered = 0;
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        QmP_x = _mm_sub_ps(_mm_loadu_ps(&batch->q_x[i]), x);
+        QmP_y = _mm_sub_ps(_mm_loadu_ps(&batch->q_y[i]), y);
+        r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(QmP_x, QmP_x), _mm_mul_ps(QmP_y, QmP_y)));
+        r_recip = _mm_div_ps(one, r);
+        ratio = _mm_mul_ps(r, h_recip);
+        OmR = _mm_sub_ps(one, ratio);
+
+        clustered += __builtin_popcount(_mm_movemask_ps(_mm_cmple_ps(r, cluster_r)));
+        in_range = _mm_and_ps(_mm_cmplt_ps(ratio, one), _mm_cmpgt_ps(r, zero));
+
+        D = _mm_add_ps(_mm_mul_ps(_mm_add_ps(pressure, _mm_loadu_ps(&batch->q_pressure[i])), OmR),
+                       _mm_mul_ps(_mm_mul_ps(_mm_add_ps(pressure_near, _mm_loadu_ps(&batch->q_pressure_near[i])), OmR), OmR));
+        D = _mm_add_ps(D, _mm_mul_ps(_mm_mul_ps(k_spring, _mm_sub_ps(h, r)), half));
+        D = _mm_mul_ps(_mm_mul_ps(dt, dt), D);
+
+        _mm_storeu_ps(&batch->out_x[i], _mm_and_ps(_mm_mul_ps(_mm_mul_ps(D, QmP_x), r_recip), in_range));
+        _mm_storeu_ps(&batch->out_y[i], _mm_and_ps(_mm_mul_ps(_mm_mul_ps(D, QmP_y), r_recip), in_range));
+    }
+
+    return clustered;
+}
+
+////////////////////////////////////////////////
+// AVX2 kernels, one 8 wide pass per batch
+// FMA is intentionally not enabled so results match the scalar kernels
+////////////////////////////////////////////////
+
+__attribute__((target("avx2")))
+void density_terms_avx2(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    __m256 d_x, d_y, r2, ratio, OmR, w;
+    __m256 x = _mm256_set1_ps(p_x);
+    __m256 y = _mm256_set1_ps(p_y);
+    __m256 h_recip = _mm256_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+
+    d_x = _mm256_sub_ps(x, _mm256_loadu_ps(batch->q_x));
+    d_y = _mm256_sub_ps(y, _mm256_loadu_ps(batch->q_y));
+    r2 = _mm256_add_ps(_mm256_mul_ps(d_x, d_x), _mm256_mul_ps(d_y, d_y));
+    ratio = _mm256_mul_ps(_mm256_sqrt_ps(r2), h_recip);
+    OmR = _mm256_max_ps(_mm256_sub_ps(one, ratio), zero);
+    w = _mm256_mul_ps(OmR, OmR);
+    _mm256_storeu_ps(batch->r2, r2);
+    _mm256_storeu_ps(batch->w, w);
+    _mm256_storeu_ps(batch->w_near, _mm256_mul_ps(w, OmR));
+}
+
+__attribute__((target("avx2")))
+void geometry_terms_avx2(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    __m256 QmP_x, QmP_y, r2, r, r_recip, OmR, c, w;
+    __m256 x = _mm256_set1_ps(p_x);
+    __m256 y = _mm256_set1_ps(p_y);
+    __m256 h_recip = _mm256_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+
+    QmP_x = _mm256_sub_ps(_mm256_loadu_ps(batch->q_x), x);
+    QmP_y = _mm256_sub_ps(_mm256_loadu_ps(batch->q_y), y);
+    r2 = _mm256_add_ps(_mm256_mul_ps(QmP_x, QmP_x), _mm256_mul_ps(QmP_y, QmP_y));
+    r = _mm256_sqrt_ps(r2);
+    r_recip = _mm256_div_ps(one, r);
+    OmR = _mm256_sub_ps(one, _mm256_mul_ps(r, h_recip));
+    c = _mm256_max_ps(OmR, zero);
+    w = _mm256_mul_ps(c, c);
+    _mm256_storeu_ps(batch->r2, r2);
+    _mm256_storeu_ps(batch->w, w);
+    _mm256_storeu_ps(batch->w_near, _mm256_mul_ps(w, c));
+    _mm256_storeu_ps(batch->r, r);
+    _mm256_storeu_ps(batch->u_x, _mm256_mul_ps(QmP_x, r_recip));
+    _mm256_storeu_ps(batch->u_y, _mm256_mul_ps(QmP_y, r_recip));
+    _mm256_storeu_ps(batch->OmR, OmR);
+}
+
+__attribute__((target("avx2")))
+void viscosity_terms_avx2(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params)
+{
+    __m256 QmP_x, QmP_y, r, r_recip, ratio, u, imp, imp_x, imp_y, approaching;
+    __m256 x = _mm256_set1_ps(p_x);
+    __m256 y = _mm256_set1_ps(p_y);
+    __m256 v_x = _mm256_set1_ps(p_v_x);
+    __m256 v_y = _mm256_set1_ps(p_v_y);
+    __m256 h_recip = _mm256_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m256 sigma = _mm256_set1_ps(params->tunable_params.sigma);
+    __m256 beta = _mm256_set1_ps(params->tunable_params.beta);
+    __m256 dt = _mm256_set1_ps(params->tunable_params.time_step);
+    __m256 v_max = _mm256_set1_ps(5.0f);
+    __m256 v_min = _mm256_set1_ps(-5.0f);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+
+    QmP_x = _mm256_sub_ps(_mm256_loadu_ps(batch->q_x), x);
+    QmP_y = _mm256_sub_ps(_mm256_loadu_ps(batch->q_y), y);
+    r = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(QmP_x, QmP_x), _mm256_mul_ps(QmP_y, QmP_y)));
+    r_recip = _mm256_div_ps(one, r);
+    ratio = _mm256_mul_ps(r, h_recip);
+
+    u = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v_x, _mm256_loadu_ps(batch->q_v_x)), QmP_x),
+                                    _mm256_mul_ps(_mm256_sub_ps(v_y, _mm256_loadu_ps(batch->q_v_y)), QmP_y)), r_recip);
+    approaching = _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(ratio, one, _CMP_LT_OQ));
+
+    imp = _mm256_mul_ps(_mm256_mul_ps(dt, _mm256_sub_ps(one, ratio)),
+                        _mm256_add_ps(_mm256_mul_ps(sigma, u), _mm256_mul_ps(_mm256_mul_ps(beta, u), u)));
+    imp_x = _mm256_mul_ps(_mm256_mul_ps(imp, QmP_x), r_recip);
+    imp_y = _mm256_mul_ps(_mm256_mul_ps(imp, QmP_y), r_recip);
+    imp_x = _mm256_max_ps(_mm256_min_ps(imp_x, v_max), v_min);
+    imp_y = _mm256_max_ps(_mm256_min_ps(imp_y, v_max), v_min);
+
+    _mm256_storeu_ps(batch->out_x, _mm256_and_ps(imp_x, approaching));
+    _mm256_storeu_ps(batch->out_y, _mm256_and_ps(imp_y, approaching));
+}
+
+__attribute__((target("avx2")))
+int relaxation_terms_avx2(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params)
+{
+    __m256 QmP_x, QmP_y, r, r_recip, ratio, OmR, D, in_range;
+    __m256 x = _mm256_set1_ps(p_x);
+    __m256 y = _mm256_set1_ps(p_y);
+    __m256 pressure = _mm256_set1_ps(p_pressure);
+    __m256 pressure_near = _mm256_set1_ps(p_pressure_near);
+    __m256 h = _mm256_set1_ps(params->tunable_params.smoothing_radius);
+    __m256 h_recip = _mm256_set1_ps(1.0f/params->tunable_params.smoothing_radius);
+    __m256 dt = _mm256_set1_ps(params->tunable_params.time_step);
+    __m256 k_spring = _mm256_set1_ps(params->tunable_params.k_spring);
+    __m256 cluster_r = _mm256_set1_ps(0.000001f);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+
+    QmP_x = _mm256_sub_ps(_mm256_loadu_ps(batch->q_x), x);
+    QmP_y = _mm256_sub_ps(_mm256_loadu_ps(batch->q_y), y);
+    r = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(QmP_x, QmP_x), _mm256_mul_ps(QmP_y, QmP_y)));
+    r_recip = _mm256_div_ps(one, r);
+    ratio = _mm256_mul_ps(r, h_recip);
+    OmR = _mm256_sub_ps(one, ratio);
+
+    in_range = _mm256_and_ps(_mm256_cmp_ps(ratio, one, _CMP_LT_OQ), _mm256_cmp_ps(r, zero, _CMP_GT_OQ));
+
+    D = _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(pressure, _mm256_loadu_ps(batch->q_pressure)), OmR),
+                      _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(pressure_near, _mm256_loadu_ps(batch->q_pressure_near)), OmR), OmR));
+    D = _mm256_add_ps(D, _mm256_mul_ps(_mm256_mul_ps(k_spring, _mm256_sub_ps(h, r)), half));
+    D = _mm256_mul_ps(_mm256_mul_ps(dt, dt), D);
+
+    _mm256_storeu_ps(batch->out_x, _mm256_and_ps(_mm256_mul_ps(_mm256_mul_ps(D, QmP_x), r_recip), in_range));
+    _mm256_storeu_ps(batch->out_y, _mm256_and_ps(_mm256_mul_ps(_mm256_mul_ps(D, QmP_y), r_recip), in_range));
+
+    return __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(r, cluster_r, _CMP_LE_OQ)));
+}
+
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+
+////////////////////////////////////////////////
+// NEON kernels, two 4 wide passes per batch
+// ARMv7 NEON has no vector sqrt or divide so refined estimates are used,
+// these match the scalar kernels to within a few ulp rather than exactly
+////////////////////////////////////////////////
+
+#if defined(__arm__) && !defined(__aarch64__)
+#pragma GCC push_options
+#pragma GCC target("fpu=neon")
+#endif
+
+#include <arm_neon.h>
+
+#if defined(__aarch64__)
+#define neon_sqrt(a) vsqrtq_f32(a)
+#define neon_recip(a) vdivq_f32(vdupq_n_f32(1.0f), a)
+#else
+static inline float32x4_t neon_sqrt(float32x4_t a)
+{
+    float32x4_t rsqrt = vrsqrteq_f32(a);
+    rsqrt = vmulq_f32(rsqrt, vrsqrtsq_f32(vmulq_f32(a, rsqrt), rsqrt));
+    rsqrt = vmulq_f32(rsqrt, vrsqrtsq_f32(vmulq_f32(a, rsqrt), rsqrt));
+    // sqrt(0) would otherwise be 0*inf
+    return vbslq_f32(vceqq_f32(a, vdupq_n_f32(0.0f)), a, vmulq_f32(a, rsqrt));
+}
+
+static inline float32x4_t neon_recip(float32x4_t a)
+{
+    float32x4_t recip = vrecpeq_f32(a);
+    recip = vmulq_f32(recip, vrecpsq_f32(a, recip));
+    recip = vmulq_f32(recip, vrecpsq_f32(a, recip));
+    return recip;
+}
+#endif
+
+#define neon_and(a, mask) vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a), mask))
+
+void density_terms_neon(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float32x4_t d_x, d_y, r2, ratio, OmR, w;
+    float32x4_t x = vdupq_n_f32(p_x);
+    float32x4_t y = vdupq_n_f32(p_y);
+    float32x4_t h_recip = vdupq_n_f32(1.0f/params->tunable_params.smoothing_radius);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        d_x = vsubq_f32(x, vld1q_f32(&batch->q_x[i]));
+        d_y = vsubq_f32(y, vld1q_f32(&batch->q_y[i]));
+        r2 = vaddq_f32(vmulq_f32(d_x, d_x), vmulq_f32(d_y, d_y));
+        ratio = vmulq_f32(neon_sqrt(r2), h_recip);
+        OmR = vmaxq_f32(vsubq_f32(one, ratio), zero);
+        w = vmulq_f32(OmR, OmR);
+        vst1q_f32(&batch->r2[i], r2);
+        vst1q_f32(&batch->w[i], w);
+        vst1q_f32(&batch->w_near[i], vmulq_f32(w, OmR));
+    }
+}
+
+void geometry_terms_neon(float p_x, float p_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float32x4_t QmP_x, QmP_y, r2, r, r_recip, OmR, c, w;
+    float32x4_t x = vdupq_n_f32(p_x);
+    float32x4_t y = vdupq_n_f32(p_y);
+    float32x4_t h_recip = vdupq_n_f32(1.0f/params->tunable_params.smoothing_radius);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        QmP_x = vsubq_f32(vld1q_f32(&batch->q_x[i]), x);
+        QmP_y = vsubq_f32(vld1q_f32(&batch->q_y[i]), y);
+        r2 = vaddq_f32(vmulq_f32(QmP_x, QmP_x), vmulq_f32(QmP_y, QmP_y));
+        r = neon_sqrt(r2);
+        r_recip = neon_recip(r);
+        OmR = vsubq_f32(one, vmulq_f32(r, h_recip));
+        c = vmaxq_f32(OmR, zero);
+        w = vmulq_f32(c, c);
+        vst1q_f32(&batch->r2[i], r2);
+        vst1q_f32(&batch->w[i], w);
+        vst1q_f32(&batch->w_near[i], vmulq_f32(w, c));
+        vst1q_f32(&batch->r[i], r);
+        vst1q_f32(&batch->u_x[i], vmulq_f32(QmP_x, r_recip));
+        vst1q_f32(&batch->u_y[i], vmulq_f32(QmP_y, r_recip));
+        vst1q_f32(&batch->OmR[i], OmR);
+    }
+}
+
+void viscosity_terms_neon(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params)
+{
+    int i;
+    float32x4_t QmP_x, QmP_y, r, r_recip, ratio, u, imp, imp_x, imp_y;
+    uint32x4_t approaching;
+    float32x4_t x = vdupq_n_f32(p_x);
+    float32x4_t y = vdupq_n_f32(p_y);
+    float32x4_t v_x = vdupq_n_f32(p_v_x);
+    float32x4_t v_y = vdupq_n_f32(p_v_y);
+    float32x4_t h_recip = vdupq_n_f32(1.0f/params->tunable_params.smoothing_radius);
+    float32x4_t sigma = vdupq_n_f32(params->tunable_params.sigma);
+    float32x4_t beta = vdupq_n_f32(params->tunable_params.beta);
+    float32x4_t dt = vdupq_n_f32(params->tunable_params.time_step);
+    float32x4_t v_max = vdupq_n_f32(5.0f);
+    float32x4_t v_min = vdupq_n_f32(-5.0f);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        QmP_x = vsubq_f32(vld1q_f32(&batch->q_x[i]), x);
+        QmP_y = vsubq_f32(vld1q_f32(&batch->q_y[i]), y);
+        r = neon_sqrt(vaddq_f32(vmulq_f32(QmP_x, QmP_x), vmulq_f32(QmP_y, QmP_y)));
+        r_recip = neon_recip(r);
+        ratio = vmulq_f32(r, h_recip);
+
+        u = vmulq_f32(vaddq_f32(vmulq_f32(vsubq_f32(v_x, vld1q_f32(&batch->q_v_x[i])), QmP_x),
+                                vmulq_f32(vsubq_f32(v_y, vld1q_f32(&batch->q_v_y[i])), QmP_y)), r_recip);
+        approaching = vandq_u32(vcgtq_f32(u, zero), vcltq_f32(ratio, one));
+
+        imp = vmulq_f32(vmulq_f32(dt, vsubq_f32(one, ratio)),
+                        vaddq_f32(vmulq_f32(sigma, u), vmulq_f32(vmulq_f32(beta, u), u)));
+        imp_x = vmulq_f32(vmulq_f32(imp, QmP_x), r_recip);
+        imp_y = vmulq_f32(vmulq_f32(imp, QmP_y), r_recip);
+        imp_x = vmaxq_f32(vminq_f32(imp_x, v_max), v_min);
+        imp_y = vmaxq_f32(vminq_f32(imp_y, v_max), v_min);
+
+        vst1q_f32(&batch->out_x[i], neon_and(imp_x, approaching));
+        vst1q_f32(&batch->out_y[i], neon_and(imp_y, approaching));
+    }
+}
+
+int relaxation_terms_neon(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params)
+{
+    int i, clustered;
+    float32x4_t QmP_x, QmP_y, r, r_recip, ratio, OmR, D;
+    uint32x4_t in_range, close;
+    float32x4_t x = vdupq_n_f32(p_x);
+    float32x4_t y = vdupq_n_f32(p_y);
+    float32x4_t pressure = vdupq_n_f32(p_pressure);
+    float32x4_t pressure_near = vdupq_n_f32(p_pressure_near);
+    float32x4_t h = vdupq_n_f32(params->tunable_params.smoothing_radius);
+    float32x4_t h_recip = vdupq_n_f32(1.0f/params->tunable_params.smoothing_radius);
+    float32x4_t dt = vdupq_n_f32(params->tunable_params.time_step);
+    float32x4_t k_spring = vdupq_n_f32(params->tunable_params.k_spring);
+    float32x4_t cluster_r = vdupq_n_f32(0.000001f);
+    float32x4_t half = vdupq_n_f32(0.5f);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+
+    clustered = 0;
+    for(i=0; i<SIMD_BATCH; i+=4) {
+        QmP_x = vsubq_f32(vld1q_f32(&batch->q_x[i]), x);
+        QmP_y = vsubq_f32(vld1q_f32(&batch->q_y[i]), y);
+        r = neon_sqrt(vaddq_f32(vmulq_f32(QmP_x, QmP_x), vmulq_f32(QmP_y, QmP_y)));
+        r_recip = neon_recip(r);
+        ratio = vmulq_f32(r, h_recip);
+        OmR = vsubq_f32(one, ratio);
+
+        // Each lane of close is 1 if clustered
+        close = vshrq_n_u32(vcleq_f32(r, cluster_r), 31);
+        clustered += vgetq_lane_u32(close, 0) + vgetq_lane_u32(close, 1) + vgetq_lane_u32(close, 2) + vgetq_lane_u32(close, 3);
+        in_range = vandq_u32(vcltq_f32(ratio, one), vcgtq_f32(r, zero));
+
+        D = vaddq_f32(vmulq_f32(vaddq_f32(pressure, vld1q_f32(&batch->q_pressure[i])), OmR),
+                      vmulq_f32(vmulq_f32(vaddq_f32(pressure_near, vld1q_f32(&batch->q_pressure_near[i])), OmR), OmR));
+        D = vaddq_f32(D, vmulq_f32(vmulq_f32(k_spring, vsubq_f32(h, r)), half));
+        D = vmulq_f32(vmulq_f32(dt, dt), D);
+
+        vst1q_f32(&batch->out_x[i], neon_and(vmulq_f32(vmulq_f32(D, QmP_x), r_recip), in_range));
+        vst1q_f32(&batch->out_y[i], neon_and(vmulq_f32(vmulq_f32(D, QmP_y), r_recip), in_range));
+    }
+
+    return clustered;
+}
+
+#if defined(__arm__) && !defined(__aarch64__)
+#pragma GCC pop_options
+#endif
+
+#endif
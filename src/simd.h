@@ -0,0 +1,101 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Adam Simpson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef fluid_simd_h
+#define fluid_simd_h
+
+typedef struct SIMD_BATCH_T simd_batch_t;
+typedef struct SIMD_KERNELS_T simd_kernels_t;
+
+#include "fluid.h"
+
+// Number of neighbors processed per kernel call
+// This is the same for every ISA so results don't depend on the ISA selected
+#define SIMD_BATCH 8
+
+// Neighbor values gathered for a batch along with the computed pair terms
+// Lanes past the number of neighbors are padded by pad_batch()
+struct SIMD_BATCH_T {
+    float q_x[SIMD_BATCH];
+    float q_y[SIMD_BATCH];
+    float q_v_x[SIMD_BATCH];
+    float q_v_y[SIMD_BATCH];
+    float q_pressure[SIMD_BATCH];
+    float q_pressure_near[SIMD_BATCH];
+    float r2[SIMD_BATCH];     // Squared distance
+    float w[SIMD_BATCH];      // Density contribution
+    float w_near[SIMD_BATCH]; // Near density contribution
+    float out_x[SIMD_BATCH];  // Viscosity impulse or relaxation displacement
+    float out_y[SIMD_BATCH];
+    float r[SIMD_BATCH];      // Pair geometry, computed by geometry_terms or read from the pair cache
+    float u_x[SIMD_BATCH];    // Unit vector from p to q
+    float u_y[SIMD_BATCH];
+    float OmR[SIMD_BATCH];    // 1 - r/h
+};
+
+// Pair kernels for the selected ISA
+// Every implementation performs the same float operations in the same order
+struct SIMD_KERNELS_T {
+    const char *isa;
+    void (*density_terms)(float p_x, float p_y, simd_batch_t *batch, param *params);
+    void (*geometry_terms)(float p_x, float p_y, simd_batch_t *batch, param *params);
+    void (*viscosity_terms)(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+    int (*relaxation_terms)(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+    // Kernels reading cached pair geometry, these have no sqrt or divide
+    void (*viscosity_terms_cached)(float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+    int (*relaxation_terms_cached)(float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+};
+
+extern simd_kernels_t simd_kernels;
+
+void init_simd_kernels();
+void pad_batch(simd_batch_t *batch, int count, float p_x, float p_y, float p_v_x, float p_v_y, param *params);
+
+void density_terms_scalar(float p_x, float p_y, simd_batch_t *batch, param *params);
+void geometry_terms_scalar(float p_x, float p_y, simd_batch_t *batch, param *params);
+void viscosity_terms_cached_scalar(float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+int relaxation_terms_cached_scalar(float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+void viscosity_terms_scalar(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+int relaxation_terms_scalar(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+
+#if defined(__x86_64__) || defined(__i386__)
+void density_terms_sse(float p_x, float p_y, simd_batch_t *batch, param *params);
+void geometry_terms_sse(float p_x, float p_y, simd_batch_t *batch, param *params);
+void viscosity_terms_sse(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+int relaxation_terms_sse(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+void density_terms_avx2(float p_x, float p_y, simd_batch_t *batch, param *params);
+void geometry_terms_avx2(float p_x, float p_y, simd_batch_t *batch, param *params);
+void viscosity_terms_avx2(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+int relaxation_terms_avx2(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+void density_terms_neon(float p_x, float p_y, simd_batch_t *batch, param *params);
+void geometry_terms_neon(float p_x, float p_y, simd_batch_t *batch, param *params);
+void viscosity_terms_neon(float p_x, float p_y, float p_v_x, float p_v_y, simd_batch_t *batch, param *params);
+int relaxation_terms_neon(float p_x, float p_y, float p_pressure, float p_pressure_near, simd_batch_t *batch, param *params);
+#endif
+
+#endif
@@ -0,0 +1,385 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Adam Simpson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include "threads.h"
+#include "fluid.h"
+#include "communication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+thread_pool_t thread_pool;
+progress_thread_t progress_thread;
+
+// Divide the cores of this node evenly among the compute ranks running on it
+// Ranks are laid out one per core today so this returns 1 unless fewer ranks are started
+// Cores used by the non-compute ranks on the node are left to them, see create_communicators()
+// A rank running a progress thread leaves it a core, so init_progress_thread() must be called first
+int default_thread_count()
+{
+    int number_ranks, number_threads;
+    long number_cores;
+    MPI_Comm node_comm;
+
+    MPI_Comm_split_type(MPI_COMM_COMPUTE, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &number_ranks);
+    MPI_Comm_free(&node_comm);
+
+    number_cores = sysconf(_SC_NPROCESSORS_ONLN) - host_noncompute_ranks;
+    number_threads = number_cores / number_ranks;
+    if(progress_thread.enabled)
+        number_threads--;
+
+    return number_threads > 1 ? number_threads : 1;
+}
+
+void init_thread_pool(int number_threads)
+{
+    int i;
+
+    thread_pool.number_threads = number_threads > 1 ? number_threads : 1;
+    thread_pool.generation = 0;
+    thread_pool.number_busy = 0;
+    thread_pool.shutdown = false;
+    pthread_mutex_init(&thread_pool.lock, NULL);
+    pthread_cond_init(&thread_pool.work_ready, NULL);
+    pthread_cond_init(&thread_pool.work_done, NULL);
+
+    thread_pool.workers = malloc(thread_pool.number_threads * sizeof(pthread_t));
+    thread_pool.queues = malloc(thread_pool.number_threads * sizeof(task_queue_t));
+    if(thread_pool.workers == NULL || thread_pool.queues == NULL)
+        printf("Could not allocate thread pool\n");
+
+    for(i=0; i<thread_pool.number_threads; i++)
+        pthread_mutex_init(&thread_pool.queues[i].lock, NULL);
+
+    // Workers are numbered from 1 as the calling thread runs tasks from queue 0
+    for(i=1; i<thread_pool.number_threads; i++) {
+        if(pthread_create(&thread_pool.workers[i], NULL, thread_pool_worker, (void*)(long)i)) {
+            printf("Could not create thread pool worker\n");
+            break;
+        }
+    }
+    // Run with whatever workers could be started
+    thread_pool.number_threads = i;
+    thread_pool.number_blocks = thread_pool.number_threads > 1 ? BLOCKS_PER_THREAD*thread_pool.number_threads : 1;
+
+    debug_print("Thread pool using %d threads\n", thread_pool.number_threads);
+}
+
+void free_thread_pool()
+{
+    int i;
+
+    pthread_mutex_lock(&thread_pool.lock);
+    thread_pool.shutdown = true;
+    pthread_cond_broadcast(&thread_pool.work_ready);
+    pthread_mutex_unlock(&thread_pool.lock);
+
+    for(i=1; i<thread_pool.number_threads; i++)
+        pthread_join(thread_pool.workers[i], NULL);
+
+    for(i=0; i<thread_pool.number_threads; i++)
+        pthread_mutex_destroy(&thread_pool.queues[i].lock);
+
+    free(thread_pool.workers);
+    free(thread_pool.queues);
+    pthread_mutex_destroy(&thread_pool.lock);
+    pthread_cond_destroy(&thread_pool.work_ready);
+    pthread_cond_destroy(&thread_pool.work_done);
+}
+
+// Items begin through end-1 of number_items split evenly into number_blocks blocks
+void block_range(int block, int number_blocks, int number_items, int *begin, int *end)
+{
+    *begin = (long)block*number_items/number_blocks;
+    *end = (long)(block+1)*number_items/number_blocks;
+}
+
+// Take the next task from the threads own queue or steal half of the tasks left in another queue
+// Returns false once every queue is empty
+bool claim_task(int thread, int *task)
+{
+    int i, victim, remaining, stolen;
+    task_queue_t *queue = &thread_pool.queues[thread];
+    task_queue_t *victim_queue;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->next < queue->end) {
+        *task = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    for(i=1; i<thread_pool.number_threads; i++) {
+        victim = (thread + i) % thread_pool.number_threads;
+        victim_queue = &thread_pool.queues[victim];
+
+        pthread_mutex_lock(&victim_queue->lock);
+        remaining = victim_queue->end - victim_queue->next;
+        if(remaining == 0) {
+            pthread_mutex_unlock(&victim_queue->lock);
+            continue;
+        }
+        // Steal from the back so the victim keeps the tasks next to the one it is running
+        stolen = (remaining+1)/2;
+        victim_queue->end -= stolen;
+        *task = victim_queue->end;
+        pthread_mutex_unlock(&victim_queue->lock);
+
+        // Run the first stolen task now and queue the rest
+        pthread_mutex_lock(&queue->lock);
+        queue->next = *task + 1;
+        queue->end = *task + stolen;
+        pthread_mutex_unlock(&queue->lock);
+
+        return true;
+    }
+
+    return false;
+}
+
+// Run tasks until none are left to claim or steal
+void run_thread_tasks(int thread)
+{
+    int task;
+
+    while(claim_task(thread, &task))
+        thread_pool.task(thread_pool.args, task);
+}
+
+void *thread_pool_worker(void *thread)
+{
+    unsigned int generation = 0;
+
+    while(1) {
+        pthread_mutex_lock(&thread_pool.lock);
+        while(thread_pool.generation == generation && !thread_pool.shutdown)
+            pthread_cond_wait(&thread_pool.work_ready, &thread_pool.lock);
+        if(thread_pool.shutdown) {
+            pthread_mutex_unlock(&thread_pool.lock);
+            break;
+        }
+        generation = thread_pool.generation;
+        pthread_mutex_unlock(&thread_pool.lock);
+
+        run_thread_tasks((long)thread);
+
+        pthread_mutex_lock(&thread_pool.lock);
+        if(--thread_pool.number_busy == 0)
+            pthread_cond_signal(&thread_pool.work_done);
+        pthread_mutex_unlock(&thread_pool.lock);
+    }
+
+    return NULL;
+}
+
+// Run task(args, 0) through task(args, number_tasks-1) across the pool and wait for them to finish
+// Each thread is first given a contiguous range of tasks so neighboring tasks tend to run on the same thread
+void run_tasks(thread_task_t task, void *args, int number_tasks)
+{
+    int i;
+
+    if(thread_pool.number_threads == 1 || number_tasks == 1) {
+        for(i=0; i<number_tasks; i++)
+            task(args, i);
+        return;
+    }
+
+    pthread_mutex_lock(&thread_pool.lock);
+    thread_pool.task = task;
+    thread_pool.args = args;
+    for(i=0; i<thread_pool.number_threads; i++)
+        block_range(i, thread_pool.number_threads, number_tasks, &thread_pool.queues[i].next, &thread_pool.queues[i].end);
+    thread_pool.number_busy = thread_pool.number_threads-1;
+    thread_pool.generation++;
+    pthread_cond_broadcast(&thread_pool.work_ready);
+    pthread_mutex_unlock(&thread_pool.lock);
+
+    run_thread_tasks(0);
+
+    pthread_mutex_lock(&thread_pool.lock);
+    while(thread_pool.number_busy > 0)
+        pthread_cond_wait(&thread_pool.work_done, &thread_pool.lock);
+    pthread_mutex_unlock(&thread_pool.lock);
+}
+
+// Start the progress thread if requested and the MPI library allows MPI calls from more than one thread
+void init_progress_thread(bool enabled)
+{
+    int provided;
+
+    MPI_Query_thread(&provided);
+    if(enabled && provided != MPI_THREAD_MULTIPLE) {
+        printf("MPI_THREAD_MULTIPLE not provided, running without a progress thread\n");
+        enabled = false;
+    }
+
+    progress_thread.enabled = enabled;
+    progress_thread.number_open = 0;
+    progress_thread.number_requests = 0;
+    progress_thread.shutdown = false;
+    if(!enabled)
+        return;
+
+    pthread_mutex_init(&progress_thread.lock, NULL);
+    pthread_cond_init(&progress_thread.work_ready, NULL);
+    pthread_cond_init(&progress_thread.requests_done, NULL);
+
+    // Duplicating MPI_COMM_SELF is local so ranks do not have to agree on whether the thread is enabled
+    MPI_Comm_dup(MPI_COMM_SELF, &progress_thread.comm);
+
+    if(pthread_create(&progress_thread.thread, NULL, progress_thread_main, NULL)) {
+        printf("Could not create progress thread\n");
+        MPI_Comm_free(&progress_thread.comm);
+        pthread_mutex_destroy(&progress_thread.lock);
+        pthread_cond_destroy(&progress_thread.work_ready);
+        pthread_cond_destroy(&progress_thread.requests_done);
+        progress_thread.enabled = false;
+        return;
+    }
+
+    debug_print("Progress thread started\n");
+}
+
+void free_progress_thread()
+{
+    if(!progress_thread.enabled)
+        return;
+
+    pthread_mutex_lock(&progress_thread.lock);
+    progress_thread.shutdown = true;
+    pthread_cond_signal(&progress_thread.work_ready);
+    pthread_mutex_unlock(&progress_thread.lock);
+
+    pthread_join(progress_thread.thread, NULL);
+
+    MPI_Comm_free(&progress_thread.comm);
+    pthread_mutex_destroy(&progress_thread.lock);
+    pthread_cond_destroy(&progress_thread.work_ready);
+    pthread_cond_destroy(&progress_thread.requests_done);
+    progress_thread.enabled = false;
+}
+
+// Communication has been started that should progress while this thread computes
+// Windows may be nested, messages are progressed until every window is closed
+void begin_progress()
+{
+    if(!progress_thread.enabled)
+        return;
+
+    pthread_mutex_lock(&progress_thread.lock);
+    if(progress_thread.number_open++ == 0)
+        pthread_cond_signal(&progress_thread.work_ready);
+    pthread_mutex_unlock(&progress_thread.lock);
+}
+
+// Called before waiting on the communication started with the matching begin_progress()
+void end_progress()
+{
+    if(!progress_thread.enabled)
+        return;
+
+    pthread_mutex_lock(&progress_thread.lock);
+    progress_thread.number_open--;
+    pthread_mutex_unlock(&progress_thread.lock);
+}
+
+// Hand started requests to the progress thread, which tests them and closes their window once they complete
+// The callers requests are set to MPI_REQUEST_NULL, end_progress_requests() waits for the thread to complete them
+// Without a progress thread the caller keeps its requests and must wait on them itself
+void begin_progress_requests(MPI_Request *requests, int number_requests)
+{
+    int i;
+
+    if(!progress_thread.enabled)
+        return;
+
+    pthread_mutex_lock(&progress_thread.lock);
+    if(progress_thread.number_requests + number_requests > MAX_PROGRESS_REQUESTS) {
+        pthread_mutex_unlock(&progress_thread.lock);
+        printf("Too many requests handed to the progress thread\n");
+        return;
+    }
+    for(i=0; i<number_requests; i++) {
+        progress_thread.requests[progress_thread.number_requests++] = requests[i];
+        requests[i] = MPI_REQUEST_NULL;
+    }
+    if(progress_thread.number_open++ == 0)
+        pthread_cond_signal(&progress_thread.work_ready);
+    pthread_mutex_unlock(&progress_thread.lock);
+}
+
+// Wait for the requests handed over by begin_progress_requests() to complete
+void end_progress_requests()
+{
+    if(!progress_thread.enabled)
+        return;
+
+    pthread_mutex_lock(&progress_thread.lock);
+    while(progress_thread.number_requests > 0)
+        pthread_cond_wait(&progress_thread.requests_done, &progress_thread.lock);
+    pthread_mutex_unlock(&progress_thread.lock);
+}
+
+void *progress_thread_main(void *args)
+{
+    int flag;
+    struct timespec interval = {0, PROGRESS_INTERVAL*1000};
+
+    while(1) {
+        pthread_mutex_lock(&progress_thread.lock);
+        while(progress_thread.number_open == 0 && !progress_thread.shutdown)
+            pthread_cond_wait(&progress_thread.work_ready, &progress_thread.lock);
+        if(progress_thread.shutdown) {
+            pthread_mutex_unlock(&progress_thread.lock);
+            break;
+        }
+
+        // Testing the handed over requests also enters the progress engine, their window closes as soon as they complete
+        // The lock is held so the main thread can't hand over more requests while they are tested
+        if(progress_thread.number_requests > 0) {
+            MPI_Testall(progress_thread.number_requests, progress_thread.requests, &flag, MPI_STATUSES_IGNORE);
+            if(flag) {
+                progress_thread.number_requests = 0;
+                progress_thread.number_open--;
+                pthread_cond_broadcast(&progress_thread.requests_done);
+            }
+            pthread_mutex_unlock(&progress_thread.lock);
+        }
+        else {
+            pthread_mutex_unlock(&progress_thread.lock);
+
+            // Nothing is ever sent on this communicator, the probe only enters the progress engine
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, progress_thread.comm, &flag, MPI_STATUS_IGNORE);
+        }
+
+        // Leave the core to the thread pool between probes
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,111 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Adam Simpson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef fluid_threads_h
+#define fluid_threads_h
+
+typedef struct THREAD_POOL_T thread_pool_t;
+typedef struct TASK_QUEUE_T task_queue_t;
+typedef struct PROGRESS_THREAD_T progress_thread_t;
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "mpi.h"
+
+// A task is run once for each task index passed to run_tasks()
+typedef void (*thread_task_t)(void *args, int task);
+
+// Work is split into this many blocks per thread so idle threads have blocks to steal
+#define BLOCKS_PER_THREAD 4
+
+// Tasks next through end-1 are waiting to be run
+// The owning thread runs tasks from the front and other threads steal from the back
+struct TASK_QUEUE_T {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+};
+
+// Pool of worker threads used within a compute rank
+// The thread calling run_tasks() also runs tasks so a pool of one thread has no workers
+// Each thread starts with a contiguous range of the tasks and steals from the others once its own range is done
+struct THREAD_POOL_T {
+    int number_threads;        // Workers plus the calling thread
+    int number_blocks;         // Blocks that work should be split into
+    pthread_t *workers;
+    task_queue_t *queues;      // Queue of each thread, the calling thread is 0
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready; // Signaled when tasks are submitted or the pool is shut down
+    pthread_cond_t work_done;  // Signaled when the last worker finishes its tasks
+    unsigned int generation;   // Incremented each time tasks are submitted
+    int number_busy;           // Workers that have not finished the current tasks
+    bool shutdown;
+    thread_task_t task;
+    void *args;
+};
+
+// Microseconds the progress thread sleeps between entries into the MPI progress engine
+#define PROGRESS_INTERVAL 20
+
+// Most requests handed to the progress thread at once
+#define MAX_PROGRESS_REQUESTS 4
+
+// Thread that keeps messages moving while the compute rank computes
+// Many MPI libraries only move a message when its rank calls into MPI, so without it an overlapped send may not leave until it is waited on
+// The main thread opens a window after starting communication and closes it before waiting, the thread only polls while a window is open
+// Otherwise the thread probes a private communicator which enters the progress engine of the whole library
+// Requests handed over with begin_progress_requests() belong to the thread, which closes their window as soon as they complete
+struct PROGRESS_THREAD_T {
+    bool enabled;           // Requires MPI_THREAD_MULTIPLE
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready; // Signaled when the first window opens or the thread is shut down
+    pthread_cond_t requests_done; // Signaled when the handed over requests complete
+    int number_open;        // Windows currently open
+    bool shutdown;
+    MPI_Comm comm;
+    MPI_Request requests[MAX_PROGRESS_REQUESTS]; // Requests handed over by begin_progress_requests()
+    int number_requests;
+};
+
+extern thread_pool_t thread_pool;
+extern progress_thread_t progress_thread;
+
+int default_thread_count();
+void init_thread_pool(int number_threads);
+void free_thread_pool();
+void run_tasks(thread_task_t task, void *args, int number_tasks);
+void block_range(int block, int number_blocks, int number_items, int *begin, int *end);
+bool claim_task(int thread, int *task);
+void run_thread_tasks(int thread);
+void *thread_pool_worker(void *thread);
+void init_progress_thread(bool enabled);
+void free_progress_thread();
+void begin_progress();
+void end_progress();
+void begin_progress_requests(MPI_Request *requests, int number_requests);
+void end_progress_requests();
+void *progress_thread_main(void *args);
+
+#endif